@@ -22,21 +22,43 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "instrumentation.h"
 
 // The data structure
 //
-// An image is stored in a structure containing 3 fields:
+// An image is stored in a structure containing 5 fields:
 // Two integers store the image width and height.
 // The other field is a pointer to an array that stores the 8-bit gray
 // level of each pixel in the image.  The pixel array is one-dimensional
-// and corresponds to a "raster scan" of the image from left to right,
-// top to bottom.
+// and, in the default LAYOUT_RASTER, corresponds to a "raster scan" of the
+// image from left to right, top to bottom.
 // For example, in a 100-pixel wide image (img->width == 100),
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
 //   pixel position (x,y) = (22,1) is stored in img->pixel[122].
+// In LAYOUT_TILED, the array is a raster scan of 64x64 tiles, and each
+// tile is itself a 4096-byte raster scan.  Tiles at the right and bottom
+// edges are padded to full size.  See pixIndex for the exact mapping.
+// An image may also be a view of a rectangle of another image: it then
+// shares that image's pixel array, and its pixel (x,y) is stored where
+// the other image's pixel (x0+x,y0+y) is.  The stride field holds the
+// width of the image that owns the array, which is what pixIndex needs.
+// Pixel arrays are reference counted: clones (see ImageClone) share one
+// array until any of them is modified, and then that one gets its own copy
+// (copy-on-write).  An array shared by clones never has views, and vice
+// versa, so writing through a view never needs to copy.
 // 
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -50,7 +72,13 @@ struct image {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
-  uint8* pixel; // pixel data (a raster scan)
+  Layout layout; // memory layout of the pixel array
+  uint8* pixel; // pixel data (a raster scan, or tiles)
+  int stride;   // width of the image that owns the pixel array
+  int x0, y0;   // position of pixel (0,0) in the owner (0,0 if not a view)
+  Image owner;  // image that owns the pixel array, if this is a view
+  atomic_int views;  // number of views of the pixel array (in the owner)
+  struct cache* cache;  // derived data, or NULL (see Caches; never in views)
 };
 
 
@@ -73,11 +101,15 @@ struct image {
 //
 // Additional information:  man 3 errno;  man 3 error;
 
+// Error state is kept per thread, so that independent threads (for
+// instance, one reading images while another processes them) do not
+// disturb each other's error reports.
+
 // Variable to preserve errno temporarily
-static int errsave = 0;
+static _Thread_local int errsave = 0;
 
 // Error cause
-static char* errCause;
+static _Thread_local char* errCause;
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -87,6 +119,7 @@ static char* errCause;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
+/// The error cause is kept per thread.
 char* ImageErrMsg() { ///
   return errCause;
 }
@@ -141,10 +174,11 @@ static int check(int condition, const char* failmsg) {
 }
 
 
-/// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
-void ImageInit(void) { ///
+// Library initialization, done once (see ImageInit).
+static void initOnce(void) {
+#if INSTR_LEVEL > 0
   InstrCalibrate();
+#endif
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
   // Name other counters here...
   InstrName[1] = "NumComparacoes";
@@ -152,47 +186,646 @@ void ImageInit(void) { ///
   
 }
 
+/// Init Image library.
+/// Currently, simply calibrate instrumentation and set names of counters.
+/// Only the first call has any effect, and it is safe to call from
+/// several threads (all return when initialization is complete).
+void ImageInit(void) { ///
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, initOnce);
+}
+
 // Macros to simplify accessing instrumentation counters:
+// (These are the counters of the calling thread: see instrumentation.h.)
 #define PIXMEM InstrCount[0]
 // Add more macros here...
 
 #define NUMCOMP InstrCount[1]
 #define NUMOPERACOES InstrCount[2]
 
-// TIP: Search for PIXMEM or InstrCount to see where it is incremented!
+// Counters are only updated through COUNT (in bulk operations, once per
+// call) and COUNT_ACCESS (for each single pixel access), so that the
+// instrumentation level can be chosen at compile time (-DINSTR_LEVEL=n):
+//   0: off: no counting at all (and no calibration in ImageInit);
+//   1: coarse: COUNT only;
+//   2: full: COUNT and COUNT_ACCESS (the default).
+// Disabled counts compile to nothing, but are still type-checked.
+#ifndef INSTR_LEVEL
+#define INSTR_LEVEL 2
+#endif
+
+#if INSTR_LEVEL >= 1
+#define COUNT(counter, n) ((void)((counter) += (n)))
+#else
+#define COUNT(counter, n) ((void)sizeof((counter) += (n)))
+#endif
+
+#if INSTR_LEVEL >= 2
+#define COUNT_ACCESS(counter, n) ((void)((counter) += (n)))
+#else
+#define COUNT_ACCESS(counter, n) ((void)sizeof((counter) += (n)))
+#endif
+
+// TIP: Search for COUNT to see where counters are incremented!
+
+
+// Pixel memory layouts
+
+// Bytes of the header of pixel arrays (see newPixels).
+#define PIXHDR 16
+
+// Tiles of LAYOUT_TILED are TSIDE x TSIDE pixels.
+#define TSHIFT 6
+#define TSIDE (1 << TSHIFT)
+#define TMASK (TSIDE - 1)
+
+// Number of tiles needed to cover n pixels.
+static inline int tilesFor(int n) {
+  return (n + TMASK) >> TSHIFT;
+}
+
+// Can the pixel array of a w x h image with given layout be allocated
+// without overflowing size_t?  (Only a concern for 32-bit size_t, or for
+// the padding of tiles, but then failing is better than wrapping around.)
+static int pixFits(int w, int h, Layout layout) {
+  size_t limit = SIZE_MAX - PIXHDR;
+  if (layout == LAYOUT_TILED) {
+    w = tilesFor(w);
+    h = tilesFor(h);
+    limit >>= 2*TSHIFT;
+  }
+  return h == 0 || (size_t)w <= limit / (size_t)h;
+}
+
+// Number of pixels in the pixel array of a w x h image with given layout.
+// Requires pixFits(w, h, layout).
+static size_t pixCount(int w, int h, Layout layout) {
+  if (layout == LAYOUT_TILED) {
+    return ((size_t)tilesFor(w) * tilesFor(h)) << (2*TSHIFT);
+  }
+  return (size_t)w * h;
+}
+
+// Index of pixel (x,y) in the pixel array of a w-wide image with layout.
+// (Indices are size_t: images may have more than INT_MAX pixels.)
+static inline size_t pixIndex(int w, Layout layout, int x, int y) {
+  if (layout == LAYOUT_TILED) {
+    size_t tile = (size_t)(y >> TSHIFT) * tilesFor(w) + (x >> TSHIFT);
+    return (((tile << TSHIFT) | (y & TMASK)) << TSHIFT) | (x & TMASK);
+  }
+  return (size_t)y*w + x;
+}
+
+// Reference counted pixel arrays.
+//
+// The counter lives in a PIXHDR-byte header just before the pixels (which
+// keeps them as aligned as malloc would).  It is atomic, so that clones may
+// be released by other threads.  The header also keeps the array size.
+// Arrays of HUGEMIN bytes or more are mapped directly, and marked for
+// transparent huge pages where the system supports them: gigapixel images
+// then need far fewer TLB entries.  Mapped memory is already zeroed, and
+// only gets physical pages as they are touched.
+
+typedef struct {
+  atomic_int refs;
+  size_t size;      // bytes in the block, header included
+} PixHeader;
+
+#define HUGEMIN ((size_t)4 << 20)
+
+static inline atomic_int* pixRefs(uint8* pixel) {
+  return &((PixHeader*)(pixel - PIXHDR))->refs;
+}
+
+// Allocate an array of n zeroed pixels, with one reference.
+// Returns NULL on failure.
+static uint8* newPixels(size_t n) {
+  size_t size = PIXHDR + n;
+  uint8* block;
+  if (size >= HUGEMIN) {
+    block = (uint8*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise(block, size, MADV_HUGEPAGE);  // just advice: failure is harmless
+#endif
+  } else {
+    block = (uint8*)calloc(size, sizeof(uint8));
+    if (block == NULL) return NULL;
+  }
+  PixHeader* hdr = (PixHeader*)block;
+  atomic_init(&hdr->refs, 1);
+  hdr->size = size;
+  return block + PIXHDR;
+}
+
+// Drop one reference to pixel array, freeing it if it was the last.
+static void releasePixels(uint8* pixel) {
+  if (atomic_fetch_sub(pixRefs(pixel), 1) == 1) {
+    PixHeader* hdr = (PixHeader*)(pixel - PIXHDR);
+    if (hdr->size >= HUGEMIN) {
+      munmap(hdr, hdr->size);
+    } else {
+      free(hdr);
+    }
+  }
+}
+
+// Is the pixel array of img shared with clones?
+static inline int shared(Image img) {
+  return img->owner == NULL && atomic_load(pixRefs(img->pixel)) > 1;
+}
+
+// Make sure the pixel array of img is not shared with clones, giving img
+// its own copy if needed (copy-on-write).  Call before modifying pixels.
+// Returns 0 on failure (and errCause is set), leaving img unchanged.
+static int ownPixels(Image img) {
+  if (!shared(img)) return 1;
+  size_t n = pixCount(img->width, img->height, img->layout);
+  uint8* pixel = newPixels(n);
+  if (!check( pixel != NULL, "Copying shared pixel array failed" )) return 0;
+  memcpy(pixel, img->pixel, n);
+  COUNT(PIXMEM, 2ul * n);  // count pixel memory accesses
+  releasePixels(img->pixel);
+  img->pixel = pixel;
+  return 1;
+}
+
+// Index of pixel (x,y) of img (which may be a view) in its pixel array.
+static inline size_t pixAt(Image img, int x, int y) {
+  x += img->x0;
+  y += img->y0;
+  if (img->layout == LAYOUT_TILED) {
+    return pixIndex(img->stride, LAYOUT_TILED, x, y);
+  }
+  return (size_t)y*img->stride + x;
+}
+
+// Row access for bulk kernels.
+//
+// The n pixels (x..x+n-1, y) of a row are contiguous in a raster image,
+// but split into runs of up to TSIDE pixels in a tiled image.
+// getRow/putRow copy such a row segment out of / into the image.
+// readRow returns a pointer to the segment: straight into the raster, or
+// gathered into buf (n bytes) for tiled images.  A segment obtained with
+// readRow may be modified and stored back with writeRow, which does
+// nothing when row already points into the raster.
+// They do not count pixel memory accesses (callers do), so they may be
+// used from worker threads.
+
+static void getRow(Image img, int x, int y, int n, uint8* dst) {
+  if (img->layout == LAYOUT_RASTER) {
+    memcpy(dst, img->pixel + pixAt(img, x, y), n);
+    return;
+  }
+  while (n > 0) {
+    int run = TSIDE - ((img->x0 + x) & TMASK);
+    if (run > n) run = n;
+    memcpy(dst, img->pixel + pixAt(img, x, y), run);
+    dst += run; x += run; n -= run;
+  }
+}
+
+static void putRow(Image img, int x, int y, int n, const uint8* src) {
+  if (img->layout == LAYOUT_RASTER) {
+    memmove(img->pixel + pixAt(img, x, y), src, n);
+    return;
+  }
+  while (n > 0) {
+    int run = TSIDE - ((img->x0 + x) & TMASK);
+    if (run > n) run = n;
+    memcpy(img->pixel + pixAt(img, x, y), src, run);
+    src += run; x += run; n -= run;
+  }
+}
+
+static uint8* readRow(Image img, int x, int y, int n, uint8* buf) {
+  if (img->layout == LAYOUT_RASTER) {
+    return img->pixel + pixAt(img, x, y);
+  }
+  getRow(img, x, y, n, buf);
+  return buf;
+}
+
+static void writeRow(Image img, int x, int y, int n, const uint8* row) {
+  if (img->layout == LAYOUT_RASTER && row == img->pixel + pixAt(img, x, y)) {
+    return;
+  }
+  putRow(img, x, y, n, row);
+}
+
+
+// Caches
+//
+// An image (not a view) may keep data derived from its pixels, built on
+// first request and then kept up to date incrementally: the histogram
+// (ImageHistogram, also used by ImageStats), the integral image
+// (ImageIntegral) and the last blurred copy (ImageBlurred).
+// Every operation that modifies pixels first calls touch with the
+// rectangle it is about to change (writes through a view touch its
+// owner); changing the whole image simply drops the cache.  Then:
+//   the histogram stops counting the pixels of a list of dirty rectangles
+//   (touch subtracts their old levels, once), and counts their new levels
+//   when next requested;
+//   the integral image is stale below and to the right of corner (sx,sy);
+//   the blurred copy keeps its own list of dirty rectangles, and only
+//   recomputes those, grown by the filter halo.
+// Lists of more than DIRTYMAX rectangles are merged into their bounding box.
+
+#define DIRTYMAX 8
+
+typedef struct {
+  int x0, y0, x1, y1;     // [x0,x1[ x [y0,y1[
+} Rect;
+
+typedef struct {
+  int n;
+  Rect r[DIRTYMAX];
+} Dirty;
+
+struct cache {
+  int hvalid;             // hist counts all pixels outside hdirty
+  Dirty hdirty;
+  uint64_t hist[256];
+  int64_t* sat;           // integral image, or NULL
+  int sx, sy;             // sat is stale from column sx and row sy on
+  Image blur;             // blurred copy, or NULL
+  int bdx, bdy;           // its filter
+  Dirty bdirty;           // and its stale rectangles
+};
+
+static Rect rectUnion(Rect a, Rect b) {
+  Rect u = a;
+  if (b.x0 < u.x0) u.x0 = b.x0;
+  if (b.y0 < u.y0) u.y0 = b.y0;
+  if (b.x1 > u.x1) u.x1 = b.x1;
+  if (b.y1 > u.y1) u.y1 = b.y1;
+  return u;
+}
+
+// Add rectangle r to list d, merging all into one if it is full.
+static void dirtyAdd(Dirty* d, Rect r) {
+  if (d->n == DIRTYMAX) {
+    for (int i = 0; i < DIRTYMAX; i++) r = rectUnion(r, d->r[i]);
+    d->n = 0;
+  }
+  d->r[d->n++] = r;
+}
+
+// Find the parts of row y, within [x0,x1), covered by the rectangles of d.
+// Stores them as disjoint intervals [iv[i][0],iv[i][1]), in order, and
+// returns their number.
+static int rowCover(const Dirty* d, int y, int x0, int x1, int iv[DIRTYMAX][2]) {
+  int n = 0;
+  for (int i = 0; i < d->n; i++) {
+    const Rect* r = &d->r[i];
+    int a = (r->x0 > x0) ? r->x0 : x0;
+    int b = (r->x1 < x1) ? r->x1 : x1;
+    if (y < r->y0 || y >= r->y1 || a >= b) continue;
+    int j = n++;  // insert, sorted by start
+    for (; j > 0 && iv[j-1][0] > a; j--) {
+      iv[j][0] = iv[j-1][0];
+      iv[j][1] = iv[j-1][1];
+    }
+    iv[j][0] = a;
+    iv[j][1] = b;
+  }
+  int m = 0;  // merge overlapping intervals
+  for (int i = 0; i < n; i++) {
+    if (m > 0 && iv[i][0] <= iv[m-1][1]) {
+      if (iv[i][1] > iv[m-1][1]) iv[m-1][1] = iv[i][1];
+    } else {
+      iv[m][0] = iv[i][0];
+      iv[m][1] = iv[i][1];
+      m++;
+    }
+  }
+  return m;
+}
+
+// Count (add > 0) or uncount (add < 0) the levels of pixels [x0,x1) of
+// row y of img in hist.
+static void histRun(Image img, uint64_t hist[256], int y, int x0, int x1, int add) {
+  uint8 buf[TSIDE];
+  for (int x = x0; x < x1; x += TSIDE) {
+    int n = (x1 - x < TSIDE) ? x1 - x : TSIDE;
+    const uint8* row = readRow(img, x, y, n, buf);
+    if (add > 0) {
+      for (int i = 0; i < n; i++) hist[row[i]]++;
+    } else {
+      for (int i = 0; i < n; i++) hist[row[i]]--;
+    }
+  }
+}
+
+static void dropCache(Image img) {
+  struct cache* c = img->cache;
+  if (c == NULL) return;
+  free(c->sat);
+  ImageDestroy(&c->blur);
+  free(c);
+  img->cache = NULL;
+}
+
+// Get the cache of img (not a view), creating an empty one if needed.
+// Returns NULL on failure (and errCause is set).
+static struct cache* getCache(Image img) {
+  if (img->cache == NULL) {
+    check( (img->cache = (struct cache*)calloc(1, sizeof(struct cache))) != NULL,
+           "Allocating image cache failed" );
+  }
+  return img->cache;
+}
+
+// Record that the pixels in rectangle (x,y,w,h) of img are about to change.
+// Must be called before they do: the histogram needs their old levels.
+static void touch(Image img, int x, int y, int w, int h) {
+  if (img->owner != NULL) {
+    x += img->x0;
+    y += img->y0;
+    img = img->owner;
+  }
+  struct cache* c = img->cache;
+  if (c == NULL || w <= 0 || h <= 0) return;
+  if (w == img->width && h == img->height) {
+    dropCache(img);
+    return;
+  }
+  Rect r = { x, y, x + w, y + h };
+  if (c->blur != NULL) dirtyAdd(&c->bdirty, r);
+  if (x < c->sx) c->sx = x;
+  if (y < c->sy) c->sy = y;
+  if (!c->hvalid) return;
+  if (c->hdirty.n == DIRTYMAX) {  // the list will be replaced by its box
+    for (int i = 0; i < DIRTYMAX; i++) r = rectUnion(r, c->hdirty.r[i]);
+  }
+  if (r.x1 - r.x0 == img->width && r.y1 - r.y0 == img->height) {
+    c->hvalid = 0;  // cheaper to count again
+    return;
+  }
+  // Uncount the pixels of r that are not already left out.
+  int iv[DIRTYMAX][2];
+  for (int yy = r.y0; yy < r.y1; yy++) {
+    int m = rowCover(&c->hdirty, yy, r.x0, r.x1, iv);
+    int xx = r.x0;
+    for (int i = 0; i < m; i++) {
+      histRun(img, c->hist, yy, xx, iv[i][0], -1);
+      xx = iv[i][1];
+    }
+    histRun(img, c->hist, yy, xx, r.x1, -1);
+  }
+  COUNT(PIXMEM, (unsigned long)(r.x1 - r.x0) * (r.y1 - r.y0));  // (at most)
+  if (c->hdirty.n == DIRTYMAX) c->hdirty.n = 0;
+  c->hdirty.r[c->hdirty.n++] = r;
+}
+
+static void touchAll(Image img) {
+  touch(img, 0, 0, img->width, img->height);
+}
+
+
+// Give img the pixels of dst, an image of the same size and layout
+// (which is left with img's old pixels, or unchanged, for destruction).
+// Arrays are swapped, unless the array of img is shared with views: then
+// the pixels are copied into it.
+static void adoptPixels(Image img, Image dst) {
+  touchAll(img);
+  if (img->owner == NULL && img->views == 0) {
+    uint8* pixel = img->pixel;
+    img->pixel = dst->pixel;
+    dst->pixel = pixel;
+    return;
+  }
+  uint8 buf[TSIDE];
+  for (int y = 0; y < img->height; y++) {
+    for (int x = 0; x < img->width; x += TSIDE) {
+      int n = (img->width - x < TSIDE) ? img->width - x : TSIDE;
+      putRow(img, x, y, n, readRow(dst, x, y, n, buf));
+    }
+  }
+}
+
+
+// Parallel execution
+//
+// parallelRows runs fn(arg, worker, y0, y1) over disjoint row ranges
+// [y0,y1) covering [0,h), concurrently, and returns when all are done.
+// worker is in [0, parallelWorkers()), and no two ranges run at the same
+// time with the same worker, so it may select per-worker scratch memory
+// or partial results.  A worker may get several ranges, in any order.
+// Jobs costing less than PARMIN (roughly, pixels processed) run serially
+// in the calling thread, as worker 0, in a single range.
+// Tasks that redo some work at the start of each range (a window of rows
+// above it, say) use parallelRowsGrain to keep ranges at least minGrain
+// rows long.
+// Tasks may use the instrumentation counters: each thread has its own,
+// and the counts of pool threads are flushed to the shared totals at the
+// end of each job, or dropped if the job was started while the caller had
+// instrMuted set.  (Most kernels simply count in the caller, once per call.)
+//
+// The workers are a persistent pool of threads, started when first needed
+// (the calling thread is worker 0).  Rows are cut into chunks of at least
+// PARGRAIN cost, about PARSPLIT per worker; each worker starts with an
+// equal share of consecutive chunks, takes them from the front, and when
+// it runs out steals chunks from the back of the others.  The pool runs
+// one job at a time: a job started while it is busy (by another thread,
+// or by a task) runs serially.  Tasks must not depend on how rows are
+// split, so results are always the same as serial ones.
+
+#define PARMAX 64         // maximum number of workers
+#define PARMIN (1 << 16)  // minimum cost worth splitting
+#define PARGRAIN (1 << 14)  // minimum cost of a chunk
+#define PARSPLIT 8        // chunks per worker, for balance
+
+typedef void (*RowTask)(void* arg, int worker, int y0, int y1);
+
+typedef struct {
+  RowTask fn;
+  void* arg;
+  int h, grain;           // rows, and rows per chunk
+  int nw;                 // workers taking part
+  int muted;              // drop the counts of pool threads
+  // Chunks [lo,hi) left to each worker, packed as lo << 32 | hi
+  _Atomic uint64_t range[PARMAX];
+} Job;
+
+// Set while the calling thread runs work that should not be counted.
+static _Thread_local int instrMuted = 0;
+
+// Number of workers: set by ImageSetThreads, or from the environment
+// variable IMAGE8BIT_THREADS, or else one per online processor.
+static atomic_int workers = 0;
+
+static int parallelWorkers(void) {
+  if (atomic_load(&workers) == 0) {
+    const char* env = getenv("IMAGE8BIT_THREADS");
+    long n = (env != NULL) ? strtol(env, NULL, 10) : 0;
+    if (n < 1) n = sysconf(_SC_NPROCESSORS_ONLN);
+    atomic_store(&workers, (n < 1) ? 1 : (n > PARMAX) ? PARMAX : (int)n);
+  }
+  return atomic_load(&workers);
+}
+
+// Take chunk from the front (own == 1) or the back of range r.
+// Returns the chunk, or -1 if the range is empty.
+static int takeChunk(_Atomic uint64_t* r, int own) {
+  uint64_t v = atomic_load(r);
+  for (;;) {
+    uint32_t lo = (uint32_t)(v >> 32), hi = (uint32_t)v;
+    if (lo >= hi) return -1;
+    uint64_t nv = own ? ((uint64_t)(lo + 1) << 32 | hi) : ((uint64_t)lo << 32 | (hi - 1));
+    if (atomic_compare_exchange_weak(r, &v, nv)) return own ? (int)lo : (int)(hi - 1);
+  }
+}
+
+// Run chunks of job as worker, until there are none left.
+static void runJob(Job* job, int worker) {
+  for (;;) {
+    int c = takeChunk(&job->range[worker], 1);
+    for (int i = 1; c < 0 && i < job->nw; i++) {  // steal
+      c = takeChunk(&job->range[(worker + i) % job->nw], 0);
+    }
+    if (c < 0) return;
+    int y0 = c * job->grain;
+    int y1 = (job->h - y0 < job->grain) ? job->h : y0 + job->grain;
+    job->fn(job->arg, worker, y0, y1);
+  }
+}
+
+// The pool.  poolLock is held by the thread running a job; the other
+// fields are protected by poolMutex.
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;
+static int poolThreads = 0;         // threads started: workers 1..poolThreads
+static unsigned long poolGen = 0;   // incremented for each job
+static Job* poolJob = NULL;         // current job
+static int poolNeed = 0;            // workers taking part in it
+static int poolBusy = 0;            // pool threads still working on it
+
+static void* poolWorker(void* p) {
+  int worker = (int)(intptr_t)p;
+  unsigned long seen = 0;
+  pthread_mutex_lock(&poolMutex);
+  for (;;) {
+    while (poolGen == seen) pthread_cond_wait(&poolWake, &poolMutex);
+    seen = poolGen;
+    if (worker >= poolNeed) continue;  // not needed for this job
+    Job* job = poolJob;
+    pthread_mutex_unlock(&poolMutex);
+    runJob(job, worker);
+    if (job->muted) {
+      memset(InstrCount, 0, sizeof(InstrCount));
+    } else {
+      InstrFlush();
+    }
+    pthread_mutex_lock(&poolMutex);
+    if (--poolBusy == 0) pthread_cond_signal(&poolDone);
+  }
+  return NULL;
+}
+
+static void parallelRowsGrain(int h, size_t cost, size_t minGrain, RowTask fn, void* arg) {
+  int nw = parallelWorkers();
+  if (nw > h) nw = h;
+  if (nw <= 1 || cost < PARMIN || pthread_mutex_trylock(&poolLock) != 0) {
+    if (h > 0) fn(arg, 0, 0, h);
+    return;
+  }
+  // Start the pool threads still missing (fewer, if that fails).
+  while (poolThreads < nw - 1) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, poolWorker, (void*)(intptr_t)(poolThreads + 1)) != 0) break;
+    pthread_detach(tid);
+    poolThreads++;
+  }
+  if (nw > poolThreads + 1) nw = poolThreads + 1;
+
+  // Chunk size: about PARSPLIT chunks per worker, of at least PARGRAIN cost.
+  size_t rowCost = cost / h + 1;
+  size_t grain = (size_t)h / ((size_t)nw * PARSPLIT);
+  size_t costGrain = (PARGRAIN + rowCost - 1) / rowCost;
+  if (grain < costGrain) grain = costGrain;
+  if (grain < minGrain) grain = minGrain;
+  if (grain < 1) grain = 1;
+  Job job;
+  job.fn = fn;
+  job.arg = arg;
+  job.h = h;
+  job.muted = instrMuted;
+  job.grain = (grain > (size_t)h) ? h : (int)grain;
+  int nchunks = (h + job.grain - 1) / job.grain;
+  if (nw > nchunks) nw = nchunks;
+  job.nw = nw;
+  for (int i = 0; i < nw; i++) {
+    uint64_t lo = (uint64_t)nchunks * i / nw, hi = (uint64_t)nchunks * (i + 1) / nw;
+    atomic_init(&job.range[i], lo << 32 | hi);
+  }
+
+  pthread_mutex_lock(&poolMutex);
+  poolJob = &job;
+  poolNeed = nw;
+  poolBusy = nw - 1;
+  poolGen++;
+  pthread_cond_broadcast(&poolWake);
+  pthread_mutex_unlock(&poolMutex);
+  runJob(&job, 0);
+  pthread_mutex_lock(&poolMutex);
+  while (poolBusy > 0) pthread_cond_wait(&poolDone, &poolMutex);
+  pthread_mutex_unlock(&poolMutex);
+  pthread_mutex_unlock(&poolLock);
+}
+
+static void parallelRows(int h, size_t cost, RowTask fn, void* arg) {
+  parallelRowsGrain(h, cost, 1, fn, arg);
+}
+
+/// Set the number of threads used by image operations to n (at most 64).
+/// With n <= 0, use the IMAGE8BIT_THREADS environment variable, if set,
+/// or else one thread per processor (the default).
+/// Results never depend on the number of threads.
+/// Not to be called while other threads are running image operations.
+void ImageSetThreads(int n) { ///
+  atomic_store(&workers, (n > PARMAX) ? PARMAX : (n < 0) ? 0 : n);
+}
+
+/// Get the number of threads used by image operations.
+int ImageThreads(void) { ///
+  return parallelWorkers();
+}
 
 
 /// Image management functions
 
-/// Create a new black image.
-///   width, height : the dimensions of the new image.
-///   maxval: the maximum gray level (corresponding to white).
-/// Requires: width and height must be non-negative, maxval > 0.
-/// 
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageCreate(int width, int height, uint8 maxval) { ///
-  assert (width >= 0);
-  assert (height >= 0);
-  assert (0 < maxval && maxval <= PixMax);
-  // Insert your code here! 
+// Create a new black image with the given pixel memory layout.
+// Same contract as ImageCreate.
+static Image newImage(int width, int height, uint8 maxval, Layout layout) {
+  if (!pixFits(width, height, layout)) {  // Tamanho não representável
+    errno = EOVERFLOW;
+    check(0, "Image too large");
+    return NULL;
+  }
   Image img = (Image)malloc(sizeof(struct image)); // Alocação dinâmica na memória.
   
   if (img == NULL) {  // Em caso de erro:
     check((img != NULL), "Alocação de Memória falhou"); //    Mensagem de erro
-    free(img);  //    Liberta de espaço da memória;
     return NULL;   //    Como falhou retorna NULL
   }
 
   img -> width = width;
   img -> height = height;
   img->maxval = maxval;
-
-  // Alocação de memória para o array de pixels
-  img->pixel = (uint8*)malloc(width * height * sizeof(uint8));
+  img->layout = layout;
+  img->stride = width;
+  img->x0 = img->y0 = 0;
+  img->owner = NULL;
+  atomic_init(&img->views, 0);
+  img->cache = NULL;
+
+  // Alocação de memória para o array de pixels (a zeros: imagem preta)
+  img->pixel = newPixels(pixCount(width, height, layout));
   if (img->pixel == NULL) {   // Em caso de erro:
-    check((img->pixel != NULL), "AAlocação de memória para o data pixel falhou");  //      Mensagem de erro
+    check((img->pixel != NULL), "Alocação de memória para o data pixel falhou");  //      Mensagem de erro
     free(img);  //     liberamos a memória alocada para a estrutura Image
     return NULL;  //      Retorno NULL;
   }
@@ -200,19 +833,105 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
   return img;  //Retorna uma nova imagem
 }
 
+/// Create a new black image.
+///   width, height : the dimensions of the new image.
+///   maxval: the maximum gray level (corresponding to white).
+/// Requires: width and height must be non-negative, maxval > 0.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreate(int width, int height, uint8 maxval) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  assert (0 < maxval && maxval <= PixMax);
+  return newImage(width, height, maxval, LAYOUT_RASTER);
+}
+
+/// Clone an image.
+/// Returns a new image with the same size, maxval, layout and pixels as img.
+/// The pixel array is shared (not copied) until either image is modified:
+/// cloning takes constant time, and modifying a clone never affects the
+/// other.  (But views, and images with views, are copied right away.)
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageClone(Image img) { ///
+  assert (img != NULL);
+  if (img->owner != NULL || img->views > 0) {  // views share for writing
+    return ImageCrop(img, 0, 0, img->width, img->height);
+  }
+  Image clone = NULL;
+  int success =
+  check( (clone = (Image)malloc(sizeof(struct image))) != NULL, "Allocating clone failed" );
+  if (!success) return NULL;
+
+  *clone = *img;
+  clone->cache = NULL;
+  atomic_fetch_add(pixRefs(img->pixel), 1);
+  return clone;
+}
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
+/// Requires: no views of the image exist.
+/// Destroying a view does not affect the image it views.
 /// Ensures: (*imgp)==NULL.
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) { ///
   assert (imgp != NULL);
   // Insert your code here!
-  free((*imgp)->pixel);  // Libera a memória alocada para o campo pixel
+  if (*imgp == NULL) return;  // Nada a fazer
+  Image owner = (*imgp)->owner;
+  if (owner != NULL) {  // Uma vista não possui os pixeis
+    atomic_fetch_sub(&owner->views, 1);
+  } else {
+    assert ((*imgp)->views == 0);  // Não pode ser destruída enquanto tiver vistas
+    dropCache(*imgp);
+    releasePixels((*imgp)->pixel);  // Liberta a memória dos pixeis, se mais nenhum clone a usa
+  }
   free(*imgp);   // Desaloca bloco de memória, liberta o número de bits que foram solicitados quando foi alocado.
   *imgp = NULL; // Garantimos que (*imgp) é NULL
 }
 
+/// Change the pixel memory layout of img, converting its pixel array.
+/// The pixel levels are not changed.
+/// Requires: img is not a view (nor viewed by others).
+/// (This is an allocation, and may fail.)
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageSetLayout(Image img, Layout layout) { ///
+  assert (img != NULL);
+  assert (img->owner == NULL && img->views == 0);
+  if (img->layout == layout) return 1;
+  uint8* pixel = NULL;
+  if (!pixFits(img->width, img->height, layout)) {
+    errno = EOVERFLOW;
+    return check(0, "Image too large");
+  }
+  int success =
+  check( (pixel = newPixels(pixCount(img->width, img->height, layout))) != NULL,
+         "Allocating pixel array failed" );
+  if (!success) return 0;
+
+  // Copy row runs that never cross a tile boundary: one memcpy each.
+  for (int y = 0; y < img->height; y++) {
+    for (int x = 0; x < img->width; x += TSIDE) {
+      int n = (img->width - x < TSIDE) ? img->width - x : TSIDE;
+      memcpy(pixel + pixIndex(img->width, layout, x, y),
+             img->pixel + pixIndex(img->width, img->layout, x, y), n);
+    }
+  }
+  COUNT(PIXMEM, 2ul * img->width * img->height);  // count pixel memory accesses
+  releasePixels(img->pixel);
+  img->pixel = pixel;
+  img->layout = layout;
+  return 1;
+}
+
 
 /// PGM file operations
 
@@ -237,16 +956,43 @@ static int skipComments(FILE* f) {
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) { ///
+  FILE* f = NULL;
+  Image img = NULL;
+
+  int success = 
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  (img = ImageRead(f)) != NULL;
+  if (success) {
+    COUNT(PIXMEM, (unsigned long)img->width * img->height);  // count pixel memory accesses
+  }
+
+  // Cleanup
+  if (f != NULL) fclose(f);
+  return img;
+}
+
+/// Read a raw PGM image from an open stream.
+/// Leading whitespace is skipped, so several images may be read in
+/// sequence from one stream (as allowed by the PGM format).
+/// Does not count pixel memory accesses, so it may run in a thread of its
+/// own, concurrently with other module functions.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+/// If the stream ends before an image starts, errCause is "End of file",
+/// and feof(f) is true.
+Image ImageRead(FILE* f) { ///
+  assert (f != NULL);
   int w, h;
   int maxval;
+  int r;
   char c;
-  FILE* f = NULL;
   Image img = NULL;
 
   int success = 
-  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  check( (r = fscanf(f, " P%c ", &c)) != EOF || !feof(f), "End of file" ) &&
   // Parse PGM header
-  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
+  check( r == 1 && c == '5' , "Invalid file format" ) &&
   skipComments(f) >= 0 &&
   check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
   skipComments(f) >= 0 &&
@@ -257,8 +1003,7 @@ Image ImageLoad(const char* filename) { ///
   // Allocate image
   (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
   // Read pixels
-  check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  check( fread(img->pixel, sizeof(uint8), (size_t)w*h, f) == (size_t)w*h , "Reading pixels" );
 
   // Cleanup
   if (!success) {
@@ -266,7 +1011,6 @@ Image ImageLoad(const char* filename) { ///
     ImageDestroy(&img);
     errno = errsave;
   }
-  if (f != NULL) fclose(f);
   return img;
 }
 
@@ -276,85 +1020,540 @@ Image ImageLoad(const char* filename) { ///
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) { ///
   assert (img != NULL);
+  FILE* f = NULL;
+
+  int success =
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  ImageWrite(img, f);
+  COUNT(PIXMEM, (unsigned long)img->width * img->height);  // count pixel memory accesses
+
+  // Cleanup
+  if (f != NULL) {
+    errsave = errno;
+    fclose(f);
+    errno = errsave;
+  }
+  return success;
+}
+
+/// Write image in raw PGM format to an open stream.
+/// Does not count pixel memory accesses, so it may run in a thread of its
+/// own, concurrently with other module functions (that do not modify img).
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageWrite(Image img, FILE* f) { ///
+  assert (img != NULL);
+  assert (f != NULL);
   int w = img->width;
   int h = img->height;
   uint8 maxval = img->maxval;
-  FILE* f = NULL;
+  uint8* buf = NULL;
 
   int success =
-  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
-  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" );
+  if (img->layout == LAYOUT_RASTER && img->stride == w) {  // contiguous
+    success = success &&
+    check( fwrite(img->pixel + pixAt(img, 0, 0), sizeof(uint8), (size_t)w*h, f) == (size_t)w*h, "Writing pixels failed" ); 
+  } else {
+    success = success &&
+    check( (buf = (uint8*)malloc(w)) != NULL, "Allocating row buffer failed" );
+    for (int y = 0; success && y < h; y++) {
+      const uint8* row = readRow(img, 0, y, w, buf);
+      success = check( fwrite(row, sizeof(uint8), w, f) == w, "Writing pixels failed" );
+    }
+  }
 
   // Cleanup
-  if (f != NULL) fclose(f);
+  errsave = errno;
+  free(buf);
+  errno = errsave;
   return success;
 }
 
 
-/// Information queries
+/// Tiled container file operations
 
-/// These functions do not modify the image and never fail.
+// File layout of the tiled container:
+//   "T8\n<width> <height>\n<maxval>\n<tile>\n"     text header (PGM-like)
+//   (ntiles+1) offsets, 8 bytes each, little-endian  tile index (row-major)
+//   tile payloads, concatenated
+// Tile i occupies bytes [offset[i], offset[i+1]) of the file.
+// Tiles are tile x tile pixels, except at the right and bottom edges,
+// where they are clipped to the image.
+//
+// Each tile is coded as horizontal deltas (restarted at every tile row),
+// which turn smooth gradients into runs, followed by PackBits RLE.
+// If coding does not shrink a tile, the tile is stored raw instead, so a
+// payload with exactly tw*th bytes is always a raw tile.
 
-/// Get image width
-int ImageWidth(Image img) { ///
-  assert (img != NULL);
-  return img->width;
-}
+// Maximum tile side accepted in a container.
+#define TILEMAX 4096
 
-/// Get image height
-int ImageHeight(Image img) { ///
-  assert (img != NULL);
-  return img->height;
+// Store/fetch 64-bit little-endian offsets in the tile index.
+static void putOffset(uint8* p, uint64_t v) {
+  for (int b = 0; b < 8; b++) p[b] = (uint8)(v >> (8*b));
 }
 
-/// Get image maximum gray level
-int ImageMaxval(Image img) { ///
-  assert (img != NULL);
-  return img->maxval;
+static uint64_t getOffset(const uint8* p) {
+  uint64_t v = 0;
+  for (int b = 7; b >= 0; b--) v = (v << 8) | p[b];
+  return v;
 }
 
-/// Pixel stats
-/// Find the minimum and maximum gray levels in image.
-/// On return,
-/// *min is set to the minimum gray level in the image,
-/// *max is set to the maximum.
-void ImageStats(Image img, uint8* min, uint8* max) { ///
-  assert (img != NULL);
-  // Insert your code here!
-
-  (*max) = 0;  // Definir um máximo temporário;
-  (*min) = PixMax;  // Definir um minimo temporário;
-
-  // Vamos percorrer todos os pixeis da image
-  for (int i=0; i < (img->width * img->height); i++) {
-    if ((*max) > img->pixel[i]) {
-      (*max) = img->pixel[i];  // Procurar pelo nivel de gray max
+// PackBits encoding of n bytes from src into dst.
+// dst must have room for n + (n+127)/128 bytes.  Returns the coded size.
+//   control c in [0,127]:   c+1 literal bytes follow;
+//   control c in [129,255]: the next byte is repeated 257-c times.
+static size_t packBits(const uint8* src, size_t n, uint8* dst) {
+  size_t i = 0, o = 0;
+  while (i < n) {
+    size_t run = 1;
+    while (i + run < n && run < 128 && src[i+run] == src[i]) run++;
+    if (run >= 3) {
+      dst[o++] = (uint8)(257 - run);
+      dst[o++] = src[i];
+      i += run;
+    } else {
+      // Literal block: stop before the next run of 3 or at 128 bytes.
+      size_t start = i;
+      while (i < n && i - start < 128 &&
+             !(i + 2 < n && src[i] == src[i+1] && src[i] == src[i+2])) {
+        i++;
+      }
+      dst[o++] = (uint8)(i - start - 1);
+      memcpy(dst + o, src + start, i - start);
+      o += i - start;
     }
+  }
+  return o;
+}
 
-    if ((*min) < img->pixel[i]) {
-      (*min) = img->pixel[i]; // Procurar pelo nivel de gray min
+// PackBits decoding of n bytes from src into exactly m bytes of dst.
+// Returns 1 on success, 0 if the code is malformed.
+static int unpackBits(const uint8* src, size_t n, uint8* dst, size_t m) {
+  size_t i = 0, o = 0;
+  while (i < n) {
+    int c = src[i++];
+    if (c < 128) {
+      size_t len = (size_t)c + 1;
+      if (i + len > n || o + len > m) return 0;
+      memcpy(dst + o, src + i, len);
+      i += len; o += len;
+    } else if (c > 128) {
+      size_t len = 257 - (size_t)c;
+      if (i >= n || o + len > m) return 0;
+      memset(dst + o, src[i++], len);
+      o += len;
     }
   }
+  return o == m;
 }
 
-/// Check if pixel position (x,y) is inside img.
-int ImageValidPos(Image img, int x, int y) { ///
-  assert (img != NULL);
-  return (0 <= x && x < img->width) && (0 <= y && y < img->height);
+// Encode a tw x th tile (rows of tile[] are tw bytes apart) into code[],
+// using delta[] as scratch.  Both buffers need tw*th + (tw*th+127)/128 bytes.
+// Returns the payload size; a payload of tw*th bytes is the raw tile.
+static size_t tileEncode(const uint8* tile, int tw, int th, uint8* delta, uint8* code) {
+  size_t n = (size_t)tw*th;
+  for (int r = 0; r < th; r++) {
+    const uint8* row = tile + (size_t)r*tw;
+    uint8* d = delta + (size_t)r*tw;
+    d[0] = row[0];
+    for (int c = 1; c < tw; c++) d[c] = (uint8)(row[c] - row[c-1]);
+  }
+  size_t len = packBits(delta, n, code);
+  if (len >= n) {  // no gain: store raw
+    memcpy(code, tile, n);
+    len = n;
+  }
+  return len;
 }
 
-/// Check if rectangular area (x,y,w,h) is completely inside img.
-int ImageValidRect(Image img, int x, int y, int w, int h) { ///
-  assert (img != NULL);
-  // Insert your code here!
-
-  // Verificar se os limites não são menores de zero nem passam os limites da imagem
-  return (x >= 0 && y >= 0 && w > 0 && h > 0 && (x+w) < img->width && (y+h) < img->height);
+// Decode a payload of len bytes into a tw x th tile.
+// Returns 1 on success, 0 if the payload is malformed.
+static int tileDecode(const uint8* code, size_t len, int tw, int th, uint8* tile) {
+  size_t n = (size_t)tw*th;
+  if (len == n) {
+    memcpy(tile, code, n);
+    return 1;
+  }
+  if (!unpackBits(code, len, tile, n)) return 0;
+  for (int r = 0; r < th; r++) {
+    uint8* row = tile + (size_t)r*tw;
+    for (int c = 1; c < tw; c++) row[c] = (uint8)(row[c] + row[c-1]);
+  }
+  return 1;
 }
 
-/// Pixel get & set operations
+// Parse tiled container header from f.
+// On success, returns nonzero and f is positioned at the tile index.
+static int readTiledHeader(FILE* f, int* w, int* h, int* maxval, int* tile) {
+  char c;
+  return
+  check( fscanf(f, "T%c", &c) == 1 && c == '8' , "Invalid file format" ) &&
+  check( fscanf(f, "%d", w) == 1 && *w >= 0 , "Invalid width" ) &&
+  check( fscanf(f, "%d", h) == 1 && *h >= 0 , "Invalid height" ) &&
+  check( fscanf(f, "%d", maxval) == 1 && 0 < *maxval && *maxval <= (int)PixMax , "Invalid maxval" ) &&
+  check( fscanf(f, "%d", tile) == 1 && 0 < *tile && *tile <= TILEMAX , "Invalid tile size" ) &&
+  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" );
+}
+
+/// Save image to a tiled container file, using tile x tile pixel tiles.
+/// Requires: 0 < tile <= 4096.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageSaveTiled(Image img, const char* filename, int tile) { ///
+  assert (img != NULL);
+  assert (0 < tile && tile <= TILEMAX);
+  int w = img->width;
+  int h = img->height;
+  int ntx = (w + tile - 1) / tile;
+  int nty = (h + tile - 1) / tile;
+  size_t ntiles = (size_t)ntx*nty;
+  size_t cap = (size_t)tile*tile + ((size_t)tile*tile + 127)/128;
+  uint8* index = NULL;
+  uint8* buf = NULL;    // one tile, followed by delta and code scratch
+  FILE* f = NULL;
+  long base = 0;
+
+  int success =
+  check( (index = (uint8*)calloc(ntiles + 1, 8)) != NULL &&
+         (buf = (uint8*)malloc((size_t)tile*tile + 2*cap)) != NULL, "Allocating tile buffers failed" ) &&
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fprintf(f, "T8\n%d %d\n%u\n%d\n", w, h, img->maxval, tile) > 0, "Writing header failed" ) &&
+  // Reserve room for the index, which is written when all offsets are known
+  check( (base = ftell(f)) >= 0 &&
+         fwrite(index, 8, ntiles + 1, f) == ntiles + 1, "Writing tile index failed" );
+
+  uint8* tbuf = buf;
+  uint8* delta = buf + (size_t)tile*tile;
+  uint8* code = delta + cap;
+  uint64_t offset = (uint64_t)base + 8*(ntiles + 1);
+  for (size_t t = 0; success && t < ntiles; t++) {
+    int x0 = (int)(t % ntx) * tile;
+    int y0 = (int)(t / ntx) * tile;
+    int tw = (w - x0 < tile) ? w - x0 : tile;
+    int th = (h - y0 < tile) ? h - y0 : tile;
+    for (int r = 0; r < th; r++) {
+      getRow(img, x0, y0 + r, tw, tbuf + (size_t)r*tw);
+    }
+    size_t len = tileEncode(tbuf, tw, th, delta, code);
+    putOffset(index + 8*t, offset);
+    success = check( fwrite(code, 1, len, f) == len, "Writing tiles failed" );
+    offset += len;
+  }
+  putOffset(index + 8*ntiles, offset);
+  success = success &&
+  check( fseek(f, base, SEEK_SET) == 0 &&
+         fwrite(index, 8, ntiles + 1, f) == ntiles + 1, "Writing tile index failed" );
+  COUNT(PIXMEM, (unsigned long)w*h);  // count pixel memory accesses
+
+  // Cleanup
+  errsave = errno;
+  if (f != NULL) fclose(f);
+  free(buf);
+  free(index);
+  errno = errsave;
+  return success;
+}
+
+/// Check if file is a tiled container.
+/// If it is, returns 1 and sets (*pw, *ph) to the image dimensions.
+/// Otherwise, returns 0 and (*pw, *ph) are left untouched.
+int ImageProbeTiled(const char* filename, int* pw, int* ph) { ///
+  assert (pw != NULL);
+  assert (ph != NULL);
+  int w, h, maxval, tile;
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) return 0;
+  int success = readTiledHeader(f, &w, &h, &maxval, &tile);
+  fclose(f);
+  if (success) {
+    *pw = w;
+    *ph = h;
+  }
+  return success;
+}
+
+/// Load the rectangle (x,y,w,h) of the image stored in a tiled container.
+/// Only the tiles that intersect the rectangle are read and decoded.
+/// The rectangle must be inside the stored image (it is checked).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadRegion(const char* filename, int x, int y, int w, int h) { ///
+  int W, H, maxval, tile;
+  long base = 0;
+  uint8* index = NULL;
+  uint8* buf = NULL;
+  FILE* f = NULL;
+  Image img = NULL;
+
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  readTiledHeader(f, &W, &H, &maxval, &tile) &&
+  check( 0 <= x && 0 <= y && 0 <= w && 0 <= h &&
+         w <= W - x && h <= H - y, "Invalid region" ) &&
+  check( (base = ftell(f)) >= 0, "Reading tile index failed" ) &&
+  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+  check( (index = (uint8*)malloc(8*((size_t)(W + tile - 1)/tile + 1))) != NULL &&
+         (buf = (uint8*)malloc(2*(size_t)tile*tile)) != NULL, "Allocating tile buffers failed" );
+
+  if (success && w > 0 && h > 0) {
+    int ntx = (W + tile - 1) / tile;
+    int tx0 = x / tile, tx1 = (x + w - 1) / tile;
+    int ty0 = y / tile, ty1 = (y + h - 1) / tile;
+    uint8* tbuf = buf;
+    uint8* code = buf + (size_t)tile*tile;
+    for (int ty = ty0; success && ty <= ty1; ty++) {
+      // Read only the index entries of the tiles touched in this tile row
+      size_t first = (size_t)ty*ntx + tx0;
+      size_t count = (size_t)(tx1 - tx0) + 2;
+      success =
+      check( fseek(f, base + (long)(8*first), SEEK_SET) == 0 &&
+             fread(index, 8, count, f) == count, "Reading tile index failed" );
+      for (int tx = tx0; success && tx <= tx1; tx++) {
+        int x0 = tx*tile, y0 = ty*tile;
+        int tw = (W - x0 < tile) ? W - x0 : tile;
+        int th = (H - y0 < tile) ? H - y0 : tile;
+        uint64_t off = getOffset(index + 8*(tx - tx0));
+        uint64_t end = getOffset(index + 8*(tx - tx0 + 1));
+        size_t len = (size_t)(end - off);
+        success =
+        check( off <= end && len <= (size_t)tw*th, "Corrupt tile index" ) &&
+        check( fseek(f, (long)off, SEEK_SET) == 0 &&
+               fread(code, 1, len, f) == len, "Reading tiles failed" ) &&
+        check( tileDecode(code, len, tw, th, tbuf), "Corrupt tile" );
+        if (!success) break;
+        // Copy the intersection of tile and region
+        int cx0 = (x > x0) ? x : x0;
+        int cx1 = (x + w < x0 + tw) ? x + w : x0 + tw;
+        int cy0 = (y > y0) ? y : y0;
+        int cy1 = (y + h < y0 + th) ? y + h : y0 + th;
+        for (int r = cy0; r < cy1; r++) {
+          memcpy(img->pixel + (size_t)(r - y)*w + (cx0 - x),
+                 tbuf + (size_t)(r - y0)*tw + (cx0 - x0), cx1 - cx0);
+        }
+      }
+    }
+  }
+  COUNT(PIXMEM, (unsigned long)w*h);  // count pixel memory accesses
+
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    ImageDestroy(&img);
+    errno = errsave;
+  }
+  free(buf);
+  free(index);
+  if (f != NULL) fclose(f);
+  return img;
+}
+
+
+/// Information queries
+
+/// These functions do not modify the image and never fail.
+
+/// Get image width
+int ImageWidth(Image img) { ///
+  assert (img != NULL);
+  return img->width;
+}
+
+/// Get image height
+int ImageHeight(Image img) { ///
+  assert (img != NULL);
+  return img->height;
+}
+
+/// Get image maximum gray level
+int ImageMaxval(Image img) { ///
+  assert (img != NULL);
+  return img->maxval;
+}
+
+/// Get image pixel memory layout
+Layout ImageLayout(Image img) { ///
+  assert (img != NULL);
+  return img->layout;
+}
+
+/// Check if img is a view of another image (see ImageView).
+int ImageIsView(Image img) { ///
+  assert (img != NULL);
+  return img->owner != NULL;
+}
+
+/// Check if img has views (see ImageView).
+int ImageHasViews(Image img) { ///
+  assert (img != NULL);
+  return img->views > 0;
+}
+
+/// Check if img shares its pixel array with clones (see ImageClone).
+/// Destroying such an image frees no pixel memory.
+int ImageSharesPixels(Image img) { ///
+  assert (img != NULL);
+  return shared(img);
+}
+
+/// Pixel stats
+
+// Minimum and maximum found by each worker of ImageStats.
+typedef struct {
+  Image img;
+  uint8 min[PARMAX], max[PARMAX];
+} Stats;
+
+static void statsRows(void* arg, int worker, int y0, int y1) {
+  Stats* st = (Stats*)arg;
+  Image img = st->img;
+  uint8 max = st->max[worker];
+  uint8 min = st->min[worker];
+
+  // Vamos percorrer todos os pixeis das linhas [y0, y1[
+  // (em segmentos de TSIDE pixeis, que não precisam de memória extra)
+  uint8 buf[TSIDE];
+  for (int y = y0; y < y1; y++) {
+    for (int x = 0; x < img->width; x += TSIDE) {
+      int n = (img->width - x < TSIDE) ? img->width - x : TSIDE;
+      const uint8* row = readRow(img, x, y, n, buf);
+      for (int i = 0; i < n; i++) {
+        if (row[i] > max) {
+          max = row[i];  // Procurar pelo nivel de gray max
+        }
+        if (row[i] < min) {
+          min = row[i]; // Procurar pelo nivel de gray min
+        }
+      }
+    }
+  }
+  st->max[worker] = max;
+  st->min[worker] = min;
+}
+
+// Histograms counted by each worker of ImageHistogram.
+typedef struct {
+  Image img;
+  uint64_t (*hist)[256];
+} Hist;
+
+static void histRows(void* arg, int worker, int y0, int y1) {
+  Hist* hs = (Hist*)arg;
+  for (int y = y0; y < y1; y++) {
+    histRun(hs->img, hs->hist[worker], y, 0, hs->img->width, 1);
+  }
+}
+
+// Count the levels of all pixels of img into hist.
+// Returns 0 on failure (and errCause is set).
+static int histCount(Image img, uint64_t hist[256]) {
+  int nw = parallelWorkers();
+  Hist hs = { img, NULL };
+  if (!check( (hs.hist = (uint64_t (*)[256])calloc(nw, sizeof(*hs.hist))) != NULL,
+              "Allocating histograms failed" )) {
+    return 0;
+  }
+  parallelRows(img->height, (size_t)img->width * img->height, histRows, &hs);
+  for (int v = 0; v < 256; v++) {
+    uint64_t n = 0;
+    for (int i = 0; i < nw; i++) n += hs.hist[i][v];
+    hist[v] = n;
+  }
+  free(hs.hist);
+  COUNT(PIXMEM, (unsigned long)img->width * img->height);  // count pixel memory accesses
+  return 1;
+}
+
+/// Compute the histogram of img: hist[v] is set to the number of pixels
+/// with level v, for v in [0, 255].
+/// Unless img is a view, the histogram is kept with it, and later calls
+/// only recount the pixels changed since (by any operation).
+/// (This involves allocation, and may fail.)
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageHistogram(Image img, uint64_t hist[256]) { ///
+  assert (img != NULL);
+  assert (hist != NULL);
+  if (img->owner != NULL) return histCount(img, hist);
+  struct cache* c = getCache(img);
+  if (c == NULL) return 0;
+  if (!c->hvalid) {
+    if (!histCount(img, c->hist)) return 0;
+    c->hvalid = 1;
+    c->hdirty.n = 0;
+  } else if (c->hdirty.n > 0) {
+    // Count the new levels of the dirty rectangles (once where they overlap).
+    Rect box = c->hdirty.r[0];
+    for (int i = 1; i < c->hdirty.n; i++) box = rectUnion(box, c->hdirty.r[i]);
+    int iv[DIRTYMAX][2];
+    for (int y = box.y0; y < box.y1; y++) {
+      int m = rowCover(&c->hdirty, y, box.x0, box.x1, iv);
+      for (int i = 0; i < m; i++) histRun(img, c->hist, y, iv[i][0], iv[i][1], 1);
+    }
+    c->hdirty.n = 0;
+    COUNT(PIXMEM, (unsigned long)(box.x1 - box.x0) * (box.y1 - box.y0));  // (at most)
+  }
+  memcpy(hist, c->hist, sizeof(c->hist));
+  return 1;
+}
+
+/// Find the minimum and maximum gray levels in image.
+/// On return,
+/// *min is set to the minimum gray level in the image,
+/// *max is set to the maximum.
+/// Unless img is a view, this uses (and keeps) its histogram: see
+/// ImageHistogram.
+void ImageStats(Image img, uint8* min, uint8* max) { ///
+  assert (img != NULL);
+  // Insert your code here!
+
+  uint64_t hist[256];
+  if (img->owner == NULL && ImageHistogram(img, hist)) {
+    (*max) = 0;
+    (*min) = PixMax;
+    for (int v = 0; v < 256; v++) {
+      if (hist[v] == 0) continue;
+      if (v < (*min)) (*min) = v;
+      (*max) = v;
+    }
+    return;
+  }
+  // Sem histograma (vistas, ou falta de memória): procurar diretamente.
+  Stats st;
+  st.img = img;
+  for (int i = 0; i < PARMAX; i++) {
+    st.max[i] = 0;  // Definir um máximo temporário;
+    st.min[i] = PixMax;  // Definir um minimo temporário;
+  }
+  parallelRows(img->height, (size_t)img->width * img->height, statsRows, &st);
+  (*max) = 0;
+  (*min) = PixMax;
+  for (int i = 0; i < PARMAX; i++) {
+    if (st.max[i] > (*max)) (*max) = st.max[i];
+    if (st.min[i] < (*min)) (*min) = st.min[i];
+  }
+  COUNT(PIXMEM, (unsigned long)img->width * img->height);  // count pixel memory accesses
+}
+
+/// Check if pixel position (x,y) is inside img.
+int ImageValidPos(Image img, int x, int y) { ///
+  assert (img != NULL);
+  return (0 <= x && x < img->width) && (0 <= y && y < img->height);
+}
+
+/// Check if rectangular area (x,y,w,h) is completely inside img.
+int ImageValidRect(Image img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  // Insert your code here!
+
+  // Verificar se os limites não são menores de zero nem passam os limites da imagem
+  return (x >= 0 && y >= 0 && w > 0 && h > 0 && (x+w) <= img->width && (y+h) <= img->height);
+}
+
+/// Pixel get & set operations
 
 /// These are the primitive operations to access and modify a single pixel
 /// in the image.
@@ -363,14 +1562,15 @@ int ImageValidRect(Image img, int x, int y, int w, int h) { ///
 
 // Transform (x, y) coords into linear pixel index.
 // This internal function is used in ImageGetPixel / ImageSetPixel. 
-// The returned index must satisfy (0 <= index < img->width*img->height)
-static inline int G(Image img, int x, int y) {
-  int index;
+// The returned index must be inside the pixel array, which, for a view,
+// has at least y0+height rows of stride pixels.
+static inline size_t G(Image img, int x, int y) {
+  size_t index;
   // Insert your code here!
 
-  index = x + (y * img->width);  // Calculo do indice para as coordenadas (x, y);
+  index = pixAt(img, x, y);  // Calculo do indice para as coordenadas (x, y);
 
-  assert (0 <= index && index < img->width*img->height);  // Verificação se esse indice está dentro dos valores corretos
+  assert (index < pixCount(img->stride, img->y0 + img->height, img->layout));  // Verificação se esse indice está dentro dos valores corretos
   return index;  //retorno do indice.
 }
 
@@ -378,15 +1578,19 @@ static inline int G(Image img, int x, int y) {
 uint8 ImageGetPixel(Image img, int x, int y) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
-  PIXMEM += 1;  // count one pixel access (read)
+  COUNT_ACCESS(PIXMEM, 1);  // count one pixel access (read)
   return img->pixel[G(img, x, y)];
 } 
 
 /// Set the pixel at position (x,y) to new level.
+/// If img shares its pixels with a clone, it gets its own copy first;
+/// should that fail, the pixel is left unchanged (and errCause is set).
 void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
-  PIXMEM += 1;  // count one pixel access (store)
+  if (!ownPixels(img)) return;
+  touch(img, x, y, 1, 1);
+  COUNT_ACCESS(PIXMEM, 1);  // count one pixel access (store)
   img->pixel[G(img, x, y)] = level;
 } 
 
@@ -395,14 +1599,84 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
 
 /// These functions modify the pixel levels in an image, but do not change
 /// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
-/// They never fail.
+/// All of these functions modify the image in-place, and only allocate
+/// memory if img shares its pixels with a clone (see ImageClone).
+/// On success, they return nonzero.
+/// On failure, they return 0, errno/errCause are set accordingly, and img
+/// is left unchanged.
+
+// Replace each pixel level v of img by lut[v].
+// Whole pixel arrays are scanned linearly (in LAYOUT_TILED this includes
+// the tile padding, which is harmless), in parallel blocks of LUTBLOCK
+// pixels; views are scanned row by row.
+// A shared array is mapped into a new one, instead of copied and then
+// mapped in-place.
+// Same contract as ImageNegative.
+
+#define LUTBLOCK 4096
+
+typedef struct {
+  Image img;
+  const uint8* lut;
+  const uint8* src;       // whole arrays: source and destination
+  uint8* dst;
+  size_t n;               // and number of pixels
+} Lut;
+
+static void lutBlocks(void* arg, int worker, int b0, int b1) {
+  (void)worker;
+  Lut* t = (Lut*)arg;
+  size_t i1 = (size_t)b1 * LUTBLOCK;
+  if (i1 > t->n) i1 = t->n;
+  for (size_t i = (size_t)b0 * LUTBLOCK; i < i1; i++) {
+    t->dst[i] = t->lut[t->src[i]];
+  }
+}
+
+static void lutRows(void* arg, int worker, int y0, int y1) {
+  (void)worker;
+  Lut* t = (Lut*)arg;
+  Image img = t->img;
+  uint8 buf[TSIDE];
+  for (int y = y0; y < y1; y++) {
+    for (int x = 0; x < img->width; x += TSIDE) {
+      int n = (img->width - x < TSIDE) ? img->width - x : TSIDE;
+      uint8* row = readRow(img, x, y, n, buf);
+      for (int i = 0; i < n; i++) {
+        row[i] = t->lut[row[i]];
+      }
+      writeRow(img, x, y, n, row);
+    }
+  }
+}
+
+static int applyLut(Image img, const uint8 lut[256]) {
+  Lut t = { img, lut, NULL, NULL, 0 };
+  touchAll(img);
+  if (img->owner == NULL) {
+    t.n = pixCount(img->width, img->height, img->layout);
+    t.src = img->pixel;
+    t.dst = img->pixel;
+    if (shared(img)) {
+      t.dst = newPixels(t.n);
+      if (!check( t.dst != NULL, "Copying shared pixel array failed" )) return 0;
+    }
+    parallelRows((int)((t.n + LUTBLOCK - 1) / LUTBLOCK), t.n, lutBlocks, &t);
+    if (t.dst != img->pixel) {
+      releasePixels(img->pixel);
+      img->pixel = t.dst;
+    }
+    return 1;
+  }
+  parallelRows(img->height, (size_t)img->width * img->height, lutRows, &t);
+  return 1;
+}
 
 
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
-void ImageNegative(Image img) { ///
+int ImageNegative(Image img) { ///
   assert (img != NULL);
   // Insert your code here!
   
@@ -410,16 +1684,20 @@ void ImageNegative(Image img) { ///
     Para fazer o negativo da imagem, temos de percorrer todos os pixeis
     da imagem e depois ao valor máximo de intensidade (PixMax -> 255)
     subtraimos o valor atual da intensidade do pixel.
+    O resultado só depende do nível, por isso calculamo-lo uma vez por
+    nível (tabela lut) e aplicamos a tabela a todos os pixeis.
   */
-  for(int i=0; i<img->width * img->height; i++) {
-    img->pixel[i] = PixMax - img->pixel[i];
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) {
+    lut[v] = (uint8)(PixMax - v);
   }
+  return applyLut(img, lut);
 }
 
 /// Apply threshold to image.
 /// Transform all pixels with level<thr to black (0) and
 /// all pixels with level>=thr to white (maxval).
-void ImageThreshold(Image img, uint8 thr) { ///
+int ImageThreshold(Image img, uint8 thr) { ///
   assert (img != NULL);
   // Insert your code here!
 
@@ -428,25 +1706,22 @@ void ImageThreshold(Image img, uint8 thr) { ///
     e verificar se o valor do pixel é menor que o threshold, caso seja, 
     o pixel fica preto, caso contrário fica branco.
   */
-  for(int i=0; i<(img->width*img->height); i++) {
-
-    uint8 level = img->pixel[i];
-
+  uint8 lut[256];
+  for (int level = 0; level < 256; level++) {
     if (level < thr) {
-      img->pixel[i] = (uint8)0;
+      lut[level] = (uint8)0;
     } else {
-      img->pixel[i] = PixMax;
+      lut[level] = PixMax;
     }
-
   }
-
+  return applyLut(img, lut);
 }
 
 /// Brighten image by a factor.
 /// Multiply each pixel level by a factor, but saturate at maxval.
 /// This will brighten the image if factor>1.0 and
 /// darken the image if factor<1.0.
-void ImageBrighten(Image img, double factor) { ///
+int ImageBrighten(Image img, double factor) { ///
   assert (img != NULL);
   assert (factor >= 0.0);
   // Insert your code here!
@@ -457,12 +1732,12 @@ void ImageBrighten(Image img, double factor) { ///
     valor do pixel seja maior que o valor máximo de intensidade (PixMax -> 255)
     o pixel fica com o valor máximo de intensidade.
   */
-  for (int i=0; i < (img->width * img->height); i++) {
-
-    double newPixelValue = img->pixel[i] * factor;
-    img->pixel[i] = (newPixelValue > PixMax) ? PixMax : (uint8)(newPixelValue+0.5);
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) {
+    double newPixelValue = v * factor;
+    lut[v] = (newPixelValue > PixMax) ? PixMax : (uint8)(newPixelValue+0.5);
   }
-
+  return applyLut(img, lut);
 }
 
 
@@ -491,18 +1766,30 @@ Image ImageRotate(Image img) { ///
   assert (img != NULL);
   // Insert your code here!
 
-  Image ImgR = ImageCreate(img->width, img->height, img->maxval); // Criar uma nova imagem com as dimensões trocadas
+  int w = img->width;
+  int h = img->height;
+  Image ImgR = newImage(h, w, img->maxval, img->layout); // Criar uma nova imagem com as dimensões trocadas
+  if (ImgR == NULL) return NULL;
 
   /* 
-    Para fazer a rotação da imagem, temos de percorrer todos os pixeis
-    da imagem e depois trocar as coordenadas x e y, ou seja, a coordenada
-    x passa a ser a coordenada y e a coordenada y passa a ser a coordenada x.
+    O pixel (x, y) da imagem original vai para a posição (y, w-1-x) da
+    imagem rodada.  Percorremos a imagem em blocos de TSIDE x TSIDE, para
+    que tanto as leituras como as escritas fiquem na cache (em LAYOUT_TILED
+    cada bloco de origem é exatamente um tile).
   */
-  for(int y=0; y<img->height; y++) {
-    for(int x=0; x<img->width; x++) {
-      ImageSetPixel(ImgR, x, y, ImageGetPixel(img, (img->height - y - 1), x));
+  for (int by = 0; by < h; by += TSIDE) {
+    int ey = (by + TSIDE < h) ? by + TSIDE : h;
+    for (int bx = 0; bx < w; bx += TSIDE) {
+      int ex = (bx + TSIDE < w) ? bx + TSIDE : w;
+      for (int y = by; y < ey; y++) {
+        for (int x = bx; x < ex; x++) {
+          ImgR->pixel[G(ImgR, y, w - 1 - x)] = img->pixel[G(img, x, y)];
+        }
+      }
     }
-  } return ImgR;
+  }
+  COUNT(PIXMEM, 2ul * w * h);  // count pixel memory accesses
+  return ImgR;
 }
 
 /// Mirror an image = flip left-right.
@@ -516,18 +1803,236 @@ Image ImageMirror(Image img) { ///
   assert (img != NULL);
   // Insert your code here!
 
-  Image ImgM = ImageCreate(img->height, img->width, img->maxval);   // Criar uma nova imagem com as dimensões trocadas
+  Image ImgM = newImage(img->width, img->height, img->maxval, img->layout);   // Criar uma nova imagem com as mesmas dimensões
+  if (ImgM == NULL) return NULL;
 
   /* 
-    Para fazer o mirror da imagem, temos de percorrer todos os pixeis
-    da imagem e depois trocar as coordenadas x e y, ou seja, a coordenada
-    x passa a ser a coordenada y e a coordenada y passa a ser a coordenada x.
+    Para fazer o mirror da imagem, cada linha é copiada com a ordem dos
+    pixeis invertida: o pixel (x, y) passa para (w-1-x, y).
+    Trabalhamos em segmentos de TSIDE pixeis, sem memória extra.
   */
+  uint8 src[TSIDE], dst[TSIDE];
+  int w = img->width;
   for(int y=0; y<img->height; y++) {
-    for(int x=0; x<img->width; x++) {
-      ImageSetPixel(ImgM, x, y, ImageGetPixel(img, img->width - x - 1, y));
+    for(int x=0; x<w; x+=TSIDE) {
+      int n = (w - x < TSIDE) ? w - x : TSIDE;
+      const uint8* row = readRow(img, x, y, n, src);
+      for (int i = 0; i < n; i++) {
+        dst[n - 1 - i] = row[i];
+      }
+      putRow(ImgM, w - x - n, y, n, dst);
+    }
+  }
+  COUNT(PIXMEM, 2ul * w * img->height);  // count pixel memory accesses
+  return ImgM;
+}
+
+// In-place geometric transformations
+//
+// These reuse the pixel array of img instead of allocating a result, so
+// the peak memory is about half that of the functions above.  They work
+// on rows through the row helpers, except 90 degree rotation, which is a
+// transpose followed by a flip of the row order.  The transpose is done in
+// TSIDE x TSIDE blocks for square raster images, and by following the
+// cycles of the transposition permutation otherwise: over pixels, for
+// raster images, or over whole tiles (each then transposed by itself),
+// for tiled images.
+
+// Exchange rows y1 and y2 of img (y1 may equal y2), reversing them if rev.
+// That is, pixel (x,y1) goes to (x',y2) and vice-versa, with x' = w-1-x if
+// rev or x' = x otherwise.
+static void swapRows(Image img, int y1, int y2, int rev) {
+  int w = img->width;
+  uint8 a[TSIDE], b[TSIDE], c[TSIDE], d[TSIDE];
+  if (!rev) {
+    if (y1 == y2) return;
+    for (int x = 0; x < w; x += TSIDE) {
+      int n = (w - x < TSIDE) ? w - x : TSIDE;
+      getRow(img, x, y1, n, a);
+      getRow(img, x, y2, n, b);
+      putRow(img, x, y1, n, b);
+      putRow(img, x, y2, n, a);
+    }
+    return;
+  }
+  // Segments [x,x+n) and [w-x-n,w-x) of both rows, for x < w/2, never
+  // overlap.  The middle column of an odd width just swaps rows.
+  int half = w / 2;
+  for (int x = 0; x < half; x += TSIDE) {
+    int n = (half - x < TSIDE) ? half - x : TSIDE;
+    int xr = w - x - n;
+    getRow(img, x, y1, n, a);
+    getRow(img, xr, y2, n, b);
+    getRow(img, x, y2, n, c);
+    getRow(img, xr, y1, n, d);
+    for (int i = 0, j = n - 1; i < j; i++, j--) {
+      uint8 t;
+      t = a[i]; a[i] = a[j]; a[j] = t;
+      t = b[i]; b[i] = b[j]; b[j] = t;
+      t = c[i]; c[i] = c[j]; c[j] = t;
+      t = d[i]; d[i] = d[j]; d[j] = t;
+    }
+    putRow(img, x, y1, n, b);
+    putRow(img, xr, y2, n, a);
+    putRow(img, x, y2, n, d);
+    putRow(img, xr, y1, n, c);
+  }
+  if (w % 2 != 0 && y1 != y2) {
+    getRow(img, half, y1, 1, a);
+    getRow(img, half, y2, 1, b);
+    putRow(img, half, y1, 1, b);
+    putRow(img, half, y2, 1, a);
+  }
+}
+
+typedef struct {
+  Image img;
+  int mirror;  // swap each row with itself (mirror) or with row h-1-y
+  int rev;     // reverse rows (see swapRows)
+} Flip;
+
+// Flip rows [y0,y1) as given by arg.
+static void flipRows(void* arg, int worker, int y0, int y1) {
+  Flip* f = (Flip*)arg;
+  int h = f->img->height;
+  for (int y = y0; y < y1; y++) {
+    swapRows(f->img, y, f->mirror ? y : h - 1 - y, f->rev);
+  }
+}
+
+// Transpose the n x n matrix at a, with rows ld bytes apart, in-place.
+static void transposeSquare(uint8* a, int n, size_t ld) {
+  for (int bi = 0; bi < n; bi += TSIDE) {
+    int ei = (bi + TSIDE < n) ? bi + TSIDE : n;
+    for (int bj = bi; bj < n; bj += TSIDE) {
+      int ej = (bj + TSIDE < n) ? bj + TSIDE : n;
+      for (int i = bi; i < ei; i++) {
+        for (int j = (bi == bj) ? i + 1 : bj; j < ej; j++) {
+          uint8 t = a[i*ld + j];
+          a[i*ld + j] = a[j*ld + i];
+          a[j*ld + i] = t;
+        }
+      }
+    }
+  }
+}
+
+// Transpose the rows x cols matrix at a, with elements of esize bytes,
+// in-place, by following the cycles of the permutation: the element at
+// p = r*cols + c goes to c*rows + r = p*rows mod (N-1), N = rows*cols.
+// A bitset marks the elements already moved.
+// Returns 0 on failure (and errCause is set), leaving a unchanged.
+static int transposeCycles(uint8* a, int rows, int cols, size_t esize) {
+  size_t N = (size_t)rows * cols;
+  if (N < 3) return 1;
+  uint8* done = NULL;
+  uint8* tmp = NULL;
+  int success =
+  check( (done = (uint8*)calloc((N + 7) / 8, sizeof(uint8))) != NULL &&
+         (tmp = (uint8*)malloc(2 * esize)) != NULL, "Allocating transpose buffers failed" );
+  if (success) {
+    uint8* val = tmp;
+    uint8* t = tmp + esize;
+    for (size_t s = 1; s < N - 1; s++) {
+      if (done[s >> 3] & (1 << (s & 7))) continue;
+      // Carry the element at s around its cycle.
+      memcpy(val, a + s*esize, esize);
+      size_t q = s;
+      do {
+        q = (q * rows) % (N - 1);
+        memcpy(t, a + q*esize, esize);
+        memcpy(a + q*esize, val, esize);
+        memcpy(val, t, esize);
+        done[q >> 3] |= (uint8)(1 << (q & 7));
+      } while (q != s);
+    }
+  }
+  errsave = errno;
+  free(tmp);
+  free(done);
+  errno = errsave;
+  return success;
+}
+
+/// Mirror an image in-place (flip left-right).
+/// Same result as ImageMirror, without allocating a new image.
+/// If img shares its pixels with a clone, they are copied first.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageMirrorInPlace(Image img) { ///
+  assert (img != NULL);
+  if (!ownPixels(img)) return 0;
+  touchAll(img);
+  Flip f = { img, 1, 1 };
+  parallelRows(img->height, (size_t)img->width * img->height, flipRows, &f);
+  COUNT(PIXMEM, 2ul * img->width * img->height);  // count pixel memory accesses
+  return 1;
+}
+
+/// Rotate an image 180 degrees in-place.
+/// If img shares its pixels with a clone, they are copied first.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageRotate180InPlace(Image img) { ///
+  assert (img != NULL);
+  if (!ownPixels(img)) return 0;
+  touchAll(img);
+  Flip f = { img, 0, 1 };  // row y, reversed, with row h-1-y
+  parallelRows((img->height + 1) / 2, (size_t)img->width * img->height, flipRows, &f);
+  COUNT(PIXMEM, 2ul * img->width * img->height);  // count pixel memory accesses
+  return 1;
+}
+
+/// Rotate an image 90 degrees anti-clockwise in-place.
+/// Same result as ImageRotate, without allocating a new image (but, for
+/// non-square raster images, w*h/8 bytes of bookkeeping).
+/// If img shares its pixels with a clone, ImageRotate is used instead.
+/// Requires: img is not a view, nor viewed by others.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageRotateInPlace(Image img) { ///
+  assert (img != NULL);
+  assert (img->owner == NULL && img->views == 0);
+  int w = img->width;
+  int h = img->height;
+  touchAll(img);
+  if (shared(img)) {  // a copy is needed anyway
+    Image r = ImageRotate(img);
+    if (r == NULL) return 0;
+    uint8* pixel = img->pixel;  // swap arrays: the old one goes away with r
+    img->pixel = r->pixel;
+    r->pixel = pixel;
+    ImageDestroy(&r);
+    img->width = img->stride = h;
+    img->height = w;
+    return 1;
+  }
+
+  // Transpose: pixel (x,y) goes to (y,x)
+  if (img->layout == LAYOUT_TILED) {
+    size_t tsize = (size_t)TSIDE * TSIDE;
+    int ntx = tilesFor(w);
+    int nty = tilesFor(h);
+    if (!transposeCycles(img->pixel, nty, ntx, tsize)) return 0;
+    for (size_t t = 0; t < (size_t)ntx * nty; t++) {
+      transposeSquare(img->pixel + t * tsize, TSIDE, TSIDE);
     }
-  } return ImgM;
+  } else if (w == h) {
+    transposeSquare(img->pixel, w, w);
+  } else {
+    if (!transposeCycles(img->pixel, h, w, 1)) return 0;
+  }
+  img->width = img->stride = h;
+  img->height = w;
+
+  // Then flip upside down: pixel (y,x) goes to (y,w-1-x)
+  Flip f = { img, 0, 0 };
+  parallelRows(w / 2, (size_t)w * h, flipRows, &f);
+  COUNT(PIXMEM, 4ul * w * h);  // count pixel memory accesses
+  return 1;
 }
 
 /// Crop a rectangular subimage from img.
@@ -547,103 +2052,386 @@ Image ImageCrop(Image img, int x, int y, int w, int h) { ///
   assert (ImageValidRect(img, x, y, w, h));
   // Insert your code here!
 
-  Image ImgC = ImageCreate(w, h, img->maxval);  // Criar uma nova imagem com as dimensões do retangulo
+  Image ImgC = newImage(w, h, img->maxval, img->layout);  // Criar uma nova imagem com as dimensões do retangulo
+  if (ImgC == NULL) return NULL;
 
    /* 
-    Para fazer o crop da imagem, temos de percorrer todos os pixeis
-    da imagem e depois copiar os pixeis da imagem original para a nova
-    imagem.
+    Para fazer o crop da imagem, copiamos cada linha do retangulo da
+    imagem original para a nova imagem, em segmentos de TSIDE pixeis.
   */
-  for(int i=0; i<w; i++) {
-    for(int j=0; j<h; j++) {
-      ImageSetPixel(ImgC, i, j, ImageGetPixel(img, x+i, y+j));
+  uint8 buf[TSIDE];
+  for(int j=0; j<h; j++) {
+    for(int i=0; i<w; i+=TSIDE) {
+      int n = (w - i < TSIDE) ? w - i : TSIDE;
+      putRow(ImgC, i, j, n, readRow(img, x+i, y+j, n, buf));
     }
-  } return ImgC;
+  }
+  COUNT(PIXMEM, 2ul * w * h);  // count pixel memory accesses
+  return ImgC;
+}
+
+/// Create a view of a rectangular subimage of img, without copying.
+/// The rectangle is specified as in ImageCrop.
+/// The view is an image of width w and height h that shares its pixels
+/// with img: changes made through either are seen in both.
+/// Views may be used wherever an image is expected (except in
+/// ImageSetLayout), and views of views are allowed.
+/// Requires:
+///   The rectangle must be inside the original image.
+///   The view must be destroyed before img.
+/// Ensures:
+///   The pixels of img are not copied nor modified.
+/// Pasting or blending a view into an overlapping region of the same
+/// pixels is not supported.
+/// 
+/// On success, a new image (view) is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageView(Image img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  assert (ImageValidRect(img, x, y, w, h));
+  Image view = NULL;
+  int success =
+  ownPixels(img) &&  // writes through the view must not reach any clone
+  check( (view = (Image)malloc(sizeof(struct image))) != NULL, "Allocating view failed" );
+  if (!success) return NULL;
+
+  *view = *img;  // same pixel array, layout and stride
+  view->width = w;
+  view->height = h;
+  view->x0 = img->x0 + x;
+  view->y0 = img->y0 + y;
+  view->owner = (img->owner != NULL) ? img->owner : img;
+  atomic_init(&view->views, 0);
+  view->cache = NULL;
+  atomic_fetch_add(&view->owner->views, 1);
+  return view;
 }
 
 
 /// Operations on two images
 
+// ImagePaste and ImageBlend run in parallel over the rows of img2, unless
+// img2 shares the pixel array of img1 (a view of it, say): then they may
+// overlap, and the rows must be done in order.
+
+typedef struct {
+  Image img1, img2;
+  int x, y;
+  double alpha;
+} Paste;
+
+static void pasteRows(void* arg, int worker, int y0, int y1) {
+  (void)worker;
+  Paste* p = (Paste*)arg;
+  Image img2 = p->img2;
+  uint8 buf[TSIDE];
+  for(int j=y0; j<y1; j++) {
+    for(int i=0; i<img2->width; i+=TSIDE) {
+      int n = (img2->width - i < TSIDE) ? img2->width - i : TSIDE;
+      putRow(p->img1, p->x+i, p->y+j, n, readRow(img2, i, j, n, buf));
+    }
+  }
+}
+
+static void blendRows(void* arg, int worker, int y0, int y1) {
+  (void)worker;
+  Paste* p = (Paste*)arg;
+  Image img2 = p->img2;
+  double alpha = p->alpha;
+  double newPixel;  // Variável para guardar o novo valor do pixel
+  uint8 buf1[TSIDE], buf2[TSIDE];
+  for(int j=y0; j<y1; j++) {
+    for(int i=0; i<img2->width; i+=TSIDE) {
+      int n = (img2->width - i < TSIDE) ? img2->width - i : TSIDE;
+      uint8* row1 = readRow(p->img1, p->x+i, p->y+j, n, buf1);
+      const uint8* row2 = readRow(img2, i, j, n, buf2);
+      for (int k = 0; k < n; k++) {
+        newPixel = (1 - alpha) * row1[k] + alpha * row2[k];
+        newPixel = (newPixel < 0) ? 0 : ((newPixel > PixMax) ? PixMax : newPixel); 
+        row1[k] = (uint8)(newPixel+0.5);
+      }
+      writeRow(p->img1, p->x+i, p->y+j, n, row1);
+    }
+  }
+}
+
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place, and only allocates memory if img1 shares
+/// its pixels with a clone.
 /// Requires: img2 must fit inside img1 at position (x, y).
-void ImagePaste(Image img1, int x, int y, Image img2) { ///
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img1 is
+/// left unchanged.
+int ImagePaste(Image img1, int x, int y, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));
   // Insert your code here!
 
   /* 
-    Para fazer o paste da imagem, temos de percorrer todos os pixeis
-    da imagem e depois copiar os pixeis da imagem original para a nova
-    imagem.
+    Para fazer o paste da imagem, copiamos cada linha de img2 para a
+    posição correspondente de img1, em segmentos de TSIDE pixeis.
   */
-  for(int i=0; i<img2->width; i++) {
-    for(int j=0; j<img2->height; j++) {
-
-      if ((x+i < img1->width) && (y + j < img1->height)) {
-        ImageSetPixel(img1, i+x, j+y, ImageGetPixel(img2, i, j));
-      }
-    }
+  if (!ownPixels(img1)) return 0;
+  touch(img1, x, y, img2->width, img2->height);
+  Paste p = { img1, img2, x, y, 0.0 };
+  size_t cost = (size_t)img2->width * img2->height;
+  if (img1->pixel != img2->pixel) {
+    parallelRows(img2->height, cost, pasteRows, &p);
+  } else {
+    pasteRows(&p, 0, 0, img2->height);
   }
+  COUNT(PIXMEM, 2ul * img2->width * img2->height);  // count pixel memory accesses
+  return 1;
 }
 
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place, and only allocates memory if img1 shares
+/// its pixels with a clone.
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
-void ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img1 is
+/// left unchanged.
+int ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));
   // Insert your code here!
 
-  double newPixel;  // Variável para guardar o novo valor do pixel
-
   /* 
-    Para fazer o blend da imagem, temos de percorrer todos os pixeis
-    da imagem e depois calcular o novo valor do pixel.
+    Para fazer o blend da imagem, percorremos as linhas de img2 (em
+    segmentos de TSIDE pixeis) e calculamos o novo valor de cada pixel
+    de img1.
   */
-  for(int i=0; i<img2->width; i++) {
-    for(int j=0; j<img2->height; j++) {
+  if (!ownPixels(img1)) return 0;
+  touch(img1, x, y, img2->width, img2->height);
+  Paste p = { img1, img2, x, y, alpha };
+  size_t cost = 4 * (size_t)img2->width * img2->height;
+  if (img1->pixel != img2->pixel) {
+    parallelRows(img2->height, cost, blendRows, &p);
+  } else {
+    blendRows(&p, 0, 0, img2->height);
+  }
+  COUNT(PIXMEM, 3ul * img2->width * img2->height);  // count pixel memory accesses
+  return 1;
+}
 
-      newPixel = (1 - alpha) * ImageGetPixel(img1, x + i, j + y) + alpha * ImageGetPixel(img2, i, j);
-      newPixel = (newPixel < 0) ? 0 : ((newPixel > PixMax) ? PixMax : newPixel); 
-      ImageSetPixel(img1, i + x, j + y, (uint8)(newPixel+0.5));
+// ImageComposite works on the TSIDE x TSIDE tiles of base (aligned to its
+// origin) covered by some layer: each one is loaded once, every layer that
+// overlaps it is blended in, in order, and it is stored back.  Rows of
+// tiles run in parallel.
+// Mask levels are first scaled to [0,255] (if their maxval is not 255),
+// and then blended in 8 bit fixed point (see blendSpan).
+
+typedef struct {
+  Image img, mask;
+  int x, y;               // position in base
+  Rect r;                 // the part of base it covers
+  int scale;              // mask levels must be scaled by lut
+  uint8 lut[256];
+} Layer;
+
+typedef struct {
+  Image base;
+  Layer* layer;
+  int n;
+  Rect box;               // bounding box of all layers, in whole tiles
+} Composite;
+
+// Blend q into d, n pixels, with alphas m/255: with weight w = m + m/128,
+// which is round(256 m / 255), d becomes (d (256-w) + q w + 128) / 256.
+// Every term fits 16 bits, so SSE2 does 16 pixels at a time.
+static void blendSpan(uint8* d, const uint8* q, const uint8* m, int n) {
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i k256 = _mm_set1_epi16(256);
+  const __m128i k128 = _mm_set1_epi16(128);
+  for (; i + 16 <= n; i += 16) {
+    __m128i dv = _mm_loadu_si128((const __m128i*)(d + i));
+    __m128i qv = _mm_loadu_si128((const __m128i*)(q + i));
+    __m128i mv = _mm_loadu_si128((const __m128i*)(m + i));
+    __m128i r[2];
+    for (int k = 0; k < 2; k++) {
+      __m128i dk = k ? _mm_unpackhi_epi8(dv, zero) : _mm_unpacklo_epi8(dv, zero);
+      __m128i qk = k ? _mm_unpackhi_epi8(qv, zero) : _mm_unpacklo_epi8(qv, zero);
+      __m128i mk = k ? _mm_unpackhi_epi8(mv, zero) : _mm_unpacklo_epi8(mv, zero);
+      __m128i wk = _mm_add_epi16(mk, _mm_srli_epi16(mk, 7));
+      __m128i sk = _mm_add_epi16(_mm_mullo_epi16(dk, _mm_sub_epi16(k256, wk)),
+                                 _mm_mullo_epi16(qk, wk));
+      r[k] = _mm_srli_epi16(_mm_add_epi16(sk, k128), 8);
     }
+    _mm_storeu_si128((__m128i*)(d + i), _mm_packus_epi16(r[0], r[1]));
+  }
+#endif
+  for (; i < n; i++) {
+    unsigned w = m[i] + (m[i] >> 7);
+    d[i] = (uint8)((d[i] * (256 - w) + q[i] * w + 128) >> 8);
   }
-
 }
 
-/// Compare an image to a subimage of a larger image.
-/// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
-/// Returns 0, otherwise.
-int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
-  assert (img1 != NULL);
-  assert (img2 != NULL);
-  assert (ImageValidPos(img1, x, y));
-  // Insert your code here!
-
-  /* 
-    Para fazer o match da imagem, temos de percorrer todos os pixeis
-    da imagem e depois comparar os pixeis da imagem original com os pixeis
-    da nova imagem.
-  */
-  for (int j = 0; j < img2->height; ++j) {
-    for (int i = 0; i < img2->width; ++i) {
-      uint8 pixel1 = ImageGetPixel(img1, x + i, y + j);
-      uint8 pixel2 = ImageGetPixel(img2, i, j);
-      NUMCOMP += 1;
-      if (pixel1 != pixel2) {
-        return 0;  // Mismatch found
+static void compositeRows(void* arg, int worker, int t0, int t1) {
+  (void)worker;
+  Composite* cp = (Composite*)arg;
+  Image base = cp->base;
+  uint8 tile[TSIDE * TSIDE];
+  uint8* row[TSIDE];
+  uint8 qbuf[TSIDE], mbuf[TSIDE];
+  for (int ty = t0; ty < t1; ty++) {
+    int y0 = cp->box.y0 + ty * TSIDE;
+    int y1 = (y0 + TSIDE < base->height) ? y0 + TSIDE : base->height;
+    for (int x0 = cp->box.x0; x0 < cp->box.x1; x0 += TSIDE) {
+      int x1 = (x0 + TSIDE < base->width) ? x0 + TSIDE : base->width;
+      int loaded = 0;
+      for (int i = 0; i < cp->n; i++) {
+        const Layer* L = &cp->layer[i];
+        Rect r = { (L->r.x0 > x0) ? L->r.x0 : x0, (L->r.y0 > y0) ? L->r.y0 : y0,
+                   (L->r.x1 < x1) ? L->r.x1 : x1, (L->r.y1 < y1) ? L->r.y1 : y1 };
+        if (r.x0 >= r.x1 || r.y0 >= r.y1) continue;
+        if (!loaded) {  // load the tile (or just find its rows, in a raster)
+          for (int j = 0; j < y1 - y0; j++) {
+            row[j] = readRow(base, x0, y0 + j, x1 - x0, tile + j * TSIDE);
+          }
+          loaded = 1;
+        }
+        int n = r.x1 - r.x0;
+        for (int y = r.y0; y < r.y1; y++) {
+          uint8* d = row[y - y0] + (r.x0 - x0);
+          const uint8* q = readRow(L->img, r.x0 - L->x, y - L->y, n, qbuf);
+          if (L->mask == NULL) {
+            memcpy(d, q, n);
+            continue;
+          }
+          const uint8* m = readRow(L->mask, r.x0 - L->x, y - L->y, n, mbuf);
+          if (L->scale) {
+            for (int k = 0; k < n; k++) mbuf[k] = L->lut[m[k]];
+            m = mbuf;
+          }
+          blendSpan(d, q, m, n);
+        }
+      }
+      if (loaded) {
+        for (int j = 0; j < y1 - y0; j++) {
+          writeRow(base, x0, y0 + j, x1 - x0, row[j]);
+        }
       }
     }
   }
+}
+
+/// Composite n layers into base, in one pass.
+/// Layer i is the image layers[i], placed with its top left corner at
+/// (offsets[2*i], offsets[2*i+1]) of base, and clipped to base (it need
+/// not fit inside).  Layers are applied in order, so later ones go on top.
+/// If masks != NULL and masks[i] != NULL, masks[i] is the alpha mask of
+/// layer i, of the same size: level m blends the layer pixel over base
+/// with alpha m/maxval of the mask (with 8 bits of precision).  Layers
+/// without a mask are opaque (as in ImagePaste).
+/// This modifies base in-place, and only allocates memory if base shares
+/// its pixels with a clone, besides O(n) bookkeeping.
+/// Requires: n >= 0; layers and masks do not share pixels with base (are
+/// not views of it, say).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and base is
+/// left unchanged.
+int ImageComposite(Image base, Image layers[], Image masks[], const int offsets[], int n) { ///
+  assert (base != NULL);
+  assert (n >= 0);
+  assert (n == 0 || (layers != NULL && offsets != NULL));
+  Composite cp = { base, NULL, 0, { base->width, base->height, 0, 0 } };
+  int success =
+  check( (cp.layer = (Layer*)malloc(((size_t)n + 1) * sizeof(Layer))) != NULL,
+         "Allocating layers failed" ) &&
+  ownPixels(base);
+  if (!success) {
+    errsave = errno;
+    free(cp.layer);
+    errno = errsave;
+    return 0;
+  }
+  size_t area = 0;
+  for (int i = 0; i < n; i++) {
+    Layer* L = &cp.layer[cp.n];
+    L->img = layers[i];
+    L->mask = (masks != NULL) ? masks[i] : NULL;
+    L->x = offsets[2*i];
+    L->y = offsets[2*i + 1];
+    assert (L->img != NULL && L->img->pixel != base->pixel);
+    assert (L->mask == NULL || (L->mask->width == L->img->width &&
+                                L->mask->height == L->img->height &&
+                                L->mask->pixel != base->pixel));
+    // Clip (in long, as offsets may be far out).
+    long x0 = L->x, y0 = L->y;
+    long x1 = x0 + L->img->width, y1 = y0 + L->img->height;
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > base->width) x1 = base->width;
+    if (y1 > base->height) y1 = base->height;
+    if (x0 >= x1 || y0 >= y1) continue;  // nothing to do
+    L->r = (Rect){ (int)x0, (int)y0, (int)x1, (int)y1 };
+    L->scale = (L->mask != NULL && L->mask->maxval != 255);
+    if (L->scale) {
+      for (int v = 0; v < 256; v++) {
+        int a = (v * 255 + L->mask->maxval / 2) / L->mask->maxval;
+        L->lut[v] = (a > 255) ? 255 : (uint8)a;
+      }
+    }
+    cp.box = rectUnion(cp.box, L->r);
+    area += (size_t)(x1 - x0) * (y1 - y0);
+    touch(base, L->r.x0, L->r.y0, L->r.x1 - L->r.x0, L->r.y1 - L->r.y0);
+    cp.n++;
+  }
+  if (cp.n > 0) {
+    cp.box.x0 -= cp.box.x0 % TSIDE;  // whole tiles
+    cp.box.y0 -= cp.box.y0 % TSIDE;
+    int nty = (cp.box.y1 - cp.box.y0 + TSIDE - 1) / TSIDE;
+    parallelRows(nty, 4 * area, compositeRows, &cp);
+  }
+  COUNT(PIXMEM, 3ul * area);  // count pixel memory accesses
+  free(cp.layer);
+  return 1;
+}
+
+/// Compare an image to a subimage of a larger image.
+/// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
+/// Returns 0, otherwise.
+int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (ImageValidPos(img1, x, y));
+  // Insert your code here!
+
+  /* 
+    Para fazer o match da imagem, comparamos as linhas de img2 com as
+    linhas correspondentes de img1, em segmentos de TSIDE pixeis, até
+    encontrar uma diferença.
+    Os contadores são atualizados uma só vez, no fim.
+  */
+  uint8 buf1[TSIDE], buf2[TSIDE];
+  int match = 1;
+  unsigned long reads = 0;  // pixeis lidos de cada imagem
+  unsigned long cmps = 0;   // comparações feitas
+  for (int j = 0; match && j < img2->height; ++j) {
+    for (int i = 0; match && i < img2->width; i += TSIDE) {
+      int n = (img2->width - i < TSIDE) ? img2->width - i : TSIDE;
+      const uint8* row1 = readRow(img1, x + i, y + j, n, buf1);
+      const uint8* row2 = readRow(img2, i, j, n, buf2);
+      int k = 0;
+      while (k < n && row1[k] == row2[k]) k++;
+      reads += n;
+      cmps += (k < n) ? k + 1 : n;
+      match = (k == n);  // Mismatch found?
+    }
+  }
+  COUNT(PIXMEM, 2ul * reads);  // count pixel memory accesses
+  COUNT(NUMCOMP, cmps);
 
-  return 1;  // Subimage matches
+  return match;  // 1 if subimage matches
 }
 
 /// Locate a subimage inside another image.
@@ -660,8 +2448,8 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
     da imagem e depois comparar os pixeis da imagem original com os pixeis
     da nova imagem, esta comparação faz-se usando a função ImageMatchSubImage().
   */
-  for(int i=0; i < (img1->width - img2->width); i++) {
-    for(int j=0; j < (img1->height - img2->height); j++) {
+  for(int i=0; i <= (img1->width - img2->width); i++) {
+    for(int j=0; j <= (img1->height - img2->height); j++) {
 
       if (ImageMatchSubImage(img1, i, j, img2)) {
         *px = i;
@@ -673,126 +2461,2694 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
   } return 0;
 }
 
+// Tolerant matching compares row segments of up to TSIDE pixels with
+// rowSAD, and gives up on a candidate as soon as a pixel is out of
+// tolerance or the running SAD exceeds the budget.  With SSE2, PSADBW
+// (_mm_sad_epu8) sums 16 absolute differences at a time; masked out
+// pixels are zeroed in both rows first, so they add nothing.
+
+// Sum of the absolute differences of the n <= TSIDE pixels of a and b,
+// skipping those where m (if not NULL) is 0.
+// Returns -1 if some difference exceeds tol.
+static long rowSAD(const uint8* a, const uint8* b, const uint8* m, int n, int tol) {
+  long sad = 0;
+  int k = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i tv = _mm_set1_epi8((char)tol);
+  __m128i acc = zero;
+  for (; k + 16 <= n; k += 16) {
+    __m128i av = _mm_loadu_si128((const __m128i*)(a + k));
+    __m128i bv = _mm_loadu_si128((const __m128i*)(b + k));
+    if (m != NULL) {
+      __m128i off = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(m + k)), zero);
+      av = _mm_andnot_si128(off, av);
+      bv = _mm_andnot_si128(off, bv);
+    }
+    __m128i d = _mm_or_si128(_mm_subs_epu8(av, bv), _mm_subs_epu8(bv, av));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(d, tv), zero)) != 0xFFFF) return -1;
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(av, bv));
+  }
+  // Each half holds at most TSIDE*255: the low 32 bits will do.
+  sad = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+  for (; k < n; k++) {
+    if (m != NULL && m[k] == 0) continue;
+    int d = (a[k] > b[k]) ? a[k] - b[k] : b[k] - a[k];
+    if (d > tol) return -1;
+    sad += d;
+  }
+  return sad;
+}
 
-/// Filtering
+/// Compare an image to a subimage of a larger image, with tolerance.
+/// Pixels of img2 where mask (if not NULL, an image of the same size) is 0
+/// are ignored.  img2 matches the subimage of img1 at pos (x, y) if each
+/// other pixel differs from the one it covers by at most tol levels, and
+/// the sum of those absolute differences (SAD) is at most budget (or any,
+/// if budget < 0).  With tol = 0 and no mask, this is ImageMatchSubImage.
+/// Requires: img2 fits inside img1 at pos (x, y); 0 <= tol <= 255.
+/// Returns 1 (true) if it matches, 0 otherwise.
+int ImageMatchSubImageTol(Image img1, int x, int y, Image img2, Image mask, int tol, long budget) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (0 <= x && x <= img1->width - img2->width);
+  assert (0 <= y && y <= img1->height - img2->height);
+  assert (mask == NULL || (mask->width == img2->width && mask->height == img2->height));
+  assert (0 <= tol && tol <= PixMax);
+  uint8 buf1[TSIDE], buf2[TSIDE], bufm[TSIDE];
+  long sad = 0;
+  int match = 1;
+  unsigned long reads = 0;  // pixeis lidos de cada imagem
+  for (int j = 0; match && j < img2->height; ++j) {
+    for (int i = 0; match && i < img2->width; i += TSIDE) {
+      int n = (img2->width - i < TSIDE) ? img2->width - i : TSIDE;
+      const uint8* row1 = readRow(img1, x + i, y + j, n, buf1);
+      const uint8* row2 = readRow(img2, i, j, n, buf2);
+      const uint8* rowm = (mask != NULL) ? readRow(mask, i, j, n, bufm) : NULL;
+      long d = rowSAD(row1, row2, rowm, n, tol);
+      reads += n;
+      sad += d;
+      match = (d >= 0) && (budget < 0 || sad <= budget);
+    }
+  }
+  COUNT(PIXMEM, ((mask != NULL) ? 3ul : 2ul) * reads);  // count pixel memory accesses
+  COUNT(NUMCOMP, reads);
+  return match;
+}
 
-/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
-/// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
-/// The image is changed in-place.
-void ImageBlur(Image img, int dx, int dy) {
-  /*
-  
-    ! Função Básica:
+/// Locate a subimage inside another image, with tolerance.
+/// Searches for img2 inside img1, as ImageLocateSubImage, but matching
+/// as ImageMatchSubImageTol (with the given mask, tol and budget).
+/// If a match is found, returns 1 and the first matching position (in the
+/// order of ImageLocateSubImage) is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// Requires: 0 <= tol <= 255; mask is NULL or has the size of img2.
+int ImageLocateSubImageTol(Image img1, int* px, int* py, Image img2, Image mask, int tol, long budget) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (px != NULL && py != NULL);
+  for (int i = 0; i <= img1->width - img2->width; i++) {
+    for (int j = 0; j <= img1->height - img2->height; j++) {
+      if (ImageMatchSubImageTol(img1, i, j, img2, mask, tol, budget)) {
+        *px = i;
+        *py = j;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
 
-    assert(img != NULL);
 
-    Image tempImg = ImageCreate(img->width, img->height, img->maxval);
+/// Filtering
 
-    for(int x=0; x < img->width; x++) {
-      for(int y=0; y < img->height; y++) {
+// ImageBlur has three implementations, all exact (integer sums), so they
+// give the same results:
+//   BLUR_DIRECT sums each window from scratch: down the columns, then
+//     along the row.  Its cost grows with dx+dy, but its loops are short
+//     and simple, and it wins for small windows;
+//   BLUR_SAT builds a summed area table, then takes 4 entries per pixel;
+//   BLUR_RUNNING keeps running sums: the column sums of a band of rows are
+//     updated as one row enters the window and another leaves it, and
+//     the row sums likewise along each row.
+// The cost of the last two does not depend on the window.  ImageBlur picks
+// one from the window and image sizes (see blurChoose).
+//
+// BLUR_SAT builds its summed area table in parallel: first the prefix sums
+// of each row, then the running sums down strips of SATSTRIP columns; the
+// output rows are then computed in parallel too.  Integer sums are exact,
+// so the split does not matter.
+
+#define SATSTRIP 256
+
+typedef struct {
+  Image img;
+  int dx, dy;
+  int64_t* sat;           // summed area table, (w+1)x(h+1)
+                          // (32 bits overflow with 2^31/255 white pixels)
+  uint8* buf;             // a row buffer for each worker
+  Image dst;              // the result (BLUR_DIRECT, BLUR_RUNNING)
+  int64_t* col;           // column sums of each worker (idem)
+} Blur;
+
+// Rounded mean of a window of n pixels with the given sum.
+static inline uint8 windowMean(int64_t sum, int64_t n) {
+  return (uint8)((double)sum / (double)n + 0.5);
+}
 
-        double sum = 0.0;
-        int count = 0;
+static void satRows(void* arg, int worker, int y0, int y1) {
+  Blur* b = (Blur*)arg;
+  int w = b->img->width;
+  size_t sw = (size_t)w + 1;
+  uint8* buf = b->buf + (size_t)worker * sw;
+  for (int y = y0; y < y1; y++) {
+    const uint8* row = readRow(b->img, 0, y, w, buf);
+    int64_t* s1 = b->sat + (y + 1) * sw + 1;   // linha y
+    for (int x = 0; x < w; x++) {
+      s1[x] = row[x] + s1[x-1];
+    }
+  }
+}
 
-        for(int i=-dx; i < (dx+1); i++) {
-          for(int j=-dy; j < (dy+1); j++) {
+static void satColumns(void* arg, int worker, int s0, int s1) {
+  (void)worker;
+  Blur* b = (Blur*)arg;
+  int w = b->img->width;
+  int h = b->img->height;
+  size_t sw = (size_t)w + 1;
+  size_t c0 = 1 + (size_t)s0 * SATSTRIP;
+  size_t c1 = 1 + (size_t)s1 * SATSTRIP;
+  if (c1 > sw) c1 = sw;
+  for (int y = 2; y <= h; y++) {
+    int64_t* r1 = b->sat + y * sw;
+    const int64_t* r0 = r1 - sw;
+    for (size_t c = c0; c < c1; c++) r1[c] += r0[c];
+  }
+}
 
-            if (ImageValidPos(img, i+x, j+y)) {
-              sum += ImageGetPixel(img, i+x, j+y);
-              count++;
-            }
-          }
-        }
+static void blurRows(void* arg, int worker, int ya, int yb) {
+  Blur* b = (Blur*)arg;
+  int w = b->img->width;
+  int h = b->img->height;
+  int dx = b->dx, dy = b->dy;
+  size_t sw = (size_t)w + 1;
+  uint8* buf = b->buf + (size_t)worker * sw;
+  for (int y = ya; y < yb; y++) {
+    // Janela [x0, x1[ x [y0, y1[, limitada aos limites da imagem
+    int y0 = (y - dy > 0) ? y - dy : 0;
+    int y1 = (y + dy + 1 < h) ? y + dy + 1 : h;
+    const int64_t* top = b->sat + y0 * sw;
+    const int64_t* bot = b->sat + y1 * sw;
+    for (int x = 0; x < w; x++) {
+      int x0 = (x - dx > 0) ? x - dx : 0;
+      int x1 = (x + dx + 1 < w) ? x + dx + 1 : w;
+      int64_t sum = bot[x1] - bot[x0] - top[x1] + top[x0];
+      // Temos que acrescentar 0.5 à media para podermos ter arredondamentos corretos
+      buf[x] = windowMean(sum, (int64_t)(x1 - x0) * (y1 - y0));
+    }
+    putRow(b->img, 0, y, w, buf);
+  }
+}
 
-        double media = sum / count;
+// Add (sign 1) or subtract (sign -1) row y of img to the column sums col.
+static void addColumns(Image img, int y, int64_t* col, int sign, uint8* buf) {
+  int w = img->width;
+  const uint8* row = readRow(img, 0, y, w, buf);
+  if (sign > 0) {
+    for (int x = 0; x < w; x++) col[x] += row[x];
+  } else {
+    for (int x = 0; x < w; x++) col[x] -= row[x];
+  }
+}
 
-        ImageSetPixel(tempImg, x, y, (uint8)(media+0.5));
+// BLUR_DIRECT: rows [ya,yb) of b->dst.
+// Column sums take 32 bits (DIRECTROWS rows at most), so they vectorize
+// better.
+#define DIRECTROWS (UINT32_MAX / 255)
+
+static void blurDirectRows(void* arg, int worker, int ya, int yb) {
+  Blur* b = (Blur*)arg;
+  int w = b->img->width;
+  int h = b->img->height;
+  int dx = b->dx, dy = b->dy;
+  uint8* buf = b->buf + (size_t)worker * 2 * w;
+  uint8* out = buf + w;
+  uint32_t* col = (uint32_t*)(b->col + (size_t)worker * w);
+  for (int y = ya; y < yb; y++) {
+    int y0 = (y - dy > 0) ? y - dy : 0;
+    int y1 = (y + dy + 1 < h) ? y + dy + 1 : h;
+    memset(col, 0, w * sizeof(uint32_t));
+    for (int r = y0; r < y1; r++) {
+      const uint8* row = readRow(b->img, 0, r, w, buf);
+      for (int x = 0; x < w; x++) col[x] += row[x];
+    }
+    for (int x = 0; x < w; x++) {
+      int x0 = (x - dx > 0) ? x - dx : 0;
+      int x1 = (x + dx + 1 < w) ? x + dx + 1 : w;
+      int64_t sum = 0;
+      for (int i = x0; i < x1; i++) sum += col[i];
+      out[x] = windowMean(sum, (int64_t)(x1 - x0) * (y1 - y0));
+    }
+    putRow(b->dst, 0, y, w, out);
+  }
+}
 
-      }
+// BLUR_RUNNING: rows [ya,yb) of b->dst.
+// The band first sums the columns of the window of its first row.
+static void blurRunningRows(void* arg, int worker, int ya, int yb) {
+  Blur* b = (Blur*)arg;
+  int w = b->img->width;
+  int h = b->img->height;
+  int dx = b->dx, dy = b->dy;
+  uint8* buf = b->buf + (size_t)worker * 2 * w;
+  uint8* out = buf + w;
+  int64_t* col = b->col + (size_t)worker * w;
+  int y0 = (ya - dy > 0) ? ya - dy : 0;
+  int y1 = (ya + dy + 1 < h) ? ya + dy + 1 : h;
+  memset(col, 0, w * sizeof(int64_t));
+  for (int r = y0; r < y1; r++) addColumns(b->img, r, col, 1, buf);
+  int head = (dx < w) ? dx : w;   // columns of the window of x = 0, but col[dx]
+  for (int y = ya; y < yb; y++) {
+    // Window [y0, y1[ of row y: sums along the row, from that of x = 0.
+    int64_t rows = y1 - y0;
+    int64_t sum = 0;
+    for (int x = 0; x < head; x++) sum += col[x];
+    for (int x = 0; x < w; x++) {
+      if (x + dx < w) sum += col[x + dx];       // column entering
+      int x0 = (x - dx > 0) ? x - dx : 0;
+      int x1 = (x + dx + 1 < w) ? x + dx + 1 : w;
+      out[x] = windowMean(sum, (x1 - x0) * rows);
+      if (x - dx >= 0) sum -= col[x - dx];      // column leaving
+    }
+    putRow(b->dst, 0, y, w, out);
+    if (y + 1 < yb) {  // move the window down
+      if (y + dy + 1 < h) { addColumns(b->img, y + dy + 1, col, 1, buf); y1++; }
+      if (y - dy >= 0) { addColumns(b->img, y - dy, col, -1, buf); y0++; }
     }
+  }
+}
 
-    for(int x=0; x < img->width; x++) {
-      for(int y=0; y < img->height; y++) {
-        ImageSetPixel(img, x, y, ImageGetPixel(tempImg, x, y));
-      }
-    } 
+// BLUR_SAT.  Same contract as ImageBlur.
+static int blurSAT(Image img, int dx, int dy) {
+  int w = img->width;
+  int h = img->height;
 
-    ImageDestroy(&tempImg);
-  
+  /*
+    Aqui etsamos a criar uma summed Area Table: Serve para acelerar o cálculo da soma dos
+    valores de uma imagem para uma matriz bidimensional. Com a summed area table, é possível
+    acelerar o processo tornando muito útil para algoritmos de blur.
+    A tabela tem (w+1)x(h+1) entradas, guardadas linha a linha, com uma linha e uma coluna
+    de zeros no início: sat[(y+1)*(w+1) + (x+1)] é a soma dos pixeis em [0,x]x[0,y].
   */
+  size_t sw = (size_t)w + 1;
+  Blur b = { img, dx, dy, NULL, NULL, NULL, NULL };
+  int success =
+  check( (b.sat = (int64_t*)calloc(sw * (h + 1), sizeof(int64_t))) != NULL &&
+         (b.buf = (uint8*)malloc(parallelWorkers() * sw)) != NULL,
+         "Allocating summed area table failed" ) &&
+  ownPixels(img);
+  if (!success) {  // Sem memória: a imagem fica inalterada
+    errsave = errno;
+    free(b.sat);
+    free(b.buf);
+    errno = errsave;
+    return 0;
+  }
 
-  //! FUnção melhorada
-
-  // Insert your code here!
-  assert(img != NULL);  //Verificar se a imagem está NULL!
+  touchAll(img);
 
-  int sum, minX, minY, maxX, maxY;
+  // Preenchimento da summed area table (Funcionamento explicado no relatório):
+  // somas de cada linha, e depois acumuladas ao longo das colunas.
+  parallelRows(h, (size_t)w * h, satRows, &b);
+  parallelRows((int)((sw - 1 + SATSTRIP - 1) / SATSTRIP), (size_t)w * h, satColumns, &b);
+  COUNT(NUMOPERACOES, 3ul * w * h);
 
   /*
-    Aqui etsamos a criar uma summed Area Table: Serve para acelerar o cálculo da soma dos
-    valores de uma imagem para uma matriz bidimensional. Com a summed area table, é possível
-    acelerar o processo tornando muito útil para algoritmos de blur.
+    Depois de criada a summed area table, temos que iterar sobre cada pixel da imagem inicial, aplciando
+    uma janela centrada no pixel de ((2 * dx + 1) x (2 * dy + 1)). Esta janela define a area a qual 
+    será aplicado o blur, limitada aos pixeis dentro da imagem. Para isso, neste loop apenas temos de calcular
+    a média pois a soma desses valores já está guardada na summed area table. Por fim guardamos na imagem
+    original no pixel o valor calculado.
   */
-  int **summedAreaTable = (int **)malloc((img->width + 1) * sizeof(int *));
-  for (int i = 0; i < img->width + 1; i++) {
-    summedAreaTable[i] = (int *)malloc((img->height + 1) * sizeof(int));
+  parallelRows(h, 4 * (size_t)w * h, blurRows, &b);
+  COUNT(NUMCOMP, 4ul * w * h);
+  COUNT(NUMOPERACOES, 3ul * w * h);
+
+  COUNT(PIXMEM, 2ul * w * h);  // count pixel memory accesses
+
+  free(b.sat);  //Liberta a memória alocada para a tabela de soma
+  free(b.buf);
+  return 1;
+}
+
+// BLUR_DIRECT and BLUR_RUNNING, into a new pixel array that img then
+// adopts.  Same contract as ImageBlur.
+static int blurSums(Image img, int dx, int dy, BlurMethod method) {
+  int w = img->width;
+  int h = img->height;
+  int nw = parallelWorkers();
+  Blur b = { img, dx, dy, NULL, NULL, NULL, NULL };
+  if (method == BLUR_DIRECT && (dy >= h ? h : 2*(int64_t)dy + 1) > DIRECTROWS) {
+    method = BLUR_RUNNING;  // column sums could overflow
+  }
+  int success =
+  check( (b.buf = (uint8*)malloc(nw * 2 * (size_t)w + 1)) != NULL &&
+         (b.col = (int64_t*)malloc(nw * (size_t)w * sizeof(int64_t) + 1)) != NULL,
+         "Allocating blur buffers failed" ) &&
+  (b.dst = newImage(w, h, img->maxval, img->layout)) != NULL;
+  if (success) {
+    // Cost per pixel: dx+dy additions, or about 4; bands of the running
+    // version start by summing 2dy+1 rows.
+    int ex = (dx < w) ? dx : w;
+    int ey = (dy < h) ? dy : h;
+    if (method == BLUR_DIRECT) {
+      parallelRows(h, (size_t)w * h * (ex + ey + 2), blurDirectRows, &b);
+      COUNT(NUMOPERACOES, (unsigned long)w * h * (2*ex + 2*ey + 2));
+    } else {
+      parallelRowsGrain(h, 4 * (size_t)w * h, 4ul * (2*ey + 1), blurRunningRows, &b);
+      COUNT(NUMOPERACOES, 4ul * w * h);
+    }
+    // img gets the result, and the old pixels go away.
+    adoptPixels(img, b.dst);
+    COUNT(PIXMEM, 3ul * w * h);  // count pixel memory accesses
   }
+  errsave = errno;
+  ImageDestroy(&b.dst);
+  free(b.buf);
+  free(b.col);
+  errno = errsave;
+  return success;
+}
 
-  // Preenchimento da summed area table (Funcionamento explicado no relatório)
-  for (int y = 0; y < img->height; y++) {
-    for (int x = 0; x < img->width; x++) {
+// Blur method selection.
+//
+// BLUR_DIRECT is used while dx+dy (limited to the image) is at most
+// blurDirectMax, and then BLUR_SAT for images of at most blurSATMax
+// pixels, and BLUR_RUNNING for larger ones.  (-1 disables either.)
+// These thresholds are measured once by blurTune, and kept in a config
+// file: IMAGE8BIT_BLURCONF from the environment, or else ~/.image8bit-blur-N
+// for instrumentation level N.  Counting changes the speed of the methods,
+// so the header names the level too, and a file measured at another level
+// is measured again.
+// A method may be forced with ImageSetBlurMethod, or from the environment
+// variable IMAGE8BIT_BLUR (direct, sat or running).
+
+static atomic_int blurForced = BLUR_AUTO;  // set by ImageSetBlurMethod
+static int blurDirectMax = -1;
+static long blurSATMax = -1;
+
+#define BLURCONF_HEADER "image8bit blur thresholds 2, instr"
+#define TUNEMAX 16        // largest dx+dy tried for BLUR_DIRECT
+
+// Path of the config file, in buf (of size n), or NULL if there is none.
+static const char* blurConfPath(char* buf, size_t n) {
+  const char* env = getenv("IMAGE8BIT_BLURCONF");
+  if (env != NULL) return env;
+  const char* home = getenv("HOME");
+  if (home == NULL ||
+      (size_t)snprintf(buf, n, "%s/.image8bit-blur-%d", home, INSTR_LEVEL) >= n) return NULL;
+  return buf;
+}
 
-      NUMCOMP += 3;
+// Elapsed time of one blur of img (restored after), in seconds.
+static double blurTime(Image img, int dx, int dy, BlurMethod method) {
+  Image copy = ImageCrop(img, 0, 0, img->width, img->height);
+  if (copy == NULL) return INFINITY;
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  int ok = (method == BLUR_SAT) ? blurSAT(copy, dx, dy) : blurSums(copy, dx, dy, method);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  ImageDestroy(&copy);
+  if (!ok) return INFINITY;
+  return (double)(t1.tv_sec - t0.tv_sec) + 1e-9 * (double)(t1.tv_nsec - t0.tv_nsec);
+}
 
-      sum = ImageGetPixel(img, x, y);
+// Best of 3 times of blurTime.
+static double blurBest(Image img, int dx, int dy, BlurMethod method) {
+  double best = INFINITY;
+  for (int i = 0; i < 3; i++) {
+    double t = blurTime(img, dx, dy, method);
+    if (t < best) best = t;
+  }
+  return best;
+}
 
-      if (x != 0) {
-        sum += summedAreaTable[x-1][y]; NUMOPERACOES+=1; // Deve slatar a linha de indice 0
-      }
-      if (y != 0) {
-        sum += summedAreaTable[x][y-1]; NUMOPERACOES+=1;   // Deve slatar a coluna de indice 0
+// Time the methods on test images, to set the thresholds.
+static void blurMeasure(void) {
+  static const int sides[] = { 128, 512, 1536 };
+  Image img = NULL;
+  blurDirectMax = -1;
+  blurSATMax = -1;
+  for (size_t i = 0; i < sizeof(sides) / sizeof(sides[0]); i++) {
+    int n = sides[i];
+    ImageDestroy(&img);
+    if ((img = newImage(n, n, PixMax, LAYOUT_RASTER)) == NULL) break;
+    for (size_t p = 0; p < (size_t)n * n; p++) {  // some texture
+      img->pixel[p] = (uint8)((p * 2654435761u) >> 13);
+    }
+    if (n == 512) {  // direct vs running, as the window grows
+      for (int s = 0; s <= TUNEMAX; s++) {
+        if (blurBest(img, s / 2, s - s / 2, BLUR_DIRECT) >
+            blurBest(img, s / 2, s - s / 2, BLUR_RUNNING)) break;
+        blurDirectMax = s;
       }
-      if ((x != 0 && y != 0)) {
-        sum -= summedAreaTable[x-1][y-1]; NUMOPERACOES+=1;  // Deve slatar a linha e a coluna de indice 0
+    }
+    if (blurBest(img, 8, 8, BLUR_SAT) <= blurBest(img, 8, 8, BLUR_RUNNING)) {
+      blurSATMax = (long)n * n;
+    }
+  }
+  if (blurSATMax == (long)sides[2] * sides[2]) blurSATMax = LONG_MAX;
+  ImageDestroy(&img);
+}
+
+// Load the thresholds from the config file, or else measure them (and
+// try to save them there).  Run once.
+static void blurTune(void) {
+  char buf[4096];
+  const char* path = blurConfPath(buf, sizeof(buf));
+  int saved = errno;  // not errsave: blurMeasure uses it
+  FILE* f = (path != NULL) ? fopen(path, "r") : NULL;
+  if (f != NULL) {
+    char header[64], expected[64];
+    snprintf(expected, sizeof(expected), "%s %d\n", BLURCONF_HEADER, INSTR_LEVEL);
+    int ok = fgets(header, sizeof(header), f) != NULL &&
+             strcmp(header, expected) == 0 &&
+             fscanf(f, " direct %d sat %ld", &blurDirectMax, &blurSATMax) == 2;
+    fclose(f);
+    if (ok) { errno = saved; return; }
+  }
+  // The measurements should not show in the instrumentation counters,
+  // neither of this thread nor of the pool threads (see instrMuted).
+  unsigned long counts[NUMCOUNTERS];
+  memcpy(counts, InstrCount, sizeof(counts));
+  instrMuted = 1;
+  blurMeasure();
+  instrMuted = 0;
+  memcpy(InstrCount, counts, sizeof(counts));
+  f = (path != NULL) ? fopen(path, "w") : NULL;
+  if (f != NULL) {
+    fprintf(f, "%s %d\ndirect %d\nsat %ld\n", BLURCONF_HEADER, INSTR_LEVEL,
+            blurDirectMax, blurSATMax);
+    fclose(f);
+  }
+  errno = saved;
+}
+
+// The method forced by ImageSetBlurMethod or IMAGE8BIT_BLUR, or BLUR_AUTO.
+static BlurMethod blurForcedMethod(void) {
+  BlurMethod m = (BlurMethod)atomic_load(&blurForced);
+  if (m != BLUR_AUTO) return m;
+  const char* env = getenv("IMAGE8BIT_BLUR");
+  if (env == NULL) return BLUR_AUTO;
+  if (strcmp(env, "direct") == 0) return BLUR_DIRECT;
+  if (strcmp(env, "sat") == 0) return BLUR_SAT;
+  if (strcmp(env, "running") == 0) return BLUR_RUNNING;
+  return BLUR_AUTO;
+}
+
+// The method ImageBlur uses for a width x height image.
+static BlurMethod blurChoose(int width, int height, int dx, int dy) {
+  BlurMethod m = blurForcedMethod();
+  if (m != BLUR_AUTO) return m;
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, blurTune);
+  long ex = (dx < width) ? dx : width;
+  long ey = (dy < height) ? dy : height;
+  if (ex + ey <= blurDirectMax) return BLUR_DIRECT;
+  if ((long)width * height <= blurSATMax) return BLUR_SAT;
+  return BLUR_RUNNING;
+}
+
+/// Force ImageBlur to use the given method (see BlurMethod).
+/// BLUR_AUTO restores the automatic choice (or the method named by the
+/// environment variable IMAGE8BIT_BLUR, if any).
+/// All methods give the same results: this is meant for testing and
+/// benchmarking.
+void ImageSetBlurMethod(BlurMethod method) { ///
+  assert (BLUR_AUTO <= method && method <= BLUR_RUNNING);
+  atomic_store(&blurForced, method);
+}
+
+/// Get the method ImageBlur uses for a width x height image and a
+/// (2dx+1)x(2dy+1) window.
+/// The first automatic choice may take a few seconds (more with full
+/// instrumentation), to measure the methods on this machine, unless that
+/// was done before: the thresholds measured are kept in the file named by
+/// the environment variable IMAGE8BIT_BLURCONF, or else ~/.image8bit-blur-N,
+/// where N is the instrumentation level of the build (INSTR_LEVEL).
+/// Requires: width, height, dx and dy must be non-negative.
+BlurMethod ImageBlurMethod(int width, int height, int dx, int dy) { ///
+  assert (width >= 0 && height >= 0);
+  assert (dx >= 0 && dy >= 0);
+  return blurChoose(width, height, dx, dy);
+}
+
+/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
+/// Each pixel is substituted by the mean of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] (only those inside the image), rounded.
+/// The image is changed in-place.
+/// The method (see ImageBlurMethod) does not change the result.
+/// Requires: dx >= 0, dy >= 0.
+/// (This involves allocation, and may fail.)
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageBlur(Image img, int dx, int dy) { ///
+  assert(img != NULL);  //Verificar se a imagem está NULL!
+  assert (dx >= 0 && dy >= 0);
+  int w = img->width;
+  int h = img->height;
+  if (w == 0 || h == 0) return 1;
+  BlurMethod method = blurChoose(w, h, dx, dy);
+  if (method == BLUR_SAT) return blurSAT(img, dx, dy);
+  return blurSums(img, dx, dy, method);
+}
+
+/// Compute the integral image (summed area table) of img.
+/// Returns an array of (w+1)*(h+1) sums, row by row, where w and h are the
+/// dimensions of img: entry y*(w+1)+x is the sum of the levels of the
+/// pixels in [0,x[ x [0,y[ (so row 0 and column 0 are zeros).
+/// The array is kept with img, and belongs to it: it is valid until img is
+/// next modified or destroyed.  Later calls only recompute the sums that
+/// may have changed since: those below and to the right of the top left
+/// corner of the changed pixels.
+/// Requires: img is not a view.
+/// (This involves allocation, and may fail.)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+const int64_t* ImageIntegral(Image img) { ///
+  assert (img != NULL);
+  assert (img->owner == NULL);
+  int w = img->width;
+  int h = img->height;
+  size_t sw = (size_t)w + 1;
+  struct cache* c = getCache(img);
+  if (c == NULL) return NULL;
+  if (c->sat == NULL) {
+    Blur b = { img, 0, 0, NULL, NULL, NULL, NULL };
+    int success =
+    check( (b.sat = (int64_t*)calloc(sw * (h + 1), sizeof(int64_t))) != NULL &&
+           (b.buf = (uint8*)malloc(parallelWorkers() * sw)) != NULL,
+           "Allocating summed area table failed" );
+    if (!success) {
+      errsave = errno;
+      free(b.sat);
+      free(b.buf);
+      errno = errsave;
+      return NULL;
+    }
+    parallelRows(h, (size_t)w * h, satRows, &b);
+    parallelRows((int)((sw - 1 + SATSTRIP - 1) / SATSTRIP), (size_t)w * h, satColumns, &b);
+    free(b.buf);
+    COUNT(PIXMEM, (unsigned long)w * h);  // count pixel memory accesses
+    c->sat = b.sat;
+  } else if (c->sx < w && c->sy < h) {
+    // Sums left of column sx and above row sy did not change.
+    uint8 buf[TSIDE];
+    for (int y = c->sy; y < h; y++) {
+      int64_t* s1 = c->sat + (y + 1) * sw + 1;   // linha y
+      const int64_t* s0 = s1 - sw;               // linha y-1
+      for (int x = c->sx; x < w; x += TSIDE) {
+        int n = (w - x < TSIDE) ? w - x : TSIDE;
+        const uint8* row = readRow(img, x, y, n, buf);
+        for (int i = 0; i < n; i++) {
+          s1[x+i] = row[i] + s1[x+i-1] + s0[x+i] - s0[x+i-1];
+        }
       }
+    }
+    COUNT(PIXMEM, (unsigned long)(w - c->sx) * (h - c->sy));  // count pixel memory accesses
+  }
+  c->sx = w;
+  c->sy = h;
+  return c->sat;
+}
 
-      summedAreaTable[x][y] = sum;  // Guarda o valor final na matriz.
+// Recompute rectangle q of dst, the blur of src with the cached filter, from
+// the pixels of src in rectangle e (q grown by the halo, within src).
+// sat and buf are scratch space for the sums of e and one of its rows.
+static void blurRegion(Image src, Image dst, int dx, int dy, Rect q, Rect e,
+                       int64_t* sat, uint8* buf) {
+  int w = src->width;
+  int h = src->height;
+  int ew = e.x1 - e.x0;
+  size_t sw = (size_t)ew + 1;
+  memset(sat, 0, sw * sizeof(int64_t));
+  for (int j = 0; j < e.y1 - e.y0; j++) {
+    getRow(src, e.x0, e.y0 + j, ew, buf);
+    int64_t* s1 = sat + (j + 1) * sw + 1;
+    const int64_t* s0 = s1 - sw;
+    s1[-1] = 0;
+    for (int i = 0; i < ew; i++) {
+      s1[i] = buf[i] + s1[i-1] + s0[i] - s0[i-1];
+    }
+  }
+  // As in blurRows, with sums relative to the corner of e.
+  for (int y = q.y0; y < q.y1; y++) {
+    int y0 = (y - dy > 0) ? y - dy : 0;
+    int y1 = (y + dy + 1 < h) ? y + dy + 1 : h;
+    const int64_t* top = sat + (y0 - e.y0) * sw - e.x0;
+    const int64_t* bot = sat + (y1 - e.y0) * sw - e.x0;
+    for (int x = q.x0; x < q.x1; x++) {
+      int x0 = (x - dx > 0) ? x - dx : 0;
+      int x1 = (x + dx + 1 < w) ? x + dx + 1 : w;
+      int64_t sum = bot[x1] - bot[x0] - top[x1] + top[x0];
+      buf[x - q.x0] = windowMean(sum, (int64_t)(x1 - x0) * (y1 - y0));
     }
+    putRow(dst, q.x0, y, q.x1 - q.x0, buf);
   }
+}
 
-  /*
-    Depois de criada a summed area table, temos que iterar sobre cada pixel da imagem inicial, aplciando
-    uma janela centrada no pixel de ((2 * dx + 1) x (2 * dy + 1)). Esta janela define a area a qual 
-    será aplicado o blur. Para isso, neste loop apenas temos de calcular a média pois a soma desses valores
-    já está guardada na summed area table. Por fim guardamos na imagem original no pixel o valor calculado.
-  */
-  for (int y = 0; y < img->height; y++) {
-    for (int x = 0; x < img->width; x++) {
+// Rectangle r grown by (dx,dy) on every side, within a w x h image.
+static Rect rectGrow(Rect r, int dx, int dy, int w, int h) {
+  Rect g;
+  g.x0 = (r.x0 - (long)dx > 0) ? (int)(r.x0 - (long)dx) : 0;
+  g.y0 = (r.y0 - (long)dy > 0) ? (int)(r.y0 - (long)dy) : 0;
+  g.x1 = (r.x1 + (long)dx < w) ? (int)(r.x1 + (long)dx) : w;
+  g.y1 = (r.y1 + (long)dy < h) ? (int)(r.y1 + (long)dy) : h;
+  return g;
+}
+
+// Bring the blurred copy in the cache c of img up to date, recomputing just
+// its dirty rectangles, grown by the halo; or drop it, if that would cover
+// a large part of the image anyway.
+// Returns 0 on failure (and errCause is set).
+static int blurUpdate(Image img, struct cache* c) {
+  int w = img->width;
+  int h = img->height;
+  Rect q[DIRTYMAX], e[DIRTYMAX];
+  size_t area = 0, emax = 0;
+  int ewmax = 0;
+  for (int i = 0; i < c->bdirty.n; i++) {
+    q[i] = rectGrow(c->bdirty.r[i], c->bdx, c->bdy, w, h);
+    e[i] = rectGrow(q[i], c->bdx, c->bdy, w, h);
+    size_t ea = (size_t)(e[i].x1 - e[i].x0 + 1) * (e[i].y1 - e[i].y0 + 1);
+    area += ea;
+    if (ea > emax) emax = ea;
+    if (e[i].x1 - e[i].x0 > ewmax) ewmax = e[i].x1 - e[i].x0;
+  }
+  if (area >= (size_t)w * h / 2) {  // start over, in parallel
+    ImageDestroy(&c->blur);
+    return 1;
+  }
+  int64_t* sat = NULL;
+  uint8* buf = NULL;
+  int success =
+  check( (sat = (int64_t*)malloc(emax * sizeof(int64_t))) != NULL &&
+         (buf = (uint8*)malloc((size_t)ewmax + 1)) != NULL,
+         "Allocating summed area table failed" ) &&
+  ownPixels(c->blur);
+  if (success) {
+    for (int i = 0; i < c->bdirty.n; i++) {
+      blurRegion(img, c->blur, c->bdx, c->bdy, q[i], e[i], sat, buf);
+    }
+    c->bdirty.n = 0;
+    COUNT(PIXMEM, 2ul * area);  // (at most)
+  }
+  errsave = errno;
+  free(sat);
+  free(buf);
+  errno = errsave;
+  return success;
+}
+
+/// Blur a copy of img, as ImageBlur does, and return it.
+/// Unless img is a view, the result is also kept with img, so that a later
+/// call with the same dx and dy only recomputes the pixels within (dx,dy)
+/// of those changed since.  The returned image shares its pixels with the
+/// kept one until either changes (see ImageClone): destroying it before
+/// the next call saves a copy.
+/// Requires: dx >= 0, dy >= 0.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageBlurred(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  struct cache* c = NULL;
+  if (img->owner == NULL) {
+    if ((c = getCache(img)) == NULL) return NULL;
+    if (c->blur != NULL && (c->bdx != dx || c->bdy != dy)) ImageDestroy(&c->blur);
+    if (c->blur != NULL && c->bdirty.n > 0 && !blurUpdate(img, c)) return NULL;
+    if (c->blur != NULL) return ImageClone(c->blur);
+  }
+  Image b = ImageClone(img);
+  if (b == NULL) return NULL;
+  if (!ImageBlur(b, dx, dy)) {
+    ImageDestroy(&b);  // (preserves errno/errCause)
+    return NULL;
+  }
+  if (c == NULL) return b;
+  c->blur = b;
+  c->bdx = dx;
+  c->bdy = dy;
+  c->bdirty.n = 0;
+  return ImageClone(b);
+}
+
+
+/// Separable convolution
+
+// Kernels are applied in fixed point: weights are rounded to CQ fraction
+// bits, and the horizontal pass keeps CH fraction bits for the vertical
+// pass.  With the sum of absolute weights of each kernel limited to CSUM,
+// the accumulators never overflow 32 bits.
+#define CQ 12
+#define CH 4
+#define CSUM 8.0
+
+// Sum of the absolute weights of kernel k[0..n-1].
+static inline double kernelWeight(const double* k, int n) {
+  double sum = 0.0;
+  for (int i = 0; i < n; i++) sum += fabs(k[i]);
+  return sum;
+}
+
+// Round kernel k[0..n-1] to fixed point q[0..n-1], keeping the sum of the
+// rounded weights equal to the rounded sum (so that flat areas stay flat).
+static void quantizeKernel(const double* k, int n, int32_t* q) {
+  double sum = 0.0;
+  int32_t qsum = 0;
+  for (int i = 0; i < n; i++) {
+    sum += k[i];
+    q[i] = (int32_t)lround(k[i] * (1 << CQ));
+    qsum += q[i];
+  }
+  q[n/2] += (int32_t)lround(sum * (1 << CQ)) - qsum;
+}
+
+// Shared state of a convolution job.
+typedef struct {
+  Image src, dst;
+  const int32_t* wx; int rx;  // horizontal weights, radius
+  const int32_t* wy; int ry;  // vertical weights, radius
+  uint8** pad;      // per worker: source row with rx clamped pixels each side
+  int32_t** ring;   // per worker: 2ry+1 horizontally filtered rows
+  int32_t** acc;    // per worker: vertical accumulator row
+} Conv;
+
+// Horizontal pass of source row y (clamped to the image) into out[0..w-1].
+static void convolveRow(const Conv* c, int worker, int y, int32_t* out) {
+  int w = c->src->width;
+  int h = c->src->height;
+  int rx = c->rx;
+  uint8* pad = c->pad[worker];
+  y = (y < 0) ? 0 : (y >= h) ? h - 1 : y;
+  getRow(c->src, 0, y, w, pad + rx);
+  memset(pad, pad[rx], rx);
+  memset(pad + rx + w, pad[rx + w - 1], rx);
+  // Tap-outer loops over contiguous rows: these vectorize well.
+  for (int x = 0; x < w; x++) out[x] = 0;
+  for (int t = 0; t <= 2*rx; t++) {
+    int32_t wt = c->wx[t];
+    const uint8* p = pad + t;
+    for (int x = 0; x < w; x++) out[x] += wt * p[x];
+  }
+  for (int x = 0; x < w; x++) out[x] = (out[x] + (1 << (CQ - CH - 1))) >> (CQ - CH);
+}
+
+// Convolve output rows [y0,y1), keeping the 2ry+1 horizontally filtered
+// source rows needed in a ring: each source row is filtered once per band.
+static void convolveBand(void* arg, int worker, int y0, int y1) {
+  const Conv* c = (const Conv*)arg;
+  int w = c->src->width;
+  int ry = c->ry;
+  int ny = 2*ry + 1;
+  int32_t* ring = c->ring[worker];
+  int32_t* acc = c->acc[worker];
+  uint8* out = c->pad[worker];  // free again once the ring is filled
+  int maxval = c->src->maxval;
+  // Source row sy lives in ring slot (sy + ry) % ny.
+  for (int sy = y0 - ry; sy < y0 + ry; sy++) {
+    convolveRow(c, worker, sy, ring + (size_t)((sy + ry) % ny) * w);
+  }
+  for (int y = y0; y < y1; y++) {
+    convolveRow(c, worker, y + ry, ring + (size_t)((y + 2*ry) % ny) * w);
+    for (int x = 0; x < w; x++) acc[x] = 0;
+    for (int t = 0; t < ny; t++) {
+      int32_t wt = c->wy[t];
+      const int32_t* r = ring + (size_t)((y + t) % ny) * w;
+      for (int x = 0; x < w; x++) acc[x] += wt * r[x];
+    }
+    for (int x = 0; x < w; x++) {
+      int32_t v = (acc[x] + (1 << (CQ + CH - 1))) >> (CQ + CH);
+      out[x] = (uint8)((v < 0) ? 0 : (v > maxval) ? maxval : v);
+    }
+    putRow(c->dst, 0, y, w, out);
+  }
+}
+
+/// Convolve an image with a separable kernel.
+/// Each pixel is replaced by the sum of its (nkx x nky) neighbourhood,
+/// weighted by kx[i]*ky[j], with the kernels centered on the pixel.
+/// Pixels outside the image take the level of the nearest edge pixel
+/// (clamp-to-edge).  Results are rounded and saturated to [0, maxval].
+/// Weights are applied in fixed point, with 12 fraction bits.
+/// Requires: nkx and nky are odd and positive, and the absolute weights
+/// of each kernel add up to at most 8.
+/// The image is changed in-place.
+/// (This involves allocation, and may fail.)
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageConvolveSeparable(Image img, const double* kx, int nkx, const double* ky, int nky) { ///
+  assert (img != NULL);
+  assert (kx != NULL && nkx > 0 && nkx % 2 == 1);
+  assert (ky != NULL && nky > 0 && nky % 2 == 1);
+  assert (kernelWeight(kx, nkx) <= CSUM && kernelWeight(ky, nky) <= CSUM);
+  int w = img->width;
+  int h = img->height;
+  if (w == 0 || h == 0) return 1;
+
+  int nw = parallelWorkers();
+  Conv c = { img, NULL, NULL, nkx/2, NULL, nky/2, NULL, NULL, NULL };
+  int32_t* wx = NULL;
+  int32_t* wy = NULL;
+  uint8* pads = NULL;
+  int32_t* rings = NULL;
+  int32_t* accs = NULL;
+  size_t padw = (size_t)w + 2*c.rx;
+
+  int success =
+  check( (wx = (int32_t*)malloc(nkx * sizeof(int32_t))) != NULL &&
+         (wy = (int32_t*)malloc(nky * sizeof(int32_t))) != NULL &&
+         (c.pad = (uint8**)malloc(nw * sizeof(uint8*))) != NULL &&
+         (c.ring = (int32_t**)malloc(nw * sizeof(int32_t*))) != NULL &&
+         (c.acc = (int32_t**)malloc(nw * sizeof(int32_t*))) != NULL &&
+         (pads = (uint8*)malloc(nw * padw)) != NULL &&
+         (rings = (int32_t*)malloc(nw * (size_t)nky * w * sizeof(int32_t))) != NULL &&
+         (accs = (int32_t*)malloc(nw * (size_t)w * sizeof(int32_t))) != NULL,
+         "Allocating convolution buffers failed" ) &&
+  (c.dst = newImage(w, h, img->maxval, img->layout)) != NULL;
+
+  if (success) {
+    quantizeKernel(kx, nkx, wx);
+    quantizeKernel(ky, nky, wy);
+    c.wx = wx;
+    c.wy = wy;
+    for (int i = 0; i < nw; i++) {
+      c.pad[i] = pads + i * padw;
+      c.ring[i] = rings + (size_t)i * nky * w;
+      c.acc[i] = accs + (size_t)i * w;
+    }
+    // Each band first fills its ring with the nky rows around its start.
+    parallelRowsGrain(h, (size_t)w * h * (nkx + nky), 4ul * nky, convolveBand, &c);
+    // img gets the result, and the old pixels go away.
+    adoptPixels(img, c.dst);
+    COUNT(PIXMEM, 2ul * w * h);  // count pixel memory accesses
+    COUNT(NUMOPERACOES, (unsigned long)w * h * (nkx + nky));  // multiply-adds
+  }
 
-      NUMCOMP += 4;
+  // Cleanup
+  errsave = errno;
+  ImageDestroy(&c.dst);
+  free(accs);
+  free(rings);
+  free(pads);
+  free(c.acc);
+  free(c.ring);
+  free(c.pad);
+  free(wy);
+  free(wx);
+  errno = errsave;
+  return success;
+}
+
+/// Build a Gaussian kernel for standard deviation sigma.
+/// The kernel radius is r = ceil(3*sigma), so the kernel has 2r+1 taps,
+/// which are normalized to add up to 1.
+/// Requires: sigma > 0.
+/// On success, returns the kernel and sets (*n) to its length.
+/// (The caller is responsible for freeing the returned array!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+double* ImageGaussianKernel(double sigma, int* n) { ///
+  assert (sigma > 0.0);
+  assert (n != NULL);
+  int r = (int)ceil(3.0 * sigma);
+  double* k = NULL;
+  if (!check( (k = (double*)malloc((2*r + 1) * sizeof(double))) != NULL,
+              "Allocating kernel failed" )) {
+    return NULL;
+  }
+  double sum = 0.0;
+  for (int i = -r; i <= r; i++) {
+    k[i + r] = exp(-(double)i*i / (2.0*sigma*sigma));
+    sum += k[i + r];
+  }
+  for (int i = 0; i <= 2*r; i++) k[i] /= sum;
+  *n = 2*r + 1;
+  return k;
+}
+
+/// Median filter
+
+// ImageMedian follows Perreault & Hébert, "Median Filtering in Constant
+// Time" (2007).  Each column keeps a histogram of the pixels of its
+// (2dy+1)-row window; moving down one row updates each column histogram
+// with one removal and one addition.  The window histogram is the sum of
+// 2dx+1 column histograms; moving right one pixel adds one column
+// histogram and subtracts another.  Histograms are two-level (16 coarse
+// bins of 16 fine bins), so the median is found with at most 32 steps.
+// All of this costs a constant amount of work per pixel, whatever dx, dy.
+// Columns are split in strips, processed in parallel, each strip keeping
+// the column histograms of its columns plus dx columns on each side.
+
+// Column histogram: counts fit 16 bits, since dy < 32768.
+typedef struct {
+  uint16_t coarse[16];
+  uint16_t fine[256];
+} ColHist;
+
+// Window histogram.
+typedef struct {
+  uint32_t coarse[16];
+  uint32_t fine[256];
+} WinHist;
+
+typedef struct {
+  Image src, dst;
+  int dx, dy;
+  int failed[PARMAX];  // per worker: out of memory
+} Median;
+
+static inline void colAdd(ColHist* c, uint8 v) {
+  c->coarse[v >> 4]++;
+  c->fine[v]++;
+}
+
+static inline void colRemove(ColHist* c, uint8 v) {
+  c->coarse[v >> 4]--;
+  c->fine[v]--;
+}
+
+static inline void winAdd(WinHist* k, const ColHist* c) {
+  for (int i = 0; i < 16; i++) k->coarse[i] += c->coarse[i];
+  for (int i = 0; i < 256; i++) k->fine[i] += c->fine[i];
+}
+
+static inline void winRemove(WinHist* k, const ColHist* c) {
+  for (int i = 0; i < 16; i++) k->coarse[i] -= c->coarse[i];
+  for (int i = 0; i < 256; i++) k->fine[i] -= c->fine[i];
+}
 
-      /*
-        Este calculo do maxX, maxY, ... serve para definir a janela, temos der ter em atenção que a janela não pode sair 
-        dos limites de frame, ou seja, o maxX não pode ser menor de 0, caso contrário estariamos fora do frame, o mesmo se
-        aplica para os seguintes valores.
-      */
-      maxX = (x - dx - 1 > 0) ? x - dx - 1 : 0; 
-      maxY = (y - dy - 1 > 0) ? y - dy - 1 : 0;
+// Level with the given rank (0-based) in window histogram k.
+static inline uint8 winRank(const WinHist* k, uint32_t rank) {
+  int c = 0;
+  while (k->coarse[c] <= rank) rank -= k->coarse[c++];
+  int v = c << 4;
+  while (k->fine[v] <= rank) rank -= k->fine[v++];
+  return (uint8)v;
+}
 
-      minX = (x + dx + 1 > img->width) ? img->width - 1 : x + dx;
-      minY = (y + dy + 1 > img->height) ? img->height - 1 : y + dy;
-     
-     //Em baixo vamos calcular a soma dos limites da janela.
-      int sum = summedAreaTable[minX][minY] - summedAreaTable[maxX][minY] - summedAreaTable[minX][maxY] + summedAreaTable[maxX][maxY];
-      NUMOPERACOES += 3;
-      double mean = (double)(sum) / (((minX - maxX) * (minY - maxY)));  //Calculo da media
+// Median filter of the strip of columns [x0,x1).
+static void medianStrip(void* arg, int worker, int x0, int x1) {
+  Median* m = (Median*)arg;
+  int w = m->src->width;
+  int h = m->src->height;
+  int dx = m->dx, dy = m->dy;
+  // Columns with a histogram: [cx0, cx1)
+  int cx0 = (x0 - dx > 0) ? x0 - dx : 0;
+  int cx1 = (x1 + dx < w) ? x1 + dx : w;
+  int nc = cx1 - cx0;
+  ColHist* col = (ColHist*)calloc(nc, sizeof(ColHist));
+  WinHist* win = (WinHist*)malloc(sizeof(WinHist));
+  uint8* buf = (uint8*)malloc(nc + (x1 - x0));
+  if (col == NULL || win == NULL || buf == NULL) {
+    m->failed[worker] = 1;
+    free(col); free(win); free(buf);
+    return;
+  }
+  uint8* out = buf + nc;
 
-      ImageSetPixel(img, x, y, (int)(mean+0.5));  // Temos que acrescentar 0.5 à media para podermos ter arredondamentos corretos
+  // Column windows of row 0: rows [0, dy]
+  for (int r = 0; r <= dy && r < h; r++) {
+    getRow(m->src, cx0, r, nc, buf);
+    for (int c = 0; c < nc; c++) colAdd(&col[c], buf[c]);
+  }
+  for (int y = 0; y < h; y++) {
+    if (y > 0) {  // slide column windows down: rows [y-dy, y+dy] clipped
+      if (y + dy < h) {
+        getRow(m->src, cx0, y + dy, nc, buf);
+        for (int c = 0; c < nc; c++) colAdd(&col[c], buf[c]);
+      }
+      if (y - dy - 1 >= 0) {
+        getRow(m->src, cx0, y - dy - 1, nc, buf);
+        for (int c = 0; c < nc; c++) colRemove(&col[c], buf[c]);
+      }
+    }
+    int rows = ((y + dy < h) ? y + dy + 1 : h) - ((y - dy > 0) ? y - dy : 0);
+    // Window of (x0, y): columns [x0-dx, x0+dx] clipped
+    memset(win, 0, sizeof(WinHist));
+    int wx0 = (x0 - dx > 0) ? x0 - dx : 0;
+    int wx1 = (x0 + dx + 1 < w) ? x0 + dx + 1 : w;   // exclusive
+    for (int c = wx0; c < wx1; c++) winAdd(win, &col[c - cx0]);
+    for (int x = x0; x < x1; x++) {
+      if (x > x0) {  // slide window right
+        if (x + dx < w) {
+          winAdd(win, &col[x + dx - cx0]);
+          wx1++;
+        }
+        if (x - dx - 1 >= 0) {
+          winRemove(win, &col[x - dx - 1 - cx0]);
+          wx0++;
+        }
+      }
+      uint32_t n = (uint32_t)(wx1 - wx0) * rows;
+      out[x - x0] = winRank(win, (n - 1) / 2);
     }
+    putRow(m->dst, x0, y, x1 - x0, out);
+  }
+  free(col);
+  free(win);
+  free(buf);
+}
+
+/// Apply a (2dx+1)x(2dy+1) median filter.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that lie inside the image (as in ImageBlur).
+/// When that rectangle has an even number of pixels, the lower of the two
+/// middle levels is used.
+/// The cost per pixel is constant, independent of dx and dy.
+/// Requires: 0 <= dx, 0 <= dy < 32768.
+/// The image is changed in-place.
+/// (This involves allocation, and may fail.)
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageMedian(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (0 <= dx);
+  assert (0 <= dy && dy < 32768);
+  int w = img->width;
+  int h = img->height;
+  if (w == 0 || h == 0) return 1;
+
+  Median m = { img, NULL, dx, dy, {0} };
+  if ((m.dst = newImage(w, h, img->maxval, img->layout)) == NULL) return 0;
+  // Each strip also builds histograms for the dx columns on either side.
+  parallelRowsGrain(w, (size_t)w * h * 64, 8ul * dx, medianStrip, &m);
+  int success = 1;
+  for (int i = 0; i < PARMAX; i++) {
+    success = success && check( !m.failed[i], "Allocating median histograms failed" );
+  }
+  if (success) {
+    // img gets the result, and the old pixels go away.
+    adoptPixels(img, m.dst);
+    COUNT(PIXMEM, 3ul * w * h);  // count pixel memory accesses
   }
+  errsave = errno;
+  ImageDestroy(&m.dst);
+  errno = errsave;
+  return success;
+}
+
+/// Morphology
+
+// Erosion (minimum) and dilation (maximum) over (2dx+1)x(2dy+1)
+// rectangles use the van Herk / Gil-Werman algorithm, separately along
+// each axis.  For a window of k = 2r+1 samples, the (padded) line is cut
+// in blocks of k samples; P holds running minima from the start of each
+// block and S running minima to the end of each block.  Every window
+// spans at most two blocks, so its minimum is min(S[i], P[i+2r]): about
+// three comparisons per sample, whatever the window size.
+//
+// Dilation is computed as erosion of the inverted levels (~v), so a
+// single minimum kernel serves both.  Lines are padded with the neutral
+// level, which clips windows to the image, as in ImageBlur.
+//
+// The horizontal pass works row by row.  The vertical pass works on
+// strips of MSTRIP columns and combines whole strip rows at a time,
+// which vectorizes.  Both passes run in parallel.
+
+#define MSTRIP 64
+
+typedef struct {
+  Image src, dst;
+  uint8* tmp;       // result of the horizontal pass (inverted if dilating)
+  int dx, dy;
+  uint8 flip;       // 0x00 to erode, 0xFF to dilate
+  int failed[PARMAX];  // per worker: out of memory
+} Morph;
+
+static inline uint8 umin(uint8 a, uint8 b) {
+  return (a < b) ? a : b;
+}
 
-  free(summedAreaTable[0]);  //Liberta a memória alocada para a tabela de soma
-  free(summedAreaTable);
+// Horizontal van Herk / Gil-Werman pass of rows [y0,y1) into m->tmp.
+static void erodeRows(void* arg, int worker, int y0, int y1) {
+  Morph* m = (Morph*)arg;
+  int w = m->src->width;
+  int r = m->dx;
+  int k = 2*r + 1;
+  int len = (w + 2*r + k - 1) / k * k;   // padded line, whole blocks
+  uint8* f = (uint8*)malloc(3 * (size_t)len);
+  if (f == NULL) {
+    m->failed[worker] = 1;
+    return;
+  }
+  uint8* P = f + len;
+  uint8* S = P + len;
+  memset(f, 0xFF, len);
+  for (int y = y0; y < y1; y++) {
+    getRow(m->src, 0, y, w, f + r);
+    for (int i = r; i < r + w; i++) f[i] ^= m->flip;
+    for (int b = 0; b < len; b += k) {
+      P[b] = f[b];
+      for (int i = b + 1; i < b + k; i++) P[i] = umin(P[i-1], f[i]);
+      S[b + k - 1] = f[b + k - 1];
+      for (int i = b + k - 2; i >= b; i--) S[i] = umin(S[i+1], f[i]);
+    }
+    uint8* out = m->tmp + (size_t)y * w;
+    for (int i = 0; i < w; i++) out[i] = umin(S[i], P[i + 2*r]);
+  }
+  free(f);
+}
 
-}
\ No newline at end of file
+// Vertical van Herk / Gil-Werman pass of column strips [s0,s1) from
+// m->tmp into m->dst.
+static void erodeStrips(void* arg, int worker, int s0, int s1) {
+  Morph* m = (Morph*)arg;
+  int w = m->src->width;
+  int h = m->src->height;
+  int r = m->dy;
+  int k = 2*r + 1;
+  int len = (h + 2*r + k - 1) / k * k;   // padded column, whole blocks
+  uint8* P = (uint8*)malloc(2 * (size_t)len * MSTRIP + 2*MSTRIP);
+  if (P == NULL) {
+    m->failed[worker] = 1;
+    return;
+  }
+  uint8* S = P + (size_t)len * MSTRIP;
+  uint8* pad = S + (size_t)len * MSTRIP;  // neutral row
+  uint8* out = pad + MSTRIP;
+  memset(pad, 0xFF, MSTRIP);
+  for (int s = s0; s < s1; s++) {
+    int c0 = s * MSTRIP;
+    int n = (w - c0 < MSTRIP) ? w - c0 : MSTRIP;
+    // Padded line p holds row p-r, or the neutral row outside the image.
+#define LINE(p) (((p) < r || (p) >= h + r) ? pad : m->tmp + (size_t)((p) - r) * w + c0)
+    for (int b = 0; b < len; b += k) {
+      memcpy(P + (size_t)b * MSTRIP, LINE(b), n);
+      for (int p = b + 1; p < b + k; p++) {
+        const uint8* f = LINE(p);
+        const uint8* prev = P + (size_t)(p - 1) * MSTRIP;
+        uint8* cur = P + (size_t)p * MSTRIP;
+        for (int i = 0; i < n; i++) cur[i] = umin(prev[i], f[i]);
+      }
+      memcpy(S + (size_t)(b + k - 1) * MSTRIP, LINE(b + k - 1), n);
+      for (int p = b + k - 2; p >= b; p--) {
+        const uint8* f = LINE(p);
+        const uint8* next = S + (size_t)(p + 1) * MSTRIP;
+        uint8* cur = S + (size_t)p * MSTRIP;
+        for (int i = 0; i < n; i++) cur[i] = umin(next[i], f[i]);
+      }
+    }
+#undef LINE
+    for (int y = 0; y < h; y++) {
+      const uint8* a = S + (size_t)y * MSTRIP;
+      const uint8* b = P + (size_t)(y + 2*r) * MSTRIP;
+      for (int i = 0; i < n; i++) out[i] = umin(a[i], b[i]) ^ m->flip;
+      putRow(m->dst, c0, y, n, out);
+    }
+  }
+  free(P);
+}
+
+// Erode (flip = 0x00) or dilate (flip = 0xFF) img in-place.
+// Same contract as ImageErode.
+static int morph(Image img, int dx, int dy, uint8 flip) {
+  int w = img->width;
+  int h = img->height;
+  if (w == 0 || h == 0) return 1;
+
+  Morph m = { img, NULL, NULL, dx, dy, flip, {0} };
+  int success =
+  check( (m.tmp = (uint8*)malloc((size_t)w * h)) != NULL, "Allocating morphology buffer failed" ) &&
+  (m.dst = newImage(w, h, img->maxval, img->layout)) != NULL;
+  if (success) {
+    parallelRows(h, (size_t)w * h * 3, erodeRows, &m);
+    parallelRows((w + MSTRIP - 1) / MSTRIP, (size_t)w * h * 3, erodeStrips, &m);
+    for (int i = 0; i < PARMAX; i++) {
+      success = success && check( !m.failed[i], "Allocating morphology buffer failed" );
+    }
+  }
+  if (success) {
+    // img gets the result, and the old pixels go away.
+    adoptPixels(img, m.dst);
+    COUNT(PIXMEM, 4ul * w * h);  // count pixel memory accesses
+    COUNT(NUMCOMP, 6ul * w * h);  // about 3 comparisons per pixel per axis
+  }
+  errsave = errno;
+  ImageDestroy(&m.dst);
+  free(m.tmp);
+  errno = errsave;
+  return success;
+}
+
+/// Erode an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the minimum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that lie inside the image.
+/// The cost per pixel is constant, independent of dx and dy.
+/// Requires: dx >= 0, dy >= 0.
+/// The image is changed in-place.
+/// (This involves allocation, and may fail.)
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageErode(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  return morph(img, dx, dy, 0x00);
+}
+
+/// Dilate an image with a (2dx+1)x(2dy+1) rectangle.
+/// Like ImageErode, but using the maximum instead of the minimum.
+int ImageDilate(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  return morph(img, dx, dy, 0xFF);
+}
+
+/// Open an image with a (2dx+1)x(2dy+1) rectangle: erode, then dilate.
+/// This removes bright details smaller than the rectangle.
+/// Same contract as ImageErode (on failure, img may be eroded only).
+int ImageOpen(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  return morph(img, dx, dy, 0x00) && morph(img, dx, dy, 0xFF);
+}
+
+/// Close an image with a (2dx+1)x(2dy+1) rectangle: dilate, then erode.
+/// This fills dark details smaller than the rectangle.
+/// Same contract as ImageErode (on failure, img may be dilated only).
+int ImageClose(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  return morph(img, dx, dy, 0xFF) && morph(img, dx, dy, 0x00);
+}
+
+/// Resizing
+
+// ImageResize is separable: each output pixel is a weighted sum of a
+// few source pixels, with weights that depend only on the output column
+// (horizontally) and the output row (vertically).  Both coefficient
+// tables are computed once: for output index o, taps start[o] .. start[o]
+// + taps-1 of the source, with Q14 weights that add up to exactly 1.
+// Each output row is then made in two passes: a vertical pass that
+// combines whole source rows (contiguous, so it vectorizes) into an
+// intermediate row with 8 fraction bits, and a horizontal pass over that
+// row.  Output rows are independent, so they run in parallel.
+
+#define RQ 14  // fraction bits of the weights
+#define RH 8   // fraction bits of the intermediate row
+
+typedef struct {
+  int taps;        // number of taps per output index
+  int* start;      // first source index of each output index
+  int32_t* wt;     // weights, taps per output index
+} Coeffs;
+
+// Compute coefficients to resample n source samples into m samples.
+// Returns 0 if allocation failed.
+static int resizeCoeffs(Coeffs* c, int n, int m, Interp interp) {
+  double scale = (double)n / m;
+  int taps = (interp == INTERP_NEAREST) ? 1 :
+             (interp == INTERP_BILINEAR) ? 2 : (int)ceil(scale) + 1;
+  if (taps > n) taps = n;
+  c->taps = taps;
+  c->start = (int*)malloc(m * sizeof(int));
+  c->wt = (int32_t*)calloc((size_t)m * taps, sizeof(int32_t));
+  double* w = (double*)malloc((size_t)taps * sizeof(double));
+  if (c->start == NULL || c->wt == NULL || w == NULL) {
+    free(w);
+    return 0;
+  }
+  for (int o = 0; o < m; o++) {
+    // Source taps first..first+count-1, with weights w[]
+    int first, count;
+    if (interp == INTERP_NEAREST) {
+      first = (int)((o + 0.5) * scale);
+      count = 1;
+      w[0] = 1.0;
+    } else if (interp == INTERP_BILINEAR) {
+      double s = (o + 0.5) * scale - 0.5;
+      first = (int)floor(s);
+      count = 2;
+      w[1] = s - first;
+      w[0] = 1.0 - w[1];
+    } else {  // INTERP_AREA: coverage of [a,b) by each source sample
+      double a = o * scale, b = (o + 1) * scale;
+      first = (int)floor(a);
+      count = (int)ceil(b) - first;
+      if (count > taps) count = taps;
+      for (int t = 0; t < count; t++) {
+        double lo = (first + t > a) ? first + t : a;
+        double hi = (first + t + 1 < b) ? first + t + 1 : b;
+        w[t] = (hi > lo) ? (hi - lo) / scale : 0.0;
+      }
+    }
+    // Clamp taps to the source, keeping the window inside it
+    int lo = (first < 0) ? 0 : (first > n - 1) ? n - 1 : first;
+    int start = (lo > n - taps) ? n - taps : lo;
+    c->start[o] = start;
+    int32_t* q = c->wt + (size_t)o * taps;
+    int32_t sum = 0;
+    int big = 0;
+    for (int t = 0; t < count; t++) {
+      int i = first + t;
+      i = (i < 0) ? 0 : (i > n - 1) ? n - 1 : i;
+      q[i - start] += (int32_t)lround(w[t] * (1 << RQ));
+    }
+    for (int t = 0; t < taps; t++) {
+      sum += q[t];
+      if (q[t] > q[big]) big = t;
+    }
+    q[big] += (1 << RQ) - sum;  // weights add up to exactly 1
+  }
+  free(w);
+  return 1;
+}
+
+typedef struct {
+  Image src, dst;
+  Coeffs cx, cy;
+  uint8** buf;      // per worker: source row (tiled images) / output row
+  int32_t** tmp;    // per worker: vertical pass row
+} Resize;
+
+// Make output rows [y0,y1).
+static void resizeRows(void* arg, int worker, int y0, int y1) {
+  const Resize* r = (const Resize*)arg;
+  int sw = r->src->width;
+  int w = r->dst->width;
+  int ty = r->cy.taps, tx = r->cx.taps;
+  uint8* buf = r->buf[worker];
+  uint8* out = buf + sw;
+  int32_t* tmp = r->tmp[worker];
+  for (int y = y0; y < y1; y++) {
+    // Vertical pass: tmp = sum of source rows, with RH fraction bits
+    const int32_t* wy = r->cy.wt + (size_t)y * ty;
+    for (int x = 0; x < sw; x++) tmp[x] = 0;
+    for (int t = 0; t < ty; t++) {
+      int32_t wt = wy[t];
+      if (wt == 0) continue;
+      const uint8* row = readRow(r->src, 0, r->cy.start[y] + t, sw, buf);
+      for (int x = 0; x < sw; x++) tmp[x] += wt * row[x];
+    }
+    for (int x = 0; x < sw; x++) tmp[x] = (tmp[x] + (1 << (RQ - RH - 1))) >> (RQ - RH);
+    // Horizontal pass
+    for (int x = 0; x < w; x++) {
+      const int32_t* wx = r->cx.wt + (size_t)x * tx;
+      const int32_t* p = tmp + r->cx.start[x];
+      int32_t acc = 0;
+      for (int t = 0; t < tx; t++) acc += wx[t] * p[t];
+      out[x] = (uint8)((acc + (1 << (RQ + RH - 1))) >> (RQ + RH));
+    }
+    putRow(r->dst, 0, y, w, out);
+  }
+}
+
+/// Resize an image to w x h pixels.
+/// interp selects how output pixels are computed from the source:
+///   INTERP_NEAREST:  the source pixel nearest to the output pixel center;
+///   INTERP_BILINEAR: bilinear interpolation of the 4 nearest pixels;
+///   INTERP_AREA:     the mean of the source area covered by the output
+///                    pixel (best for reducing images).
+/// Requires: w >= 0, h >= 0; img must not be empty unless w*h == 0.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, Interp interp) { ///
+  assert (img != NULL);
+  assert (w >= 0 && h >= 0);
+  assert ((size_t)w * h == 0 || (size_t)img->width * img->height > 0);
+  if (w == img->width && h == img->height) {  // nothing to resample
+    return ImageClone(img);
+  }
+  Image dst = newImage(w, h, img->maxval, img->layout);
+  if (dst == NULL || (size_t)w * h == 0) return dst;
+
+  int sw = img->width;
+  int nw = parallelWorkers();
+  Resize r = { img, dst, { 0, NULL, NULL }, { 0, NULL, NULL }, NULL, NULL };
+  uint8* bufs = NULL;
+  int32_t* tmps = NULL;
+  int success =
+  check( resizeCoeffs(&r.cx, sw, w, interp) &&
+         resizeCoeffs(&r.cy, img->height, h, interp) &&
+         (r.buf = (uint8**)malloc(nw * sizeof(uint8*))) != NULL &&
+         (r.tmp = (int32_t**)malloc(nw * sizeof(int32_t*))) != NULL &&
+         (bufs = (uint8*)malloc(nw * ((size_t)sw + w))) != NULL &&
+         (tmps = (int32_t*)malloc(nw * (size_t)sw * sizeof(int32_t))) != NULL,
+         "Allocating resize tables failed" );
+  if (success) {
+    for (int i = 0; i < nw; i++) {
+      r.buf[i] = bufs + i * ((size_t)sw + w);
+      r.tmp[i] = tmps + i * (size_t)sw;
+    }
+    parallelRows(h, (size_t)h * (sw * r.cy.taps + w * r.cx.taps), resizeRows, &r);
+    COUNT(PIXMEM, (unsigned long)h * sw * r.cy.taps + (unsigned long)w * h);  // count pixel memory accesses
+    COUNT(NUMOPERACOES, (unsigned long)h * (sw * r.cy.taps + w * r.cx.taps));  // multiply-adds
+  }
+
+  // Cleanup
+  errsave = errno;
+  free(tmps);
+  free(bufs);
+  free(r.tmp);
+  free(r.buf);
+  free(r.cy.wt);
+  free(r.cy.start);
+  free(r.cx.wt);
+  free(r.cx.start);
+  if (!success) ImageDestroy(&dst);
+  errno = errsave;
+  return dst;
+}
+
+/// Affine warping
+
+// ImageWarpAffine walks the output in TSIDE x TSIDE tiles, so that the
+// source pixels read for one tile also form a compact region in cache.
+// Source coordinates are fixed point with WQ fraction bits: each row of
+// a tile starts from a position computed from the matrix, and then only
+// adds the per-column step, so there is no trigonometry or division per
+// pixel.  Bilinear interpolation uses 8-bit fractions.  Bands of tile
+// rows run in parallel.
+
+#define WQ 32
+
+typedef struct {
+  Image src, dst;
+  double m[6];
+  Interp interp;
+  uint8 fill;
+} Warp;
+
+static inline uint8 srcPixel(Image img, int x, int y) {
+  return img->pixel[pixAt(img, x, y)];
+}
+
+// Warp output tile rows [t0,t1).
+static void warpTiles(void* arg, int worker, int t0, int t1) {
+  const Warp* a = (const Warp*)arg;
+  Image src = a->src;
+  int sw = src->width, sh = src->height;
+  int w = a->dst->width, h = a->dst->height;
+  const double* m = a->m;
+  const double one = (double)((int64_t)1 << WQ);
+  int64_t stepx = llround(m[0] * one);
+  int64_t stepy = llround(m[3] * one);
+  // Valid source positions: [-0.5, sw-0.5) x [-0.5, sh-0.5)
+  const int64_t half = (int64_t)1 << (WQ - 1);
+  uint8 out[TSIDE];
+  for (int ty = t0; ty < t1; ty++) {
+    int y0 = ty * TSIDE;
+    int y1 = (y0 + TSIDE < h) ? y0 + TSIDE : h;
+    for (int x0 = 0; x0 < w; x0 += TSIDE) {
+      int n = (w - x0 < TSIDE) ? w - x0 : TSIDE;
+      for (int y = y0; y < y1; y++) {
+        int64_t sx = llround((m[0]*x0 + m[1]*y + m[2]) * one);
+        int64_t sy = llround((m[3]*x0 + m[4]*y + m[5]) * one);
+        for (int i = 0; i < n; i++, sx += stepx, sy += stepy) {
+          int64_t px = sx + half, py = sy + half;   // shifted by half a pixel
+          if (px < 0 || py < 0 || (px >> WQ) >= sw || (py >> WQ) >= sh) {
+            out[i] = a->fill;
+          } else if (a->interp == INTERP_NEAREST) {
+            out[i] = srcPixel(src, (int)(px >> WQ), (int)(py >> WQ));
+          } else {
+            // Neighbours of (sx, sy), clamped to the image
+            int ix = (int)(sx >> WQ), iy = (int)(sy >> WQ);
+            int fx = (int)((sx >> (WQ - 8)) & 0xFF);
+            int fy = (int)((sy >> (WQ - 8)) & 0xFF);
+            int xa = (ix < 0) ? 0 : ix, xb = (ix + 1 < sw) ? ix + 1 : sw - 1;
+            int ya = (iy < 0) ? 0 : iy, yb = (iy + 1 < sh) ? iy + 1 : sh - 1;
+            int top = srcPixel(src, xa, ya) * (256 - fx) + srcPixel(src, xb, ya) * fx;
+            int bot = srcPixel(src, xa, yb) * (256 - fx) + srcPixel(src, xb, yb) * fx;
+            out[i] = (uint8)((top * (256 - fy) + bot * fy + (1 << 15)) >> 16);
+          }
+        }
+        putRow(a->dst, x0, y, n, out);
+      }
+    }
+  }
+}
+
+/// Apply an affine transformation to an image.
+/// Output pixel (x,y) of the new w x h image takes the level of img at
+/// source position
+///   (m[0]*x + m[1]*y + m[2], m[3]*x + m[4]*y + m[5]),
+/// sampled with INTERP_NEAREST or INTERP_BILINEAR.
+/// Output pixels whose source position falls outside img are set to fill.
+/// The matrix of a 90 degree anti-clockwise rotation is handled exactly
+/// by ImageRotate.
+/// Requires: w >= 0, h >= 0, interp is not INTERP_AREA.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageWarpAffine(Image img, int w, int h, const double m[6], Interp interp, uint8 fill) { ///
+  assert (img != NULL);
+  assert (m != NULL);
+  assert (w >= 0 && h >= 0);
+  assert (interp == INTERP_NEAREST || interp == INTERP_BILINEAR);
+  int sw = img->width, sh = img->height;
+  if (w == sh && h == sw && m[0] == 0.0 && m[1] == -1.0 && m[2] == sw - 1 &&
+      m[3] == 1.0 && m[4] == 0.0 && m[5] == 0.0) {
+    return ImageRotate(img);
+  }
+  if (w == sw && h == sh && m[0] == 1.0 && m[1] == 0.0 && m[2] == 0.0 &&
+      m[3] == 0.0 && m[4] == 1.0 && m[5] == 0.0) {  // identity
+    return ImageClone(img);
+  }
+  Image dst = newImage(w, h, img->maxval, img->layout);
+  if (dst == NULL) return NULL;
+  Warp a = { img, dst, { m[0], m[1], m[2], m[3], m[4], m[5] }, interp, fill };
+  if ((size_t)sw * sh == 0) a.m[0] = a.m[3] = 0.0, a.m[2] = a.m[5] = -1.0;  // all fill
+  parallelRows((h + TSIDE - 1) / TSIDE, (size_t)w * h * 4, warpTiles, &a);
+  COUNT(PIXMEM, (unsigned long)w * h * ((interp == INTERP_NEAREST) ? 2 : 5));  // count pixel memory accesses
+  return dst;
+}
+
+/// Rotate an image by an arbitrary angle.
+/// Returns the image rotated anti-clockwise by degrees, about its center,
+/// in a new image just large enough to contain it.
+/// Pixels not covered by the rotated image are set to fill.
+/// Multiples of 90 degrees are exact (90 degrees gives ImageRotate).
+/// Requires: interp is not INTERP_AREA.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateAngle(Image img, double degrees, Interp interp, uint8 fill) { ///
+  assert (img != NULL);
+  assert (interp == INTERP_NEAREST || interp == INTERP_BILINEAR);
+  double turns = fmod(degrees / 90.0, 4.0);
+  if (turns < 0) turns += 4.0;
+  double c, s;
+  if (turns == floor(turns)) {  // exact cosine and sine
+    static const double cs[4][2] = { {1, 0}, {0, 1}, {-1, 0}, {0, -1} };
+    c = cs[(int)turns][0];
+    s = cs[(int)turns][1];
+  } else {
+    c = cos(turns * M_PI / 2);
+    s = sin(turns * M_PI / 2);
+  }
+  int sw = img->width, sh = img->height;
+  int w = (int)ceil(fabs(sw * c) + fabs(sh * s) - 1e-9);
+  int h = (int)ceil(fabs(sw * s) + fabs(sh * c) - 1e-9);
+  // Map output center to source center, rotating the offsets
+  double cx = (sw - 1) / 2.0, cy = (sh - 1) / 2.0;
+  double ox = (w - 1) / 2.0, oy = (h - 1) / 2.0;
+  double m[6] = { c, -s, cx - c*ox + s*oy,
+                  s,  c, cy - s*ox - c*oy };
+  return ImageWarpAffine(img, w, h, m, interp, fill);
+}
+
+/// Connected components
+
+// ImageLabel uses two-pass union-find labeling on 2x2 blocks.  All the
+// nonzero pixels of a 2x2 block are 8-connected, so the first pass gives
+// each nonempty block a provisional label, joining it with the labels of
+// the blocks above-left (P), above (Q), above-right (R) and left (S) when
+// their facing pixels touch.  Equivalences are kept in a union-find forest
+// where the root of each set is its smallest label, with path compression.
+// The first pass runs in parallel on horizontal strips of block rows: a
+// strip starting at block row by0 uses labels from by0*bw + 1 on, so strips
+// never share labels, and it ignores the blocks above it.  Then the rows at
+// the strip borders are joined (serially), the forest is flattened into
+// final labels 1..n, and the second pass writes the label map in parallel.
+// Flattening numbers the sets in the order of their first block; to number
+// them by first pixel in raster order instead, the block rows are then
+// scanned twice: blocks with nonzero pixels in their top row, then the rest.
+
+typedef struct {
+  Image img;
+  int bw, bh;             // size in blocks
+  uint32_t* block;        // label of each block (0 for background)
+  uint8* top;             // top[b] is set if block b has nonzero top pixels
+  uint32_t* parent;       // union-find forest, then final labels
+  uint32_t* labels;       // label map
+  uint8* strip;           // strip[by] is set if a strip starts at block row by
+  int failed[PARMAX];     // scratch allocation failed in some worker
+} Label;
+
+static uint32_t findRoot(uint32_t* parent, uint32_t l) {
+  while (parent[l] != l) {
+    parent[l] = parent[parent[l]];  // path halving
+    l = parent[l];
+  }
+  return l;
+}
+
+// Join the sets of labels a and b (a == 0 stands for no set).
+// Returns a label of the joined set.
+static uint32_t unite(uint32_t* parent, uint32_t a, uint32_t b) {
+  if (a == 0) return b;
+  a = findRoot(parent, a);
+  b = findRoot(parent, b);
+  if (a < b) { parent[b] = a; return a; }
+  parent[a] = b;
+  return b;
+}
+
+// Nonzero pixel x of row r (NULL or x beyond width w count as zero)?
+static inline int fg(const uint8* r, int x, int w) {
+  return r != NULL && x < w && r[x] != 0;
+}
+
+// Scan block row by, reading 3 pixel rows into buf.
+// With next != NULL (first pass), give each nonempty block a label, using
+// (*next)++ for new ones; the row above is used only if up is nonzero.
+// With next == NULL (border merge), just join blocks with those above.
+static void labelBlockRow(Label* L, int by, int up, uint8* buf, uint32_t* next) {
+  Image img = L->img;
+  int w = img->width;
+  int h = img->height;
+  int bw = L->bw;
+  const uint8* rp = up ? readRow(img, 0, 2*by - 1, w, buf) : NULL;
+  const uint8* r0 = readRow(img, 0, 2*by, w, buf + w);
+  const uint8* r1 = (2*by + 1 < h) ? readRow(img, 0, 2*by + 1, w, buf + 2*w) : NULL;
+  uint32_t* cur = L->block + (size_t)by * bw;
+  const uint32_t* above = cur - bw;
+  uint32_t* parent = L->parent;
+  for (int bx = 0; bx < bw; bx++) {
+    int x = 2*bx;
+    int a = fg(r0, x, w), b = fg(r0, x+1, w);
+    int c = fg(r1, x, w), d = fg(r1, x+1, w);
+    if (!(a | b | c | d)) {
+      if (next != NULL) cur[bx] = 0;
+      continue;
+    }
+    uint32_t l = (next != NULL) ? 0 : cur[bx];
+    if (rp != NULL) {
+      if (a && bx > 0 && fg(rp, x-1, w)) l = unite(parent, l, above[bx-1]);        // P
+      if ((a | b) && (fg(rp, x, w) || fg(rp, x+1, w))) l = unite(parent, l, above[bx]);  // Q
+      if (b && fg(rp, x+2, w)) l = unite(parent, l, above[bx+1]);                  // R
+    }
+    if (next != NULL) {
+      if ((a | c) && bx > 0 && (fg(r0, x-1, w) || fg(r1, x-1, w))) {
+        l = unite(parent, l, cur[bx-1]);                                           // S
+      }
+      if (l == 0) {
+        l = (*next)++;
+        parent[l] = l;
+      }
+      cur[bx] = l;
+      L->top[(size_t)by * bw + bx] = (uint8)(a | b);
+    }
+  }
+}
+
+// First pass over the strip of block rows [by0,by1).
+static void labelStrip(void* arg, int worker, int by0, int by1) {
+  Label* L = (Label*)arg;
+  uint8* buf = (uint8*)malloc(3 * (size_t)L->img->width + 1);
+  if (buf == NULL) {
+    L->failed[worker] = 1;
+    return;
+  }
+  L->strip[by0] = 1;
+  uint32_t next = (uint32_t)by0 * L->bw + 1;
+  for (int by = by0; by < by1; by++) {
+    labelBlockRow(L, by, by > by0, buf, &next);
+  }
+  free(buf);
+}
+
+// Second pass: write the label map for block rows [by0,by1).
+static void labelWrite(void* arg, int worker, int by0, int by1) {
+  Label* L = (Label*)arg;
+  Image img = L->img;
+  int w = img->width;
+  uint8* buf = (uint8*)malloc((size_t)w + 1);
+  if (buf == NULL) {
+    L->failed[worker] = 1;
+    return;
+  }
+  int y1 = (2*by1 < img->height) ? 2*by1 : img->height;
+  for (int y = 2*by0; y < y1; y++) {
+    const uint8* row = readRow(img, 0, y, w, buf);
+    const uint32_t* blk = L->block + (size_t)(y / 2) * L->bw;
+    uint32_t* out = L->labels + (size_t)y * w;
+    for (int x = 0; x < w; x++) {
+      out[x] = row[x] ? L->parent[blk[x / 2]] : 0;
+    }
+  }
+  free(buf);
+}
+
+/// Label the connected components of the nonzero pixels of img.
+/// Pixels are connected to their 8 neighbours (horizontal, vertical and
+/// diagonal).  This is meant for thresholded images (see ImageThreshold).
+/// On success, returns nonzero, and
+///   *pn is set to the number n of components;
+///   *plabels (if plabels != NULL) is set to a new array of width*height
+///   labels, in raster order: 0 for zero pixels, 1..n for the others.
+///   Components are numbered in raster order of their first pixel (top to
+///   bottom, then left to right), independently of the number of threads;
+///   *pstats (if pstats != NULL) is set to a new array of n+1 component
+///   statistics, indexed by label (entry 0 describes the zero pixels).
+/// (The caller is responsible for freeing the returned arrays!)
+/// Empty bounding boxes (no pixels) have x0 > x1 and y0 > y1.
+/// (This involves allocation, and may fail.)
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageLabel(Image img, int* pn, uint32_t** plabels, Component** pstats) { ///
+  assert (img != NULL);
+  assert (pn != NULL);
+  int w = img->width;
+  int h = img->height;
+  Label L = { img, (w + 1) / 2, (h + 1) / 2, NULL, NULL, NULL, NULL, NULL, {0} };
+  size_t nb = (size_t)L.bw * L.bh;
+  size_t npix = (size_t)w * h;
+  Component* stats = NULL;
+  if (nb >= UINT32_MAX) {  // labels would not fit 32 bits
+    errno = EOVERFLOW;
+    return check(0, "Image too large");
+  }
+  int success =
+  check( (L.block = (uint32_t*)malloc((nb + 1) * sizeof(uint32_t))) != NULL &&
+         (L.top = (uint8*)malloc(nb + 1)) != NULL &&
+         (L.parent = (uint32_t*)calloc(nb + 1, sizeof(uint32_t))) != NULL &&
+         (L.labels = (uint32_t*)malloc((npix + 1) * sizeof(uint32_t))) != NULL &&
+         (L.strip = (uint8*)calloc((size_t)L.bh + 1, 1)) != NULL,
+         "Allocating label buffers failed" );
+  if (success) {
+    parallelRows(L.bh, npix * 2, labelStrip, &L);
+    for (int i = 0; i < PARMAX; i++) {
+      success = success && check( !L.failed[i], "Allocating label buffers failed" );
+    }
+  }
+  uint8* buf = NULL;
+  uint32_t* rank = NULL;
+  if (success) {
+    success = check( (buf = (uint8*)malloc(3 * (size_t)w + 1)) != NULL &&
+                     (rank = (uint32_t*)calloc(nb + 1, sizeof(uint32_t))) != NULL,
+                     "Allocating label buffers failed" );
+  }
+  uint32_t n = 0;
+  if (success) {
+    // Join the strips: the first block row of each one with the row above.
+    for (int by = 1; by < L.bh; by++) {
+      if (L.strip[by]) labelBlockRow(&L, by, 1, buf, NULL);
+    }
+    // Flatten: roots (smallest label of each set) get 1..n in order,
+    // and every other label comes after its parent, which is smaller.
+    L.parent[0] = 0;
+    for (size_t l = 1; l <= nb; l++) {
+      uint32_t p = L.parent[l];
+      if (p == 0) continue;  // unused label
+      L.parent[l] = (p == l) ? ++n : L.parent[p];
+    }
+    // Renumber by first pixel: in each block row, pixel row 2*by is met in
+    // the blocks with nonzero top pixels, and row 2*by+1 only adds the sets
+    // of the others.
+    uint32_t k = 0;
+    for (int by = 0; by < L.bh; by++) {
+      const uint32_t* blk = L.block + (size_t)by * L.bw;
+      const uint8* top = L.top + (size_t)by * L.bw;
+      for (int pass = 1; pass >= 0; pass--) {
+        for (int bx = 0; bx < L.bw; bx++) {
+          uint32_t f = L.parent[blk[bx]];
+          if (f != 0 && top[bx] == pass && rank[f] == 0) rank[f] = ++k;
+        }
+      }
+    }
+    for (size_t l = 1; l <= nb; l++) L.parent[l] = rank[L.parent[l]];
+    parallelRows(L.bh, npix, labelWrite, &L);
+    for (int i = 0; i < PARMAX; i++) {
+      success = success && check( !L.failed[i], "Allocating label buffers failed" );
+    }
+  }
+  if (success && pstats != NULL) {
+    success = check( (stats = (Component*)malloc((n + 1) * sizeof(Component))) != NULL,
+                     "Allocating component statistics failed" );
+  }
+  if (success && stats != NULL) {
+    for (uint32_t l = 0; l <= n; l++) {
+      stats[l] = (Component){ 0, w, h, -1, -1 };
+    }
+    for (int y = 0; y < h; y++) {
+      const uint32_t* row = L.labels + (size_t)y * w;
+      for (int x = 0; x < w; x++) {
+        Component* s = &stats[row[x]];
+        s->area++;
+        if (x < s->x0) s->x0 = x;
+        if (x > s->x1) s->x1 = x;
+        if (y < s->y0) s->y0 = y;
+        s->y1 = y;
+      }
+    }
+  }
+  if (success) {
+    COUNT(PIXMEM, 2ul * npix);  // count pixel memory accesses
+    *pn = (int)n;
+    if (plabels != NULL) {
+      *plabels = L.labels;
+      L.labels = NULL;
+    }
+    if (pstats != NULL) *pstats = stats;
+  }
+  errsave = errno;
+  free(buf);
+  free(rank);
+  free(L.block);
+  free(L.top);
+  free(L.parent);
+  free(L.labels);
+  free(L.strip);
+  errno = errsave;
+  return success;
+}
+
+/// Distance transform
+
+// ImageDistanceTransform is the separable algorithm of Felzenszwalb and
+// Huttenlocher ("Distance Transforms of Sampled Functions", 2012).  The
+// first pass finds, for each pixel, the vertical distance to the nearest
+// foreground pixel in its column: for a binary image that is just a
+// downward and an upward sweep, which run row by row over strips of
+// columns, in parallel.  The second pass computes, for each row, the lower
+// envelope of the parabolas (x-q)^2 + dy(q)^2 of its pixels q, in linear
+// time; rows are independent and run in parallel.  The total cost is O(1)
+// per pixel.  Squared distances are exact integers in double precision.
+
+#define DTSTRIP 256     // columns per strip in the first pass
+#define DTINF 1e20      // squared distance meaning "no foreground"
+
+typedef struct {
+  Image img;
+  float* dist;          // output, and vertical distances in between
+  int any[PARMAX];      // foreground found by each worker
+  int failed[PARMAX];   // scratch allocation failed in some worker
+} Distance;
+
+// First pass over column strips [s0,s1): vertical distances, in pixels,
+// to the nearest nonzero pixel in the same column (or DTINF).
+static void distColumns(void* arg, int worker, int s0, int s1) {
+  Distance* D = (Distance*)arg;
+  Image img = D->img;
+  int w = img->width;
+  int h = img->height;
+  uint8* buf = (uint8*)malloc(DTSTRIP);
+  if (buf == NULL) {
+    D->failed[worker] = 1;
+    return;
+  }
+  for (int s = s0; s < s1; s++) {
+    int c0 = s * DTSTRIP;
+    int n = (w - c0 < DTSTRIP) ? w - c0 : DTSTRIP;
+    // Downward sweep
+    const float* prev = NULL;
+    for (int y = 0; y < h; y++) {
+      const uint8* row = readRow(img, c0, y, n, buf);
+      float* cur = D->dist + (size_t)y * w + c0;
+      for (int i = 0; i < n; i++) {
+        if (row[i] != 0) D->any[worker] = 1;
+        cur[i] = (row[i] != 0) ? 0.0f : (prev == NULL) ? (float)DTINF : prev[i] + 1.0f;
+      }
+      prev = cur;
+    }
+    // Upward sweep
+    for (int y = h - 2; y >= 0; y--) {
+      float* cur = D->dist + (size_t)y * w + c0;
+      const float* next = cur + w;
+      for (int i = 0; i < n; i++) {
+        if (next[i] + 1.0f < cur[i]) cur[i] = next[i] + 1.0f;
+      }
+    }
+  }
+  free(buf);
+}
+
+// Lower envelope of the parabolas (x-q)^2 + f[q], for q in [0,n):
+// sets d[x] to its value at each x in [0,n).
+// v (n entries) and z (n+1 entries) are scratch.
+static void distEnvelope(const double* f, int n, double* d, int* v, double* z) {
+  int k = 0;  // rightmost parabola in the envelope
+  v[0] = 0;
+  z[0] = -HUGE_VAL;
+  z[1] = HUGE_VAL;
+  for (int q = 1; q < n; q++) {
+    // Intersection with parabola v[k]; drop that one while it is hidden.
+    // (This stops at k == 0, as z[0] is -infinity.)
+    int p = v[k];
+    double s = ((f[q] + (double)q*q) - (f[p] + (double)p*p)) / (2.0 * (q - p));
+    while (s <= z[k]) {
+      k--;
+      p = v[k];
+      s = ((f[q] + (double)q*q) - (f[p] + (double)p*p)) / (2.0 * (q - p));
+    }
+    k++;
+    v[k] = q;
+    z[k] = s;
+    z[k+1] = HUGE_VAL;
+  }
+  k = 0;
+  for (int x = 0; x < n; x++) {
+    while (z[k+1] < x) k++;
+    double dx = x - v[k];
+    d[x] = dx*dx + f[v[k]];
+  }
+}
+
+// Second pass over rows [y0,y1): from vertical to Euclidean distances.
+static void distRows(void* arg, int worker, int y0, int y1) {
+  Distance* D = (Distance*)arg;
+  int w = D->img->width;
+  double* f = (double*)malloc((3 * (size_t)w + 1) * sizeof(double));
+  int* v = (int*)malloc((size_t)w * sizeof(int) + 1);
+  if (f == NULL || v == NULL) {
+    free(f);
+    free(v);
+    D->failed[worker] = 1;
+    return;
+  }
+  double* d = f + w;
+  double* z = d + w;
+  for (int y = y0; y < y1; y++) {
+    float* row = D->dist + (size_t)y * w;
+    for (int x = 0; x < w; x++) {
+      f[x] = (row[x] >= (float)DTINF) ? DTINF : (double)row[x] * row[x];
+    }
+    distEnvelope(f, w, d, v, z);
+    for (int x = 0; x < w; x++) row[x] = (float)sqrt(d[x]);
+  }
+  free(f);
+  free(v);
+}
+
+/// Compute the Euclidean distance transform of img.
+/// For each pixel, this is the distance (in pixels) to the nearest
+/// nonzero (foreground) pixel, so foreground pixels get 0.
+/// The cost per pixel is constant.
+/// On success, returns a new array of width*height distances, in raster
+/// order.  If img has no nonzero pixels, all distances are INFINITY.
+/// (The caller is responsible for freeing the returned array!)
+/// (This involves allocation, and may fail.)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+float* ImageDistanceTransform(Image img) { ///
+  assert (img != NULL);
+  int w = img->width;
+  int h = img->height;
+  size_t npix = (size_t)w * h;
+  Distance D = { img, NULL, {0}, {0} };
+  if (!check( (D.dist = (float*)malloc((npix + 1) * sizeof(float))) != NULL,
+              "Allocating distance map failed" )) {
+    return NULL;
+  }
+  parallelRows((w + DTSTRIP - 1) / DTSTRIP, npix * 2, distColumns, &D);
+  if (w > 0) parallelRows(h, npix * 8, distRows, &D);
+  int success = 1;
+  int any = 0;
+  for (int i = 0; i < PARMAX; i++) {
+    success = success && check( !D.failed[i], "Allocating distance buffers failed" );
+    any |= D.any[i];
+  }
+  if (!success) {
+    errsave = errno;
+    free(D.dist);
+    errno = errsave;
+    return NULL;
+  }
+  if (!any) {  // no foreground at all
+    for (size_t i = 0; i < npix; i++) D.dist[i] = INFINITY;
+  }
+  COUNT(PIXMEM, npix);  // count pixel memory accesses
+  COUNT(NUMOPERACOES, 8ul * npix);  // about 8 operations per pixel
+  return D.dist;
+}
+
+/// Replace each pixel by its distance to the nearest nonzero pixel
+/// (see ImageDistanceTransform), multiplied by scale, rounded, and
+/// saturated at the maxval of img.
+/// Requires: scale >= 0.
+/// The image is changed in-place.
+/// (This involves allocation, and may fail.)
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageDistanceMap(Image img, double scale) { ///
+  assert (img != NULL);
+  assert (scale >= 0.0);
+  int w = img->width;
+  int h = img->height;
+  float* dist = ImageDistanceTransform(img);
+  uint8* buf = NULL;
+  int success =
+  dist != NULL &&
+  check( (buf = (uint8*)malloc((size_t)w + 1)) != NULL, "Allocating row buffer failed" ) &&
+  ownPixels(img);
+  if (success) {
+    touchAll(img);
+    for (int y = 0; y < h; y++) {
+      const float* row = dist + (size_t)y * w;
+      for (int x = 0; x < w; x++) {
+        double v = scale * row[x] + 0.5;
+        buf[x] = (v < img->maxval) ? (uint8)v : img->maxval;
+      }
+      putRow(img, 0, y, w, buf);
+    }
+    COUNT(PIXMEM, (size_t)w * h);  // count pixel memory accesses
+  }
+  errsave = errno;
+  free(dist);
+  free(buf);
+  errno = errsave;
+  return success;
+}
+
+/// Image comparison
+
+/// Check if two images are equal: same size, maxval and pixel levels.
+/// Rows are compared in segments with memcmp (which is vectorized), and
+/// the comparison stops at the first difference.
+int ImageEqual(Image img1, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  int w = img1->width;
+  int h = img1->height;
+  if (w != img2->width || h != img2->height || img1->maxval != img2->maxval) {
+    return 0;
+  }
+  if (img1->pixel == img2->pixel && img1->layout == img2->layout &&
+      img1->x0 == img2->x0 && img1->y0 == img2->y0) {
+    return 1;  // same pixels (the same image, a clone, or the same view)
+  }
+  uint8 buf1[TSIDE], buf2[TSIDE];
+  unsigned long reads = 0;  // pixeis lidos de cada imagem
+  int equal = 1;
+  for (int y = 0; equal && y < h; y++) {
+    for (int x = 0; equal && x < w; x += TSIDE) {
+      int n = (w - x < TSIDE) ? w - x : TSIDE;
+      equal = memcmp(readRow(img1, x, y, n, buf1), readRow(img2, x, y, n, buf2), n) == 0;
+      reads += n;
+    }
+  }
+  COUNT(PIXMEM, 2ul * reads);  // count pixel memory accesses
+  return equal;
+}
+
+typedef struct {
+  Image img1, img2;
+  Image dst;                // for ImageAbsDiff
+  uint64_t sse[PARMAX];     // sum of squared differences of each worker
+} Compare;
+
+// Absolute differences of rows [y0,y1), into c->dst.
+static void absDiffRows(void* arg, int worker, int y0, int y1) {
+  Compare* c = (Compare*)arg;
+  int w = c->img1->width;
+  uint8 buf1[TSIDE], buf2[TSIDE], out[TSIDE];
+  for (int y = y0; y < y1; y++) {
+    for (int x = 0; x < w; x += TSIDE) {
+      int n = (w - x < TSIDE) ? w - x : TSIDE;
+      const uint8* a = readRow(c->img1, x, y, n, buf1);
+      const uint8* b = readRow(c->img2, x, y, n, buf2);
+      for (int i = 0; i < n; i++) out[i] = (a[i] > b[i]) ? a[i] - b[i] : b[i] - a[i];
+      putRow(c->dst, x, y, n, out);
+    }
+  }
+}
+
+// Sum of squared differences of rows [y0,y1), into c->sse[worker].
+static void sseRows(void* arg, int worker, int y0, int y1) {
+  Compare* c = (Compare*)arg;
+  int w = c->img1->width;
+  uint8 buf1[TSIDE], buf2[TSIDE];
+  uint64_t sse = 0;
+  for (int y = y0; y < y1; y++) {
+    for (int x = 0; x < w; x += TSIDE) {
+      int n = (w - x < TSIDE) ? w - x : TSIDE;
+      const uint8* a = readRow(c->img1, x, y, n, buf1);
+      const uint8* b = readRow(c->img2, x, y, n, buf2);
+      uint32_t s = 0;  // at most TSIDE * 255^2
+      for (int i = 0; i < n; i++) {
+        int d = a[i] - b[i];
+        s += (uint32_t)(d * d);
+      }
+      sse += s;
+    }
+  }
+  c->sse[worker] += sse;
+}
+
+/// Compute the absolute difference of two images of the same size.
+/// Each pixel of the result is |img1(x,y) - img2(x,y)|, and its maxval is
+/// the larger of the two maxvals.  The result has the layout of img1.
+/// Requires: img1 and img2 have the same size.
+/// Ensures: img1 and img2 are not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageAbsDiff(Image img1, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (img1->width == img2->width && img1->height == img2->height);
+  int w = img1->width;
+  int h = img1->height;
+  int maxval = (img1->maxval > img2->maxval) ? img1->maxval : img2->maxval;
+  Compare c = { img1, img2, NULL, {0} };
+  c.dst = newImage(w, h, maxval, img1->layout);
+  if (c.dst == NULL) return NULL;
+  parallelRows(h, (size_t)w * h, absDiffRows, &c);
+  COUNT(PIXMEM, 3ul * w * h);  // count pixel memory accesses
+  COUNT(NUMOPERACOES, (unsigned long)w * h);
+  return c.dst;
+}
+
+/// Compute the peak signal-to-noise ratio of img2 relative to img1, in dB:
+/// 10*log10(L^2/MSE), where L is the maxval of img1 and MSE is the mean
+/// squared difference of their pixels.
+/// Requires: img1 and img2 have the same size.
+/// Returns INFINITY if the images have the same pixels (or no pixels).
+double ImagePSNR(Image img1, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (img1->width == img2->width && img1->height == img2->height);
+  int w = img1->width;
+  int h = img1->height;
+  Compare c = { img1, img2, NULL, {0} };
+  parallelRows(h, (size_t)w * h, sseRows, &c);
+  uint64_t sse = 0;
+  for (int i = 0; i < PARMAX; i++) sse += c.sse[i];
+  COUNT(PIXMEM, 2ul * w * h);  // count pixel memory accesses
+  COUNT(NUMOPERACOES, 2ul * w * h);
+  if (sse == 0) return INFINITY;
+  double mse = (double)sse / ((double)w * h);
+  double peak = img1->maxval;
+  return 10.0 * log10(peak * peak / mse);
+}
+
+// ImageSSIM needs, for each pixel, the sums of x, y, x^2, y^2 and xy over
+// a (2r+1)x(2r+1) window (x and y being the levels of the two images).
+// Those come from integral images, but kept for one row at a time: for
+// each column, running sums over the rows of the current window are
+// updated as the window moves down (adding one row and removing another),
+// and prefix sums along the row then give each window sum in O(1).  So the
+// cost per pixel is constant, and the memory is O(width) instead of five
+// full tables.  Bands of rows run in parallel, and the SSIM of each row is
+// summed separately, so that the result does not depend on the number of
+// threads.
+
+#define SSIM_K1 0.01
+#define SSIM_K2 0.03
+
+typedef struct {
+  Image img1, img2;
+  int r;                // window radius
+  double c1, c2;        // stabilizing constants
+  double* rowSum;       // sum of the SSIM of each row
+  int failed[PARMAX];   // scratch allocation failed in some worker
+} Ssim;
+
+// Add (sign = 1) or remove (sign = -1) row y to the column sums col.
+static void ssimAddRow(Ssim* S, int y, int64_t* col, int sign, uint8* buf) {
+  int w = S->img1->width;
+  const uint8* a = readRow(S->img1, 0, y, w, buf);
+  const uint8* b = readRow(S->img2, 0, y, w, buf + w);
+  int64_t* sx = col;
+  int64_t* sy = sx + w;
+  int64_t* sxx = sy + w;
+  int64_t* syy = sxx + w;
+  int64_t* sxy = syy + w;
+  for (int x = 0; x < w; x++) {
+    int p = sign * a[x];
+    int q = sign * b[x];
+    sx[x] += p;
+    sy[x] += q;
+    sxx[x] += p * a[x];
+    syy[x] += q * b[x];
+    sxy[x] += p * b[x];
+  }
+}
+
+// SSIM of rows [y0,y1), into S->rowSum.
+static void ssimRows(void* arg, int worker, int y0, int y1) {
+  Ssim* S = (Ssim*)arg;
+  int w = S->img1->width;
+  int h = S->img1->height;
+  int r = S->r;
+  int64_t* col = (int64_t*)calloc(5 * (size_t)w + 5 * ((size_t)w + 1), sizeof(int64_t));
+  uint8* buf = (uint8*)malloc(2 * (size_t)w + 1);
+  if (col == NULL || buf == NULL) {
+    free(col);
+    free(buf);
+    S->failed[worker] = 1;
+    return;
+  }
+  int64_t* pre = col + 5 * (size_t)w;  // prefix sums: 5 rows of w+1
+  size_t pw = (size_t)w + 1;
+  int top = (y0 - r > 0) ? y0 - r : 0;  // col has the sums of rows [top,bot)
+  int bot = top;
+  for (int y = y0; y < y1; y++) {
+    int wy0 = (y - r > 0) ? y - r : 0;
+    int wy1 = (y + r + 1 < h) ? y + r + 1 : h;
+    for (; bot < wy1; bot++) ssimAddRow(S, bot, col, 1, buf);
+    for (; top < wy0; top++) ssimAddRow(S, top, col, -1, buf);
+    for (int k = 0; k < 5; k++) {
+      const int64_t* c = col + k * (size_t)w;
+      int64_t* p = pre + k * pw;
+      p[0] = 0;
+      for (int x = 0; x < w; x++) p[x+1] = p[x] + c[x];
+    }
+    double sum = 0.0;
+    for (int x = 0; x < w; x++) {
+      int x0 = (x - r > 0) ? x - r : 0;
+      int x1 = (x + r + 1 < w) ? x + r + 1 : w;
+      double n = (double)(x1 - x0) * (wy1 - wy0);
+      double s[5];
+      for (int k = 0; k < 5; k++) {
+        s[k] = (double)(pre[k * pw + x1] - pre[k * pw + x0]);
+      }
+      double mx = s[0] / n, my = s[1] / n;
+      double vx = s[2] / n - mx * mx;
+      double vy = s[3] / n - my * my;
+      double cxy = s[4] / n - mx * my;
+      sum += ((2.0 * mx * my + S->c1) * (2.0 * cxy + S->c2)) /
+             ((mx * mx + my * my + S->c1) * (vx + vy + S->c2));
+    }
+    S->rowSum[y] = sum;
+  }
+  free(col);
+  free(buf);
+}
+
+/// Compute the mean structural similarity (SSIM) of img1 and img2.
+/// The SSIM of each pixel is computed over the (2r+1)x(2r+1) window
+/// centered on it (limited to the image, as in ImageBlur), with the usual
+/// constants (0.01 L)^2 and (0.03 L)^2, where L is the maxval of img1.
+/// The cost per pixel is constant, independent of r.
+/// Requires: img1 and img2 have the same size, r >= 0.
+/// On success, returns nonzero and sets *pssim to the mean SSIM (1 for
+/// equal images; 1 also for images with no pixels).
+/// (This involves allocation, and may fail.)
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageSSIM(Image img1, Image img2, int r, double* pssim) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (img1->width == img2->width && img1->height == img2->height);
+  assert (r >= 0);
+  assert (pssim != NULL);
+  int w = img1->width;
+  int h = img1->height;
+  double L = img1->maxval;
+  Ssim S = { img1, img2, r, (SSIM_K1 * L) * (SSIM_K1 * L), (SSIM_K2 * L) * (SSIM_K2 * L),
+             NULL, {0} };
+  if (!check( (S.rowSum = (double*)malloc(((size_t)h + 1) * sizeof(double))) != NULL,
+              "Allocating SSIM buffers failed" )) {
+    return 0;
+  }
+  int success = 1;
+  if (w > 0) {
+    parallelRowsGrain(h, (size_t)w * h * 16, 4ul * r, ssimRows, &S);
+    for (int i = 0; i < PARMAX; i++) {
+      success = success && check( !S.failed[i], "Allocating SSIM buffers failed" );
+    }
+  }
+  if (success) {
+    double sum = 0.0;
+    for (int y = 0; y < h; y++) sum += S.rowSum[y];
+    *pssim = ((size_t)w * h == 0) ? 1.0 : sum / ((double)w * h);
+    COUNT(PIXMEM, 4ul * w * h);  // each row is read twice, from both images
+    COUNT(NUMOPERACOES, 40ul * w * h);
+  }
+  errsave = errno;
+  free(S.rowSum);
+  errno = errsave;
+  return success;
+}
+
+
+/// Temporal frame stacks
+
+// A stack keeps running per-pixel accumulators over a sequence of frames,
+// so its memory depends only on the frame size, not on the number of
+// frames:
+//   sum16/sum32 (STACK_SUM): frames are added into 16-bit sums, which
+//     hold up to SUM16MAX frames; those are then folded into the 32-bit
+//     sums.  Should these fill up (after SUM32MAX frames), the sums and
+//     their frame count are halved, so the mean becomes approximate.
+//   min/max (STACK_MINMAX): running minimum and maximum.
+//   hist (STACK_HIST): 256 16-bit counters per pixel.  Counters are halved
+//     (rounding up, so no level is forgotten) when one could overflow
+//     (after HISTMAX frames), and from then on the median is approximate.
+// Every frame updates all pixels, so the frame counts are per stack.
+
+#define SUM16MAX 257                    // 257*255 == UINT16_MAX
+#define SUM32MAX (UINT32_MAX / 255 - SUM16MAX)
+#define HISTMAX UINT16_MAX
+
+struct stack {
+  int width, height;
+  int flags;
+  uint8 maxval;     // largest maxval of the frames added
+  long count;       // frames added
+  uint16_t* sum16;  // sums of the last pending frames
+  uint32_t* sum32;  // sums of the older frames
+  int pending;      // frames in sum16
+  uint32_t folded;  // frames in sum32 (halved with it)
+  uint8* min;
+  uint8* max;
+  uint16_t* hist;   // 256 counters per pixel
+  int histTop;      // upper bound of every counter
+};
+
+typedef struct {
+  Stack s;
+  Image frame;      // for StackAdd
+  int fold;         // fold sum16 into sum32 first?
+  int halve;        // halve sum32 when folding?
+  int halveHist;    // halve the counters first?
+  Image dst;        // for StackMean and StackMedian
+} Stacking;
+
+// sum[i] += src[i], for i in [0,n).
+static void sumSpan(uint16_t* sum, const uint8* src, int n) {
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i lo = _mm_loadu_si128((const __m128i*)(sum + i));
+    __m128i hi = _mm_loadu_si128((const __m128i*)(sum + i + 8));
+    lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+    hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+    _mm_storeu_si128((__m128i*)(sum + i), lo);
+    _mm_storeu_si128((__m128i*)(sum + i + 8), hi);
+  }
+#endif
+  for (; i < n; i++) sum[i] += src[i];
+}
+
+// min[i] = min(min[i], src[i]) and max[i] = max(max[i], src[i]).
+static void minMaxSpan(uint8* min, uint8* max, const uint8* src, int n) {
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i lo = _mm_loadu_si128((const __m128i*)(min + i));
+    __m128i hi = _mm_loadu_si128((const __m128i*)(max + i));
+    _mm_storeu_si128((__m128i*)(min + i), _mm_min_epu8(lo, v));
+    _mm_storeu_si128((__m128i*)(max + i), _mm_max_epu8(hi, v));
+  }
+#endif
+  for (; i < n; i++) {
+    if (src[i] < min[i]) min[i] = src[i];
+    if (src[i] > max[i]) max[i] = src[i];
+  }
+}
+
+// Add rows [y0,y1) of t->frame to the accumulators of t->s.
+static void stackRows(void* arg, int worker, int y0, int y1) {
+  Stacking* t = (Stacking*)arg;
+  Stack s = t->s;
+  int w = s->width;
+  uint8 buf[TSIDE];
+  for (int y = y0; y < y1; y++) {
+    for (int x = 0; x < w; x += TSIDE) {
+      int n = (w - x < TSIDE) ? w - x : TSIDE;
+      const uint8* src = readRow(t->frame, x, y, n, buf);
+      size_t p = (size_t)y*w + x;
+      if (s->flags & STACK_SUM) {
+        if (t->fold) {
+          for (int i = 0; i < n; i++) {
+            uint32_t v = (t->halve ? (s->sum32[p+i] + 1) >> 1 : s->sum32[p+i]);
+            s->sum32[p+i] = v + s->sum16[p+i];
+            s->sum16[p+i] = 0;
+          }
+        }
+        sumSpan(s->sum16 + p, src, n);
+      }
+      if (s->flags & STACK_MINMAX) {
+        minMaxSpan(s->min + p, s->max + p, src, n);
+      }
+      if (s->flags & STACK_HIST) {
+        uint16_t* h = s->hist + 256*p;
+        if (t->halveHist) {
+          for (int i = 0; i < 256*n; i++) h[i] = (uint16_t)((h[i] + 1) >> 1);
+        }
+        for (int i = 0; i < n; i++) h[256*i + src[i]]++;
+      }
+    }
+  }
+}
+
+/// Create a stack of frames of the given size.
+///   flags: which accumulators to keep, a combination (|) of
+///     STACK_SUM for StackMean (6 bytes per pixel),
+///     STACK_MINMAX for StackMin and StackMax (2 bytes per pixel),
+///     STACK_HIST for StackMedian (512 bytes per pixel!).
+/// Requires: width and height must be non-negative.
+///
+/// On success, a new stack is returned.
+/// (The caller is responsible for destroying the returned stack!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Stack StackCreate(int width, int height, int flags) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  assert ((flags & ~(STACK_SUM | STACK_MINMAX | STACK_HIST)) == 0);
+  if (!pixFits(width, height, LAYOUT_RASTER)) {
+    errno = EOVERFLOW;
+    check(0, "Stack too large");
+    return NULL;
+  }
+  size_t n = (size_t)width * height;
+  Stack s = (Stack)calloc(1, sizeof(struct stack));
+  if (!check( s != NULL, "Allocating stack failed" )) return NULL;
+  s->width = width;
+  s->height = height;
+  s->flags = flags;
+  int success =
+  (!(flags & STACK_SUM) ||
+   (check( (s->sum16 = (uint16_t*)calloc(n + 1, sizeof(uint16_t))) != NULL,
+           "Allocating stack sums failed" ) &&
+    check( (s->sum32 = (uint32_t*)calloc(n + 1, sizeof(uint32_t))) != NULL,
+           "Allocating stack sums failed" ))) &&
+  (!(flags & STACK_MINMAX) ||
+   (check( (s->min = (uint8*)malloc(n + 1)) != NULL, "Allocating stack extremes failed" ) &&
+    check( (s->max = (uint8*)calloc(n + 1, 1)) != NULL, "Allocating stack extremes failed" ))) &&
+  (!(flags & STACK_HIST) ||
+   check( (s->hist = (uint16_t*)calloc(256*n + 1, sizeof(uint16_t))) != NULL,
+          "Allocating stack histograms failed" ));
+  if (!success) {
+    StackDestroy(&s);
+    return NULL;
+  }
+  if (s->min != NULL) memset(s->min, PixMax, n);
+  return s;
+}
+
+/// Destroy the stack pointed to by (*sp).
+/// If (*sp)==NULL, no operation is performed.
+/// Ensures: (*sp)==NULL.
+void StackDestroy(Stack* sp) { ///
+  assert (sp != NULL);
+  Stack s = *sp;
+  if (s == NULL) return;
+  errsave = errno;
+  free(s->sum16);
+  free(s->sum32);
+  free(s->min);
+  free(s->max);
+  free(s->hist);
+  free(s);
+  errno = errsave;
+  *sp = NULL;
+}
+
+/// Add a frame to the stack.
+/// The frame may have any layout, or be a view.  It is not kept: only the
+/// accumulators are updated, which takes time proportional to its size.
+/// Requires: frame has the size of the stack.
+/// Ensures: frame is not modified.
+void StackAdd(Stack s, Image frame) { ///
+  assert (s != NULL);
+  assert (frame != NULL);
+  assert (frame->width == s->width && frame->height == s->height);
+  Stacking t = { s, frame, s->pending == SUM16MAX, 0, s->histTop == HISTMAX, NULL };
+  if (t.fold) {
+    t.halve = s->folded > SUM32MAX;
+    s->folded = (t.halve ? (s->folded + 1) >> 1 : s->folded) + SUM16MAX;
+    s->pending = 0;
+  }
+  if (t.halveHist) s->histTop = (s->histTop + 1) >> 1;
+  size_t cost = (size_t)s->width * s->height * ((s->flags & STACK_HIST) ? 4 : 1);
+  parallelRows(s->height, cost, stackRows, &t);
+  s->pending++;
+  s->histTop++;
+  s->count++;
+  if (frame->maxval > s->maxval) s->maxval = frame->maxval;
+  COUNT(PIXMEM, (unsigned long)s->width * s->height);  // count pixel memory accesses
+  COUNT(NUMOPERACOES, (unsigned long)s->width * s->height);
+}
+
+/// Get the number of frames added to the stack.
+long StackCount(Stack s) { ///
+  assert (s != NULL);
+  return s->count;
+}
+
+/// Get the width of the frames of the stack.
+int StackWidth(Stack s) { ///
+  assert (s != NULL);
+  return s->width;
+}
+
+/// Get the height of the frames of the stack.
+int StackHeight(Stack s) { ///
+  assert (s != NULL);
+  return s->height;
+}
+
+// Means of rows [y0,y1), into t->dst.
+static void meanRows(void* arg, int worker, int y0, int y1) {
+  Stacking* t = (Stacking*)arg;
+  Stack s = t->s;
+  int w = s->width;
+  uint64_t n = (uint64_t)s->folded + s->pending;
+  uint8 out[TSIDE];
+  for (int y = y0; y < y1; y++) {
+    for (int x = 0; x < w; x += TSIDE) {
+      int m = (w - x < TSIDE) ? w - x : TSIDE;
+      size_t p = (size_t)y*w + x;
+      for (int i = 0; i < m; i++) {
+        uint64_t sum = (uint64_t)s->sum32[p+i] + s->sum16[p+i];
+        uint64_t v = (sum + n/2) / n;
+        out[i] = (uint8)(v > PixMax ? PixMax : v);
+      }
+      putRow(t->dst, x, y, m, out);
+    }
+  }
+}
+
+// Medians of rows [y0,y1), into t->dst.
+static void medianStackRows(void* arg, int worker, int y0, int y1) {
+  Stacking* t = (Stacking*)arg;
+  Stack s = t->s;
+  int w = s->width;
+  uint8 out[TSIDE];
+  for (int y = y0; y < y1; y++) {
+    for (int x = 0; x < w; x += TSIDE) {
+      int m = (w - x < TSIDE) ? w - x : TSIDE;
+      for (int i = 0; i < m; i++) {
+        const uint16_t* h = s->hist + 256*((size_t)y*w + x + i);
+        uint32_t total = 0;
+        for (int v = 0; v < 256; v++) total += h[v];
+        uint32_t half = (total + 1) / 2;  // the lower median, for even totals
+        uint32_t acc = 0;
+        int v = 0;
+        while (v < PixMax && (acc += h[v]) < half) v++;
+        out[i] = (uint8)v;
+      }
+      putRow(t->dst, x, y, m, out);
+    }
+  }
+}
+
+// Make a raster image of the stack size with the rows of buf (NULL: black).
+static Image stackImage(Stack s, const uint8* buf) {
+  Image img = newImage(s->width, s->height, s->maxval, LAYOUT_RASTER);
+  if (img != NULL && buf != NULL) {
+    memcpy(img->pixel, buf, (size_t)s->width * s->height);
+    COUNT(PIXMEM, 2ul * s->width * s->height);  // count pixel memory accesses
+  }
+  return img;
+}
+
+/// Get the mean of the frames in the stack, rounded to nearest.
+/// After more than about 16 million frames the mean is approximate (see
+/// StackCreate).  The maxval of the result is the largest of the frames.
+/// Requires: s was created with STACK_SUM, and has some frames.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image StackMean(Stack s) { ///
+  assert (s != NULL);
+  assert (s->flags & STACK_SUM);
+  assert (s->count > 0);
+  Stacking t = { s, NULL, 0, 0, 0, stackImage(s, NULL) };
+  if (t.dst == NULL) return NULL;
+  parallelRows(s->height, 2 * (size_t)s->width * s->height, meanRows, &t);
+  COUNT(NUMOPERACOES, (unsigned long)s->width * s->height);
+  return t.dst;
+}
+
+/// Get the (lower) median of the frames in the stack.
+/// After 65535 frames the counters start being halved, and the median is
+/// approximate, favouring the more recent frames.
+/// The maxval of the result is the largest of the frames.
+/// Requires: s was created with STACK_HIST, and has some frames.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image StackMedian(Stack s) { ///
+  assert (s != NULL);
+  assert (s->flags & STACK_HIST);
+  assert (s->count > 0);
+  Stacking t = { s, NULL, 0, 0, 0, stackImage(s, NULL) };
+  if (t.dst == NULL) return NULL;
+  parallelRows(s->height, 256 * (size_t)s->width * s->height, medianStackRows, &t);
+  COUNT(NUMOPERACOES, 256ul * s->width * s->height);
+  return t.dst;
+}
+
+/// Get the minimum of the frames in the stack.
+/// Requires: s was created with STACK_MINMAX, and has some frames.
+/// On success, a new image is returned (see StackMean).
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image StackMin(Stack s) { ///
+  assert (s != NULL);
+  assert (s->flags & STACK_MINMAX);
+  assert (s->count > 0);
+  return stackImage(s, s->min);
+}
+
+/// Get the maximum of the frames in the stack.
+/// Requires: s was created with STACK_MINMAX, and has some frames.
+/// On success, a new image is returned (see StackMean).
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image StackMax(Stack s) { ///
+  assert (s != NULL);
+  assert (s->flags & STACK_MINMAX);
+  assert (s->count > 0);
+  return stackImage(s, s->max);
+}
+
+typedef struct {
+  Image img, bg;
+  int thr;
+} Foreground;
+
+// Background subtraction of rows [y0,y1).
+static void foregroundRows(void* arg, int worker, int y0, int y1) {
+  Foreground* f = (Foreground*)arg;
+  int w = f->img->width;
+  uint8 buf1[TSIDE], buf2[TSIDE];
+  for (int y = y0; y < y1; y++) {
+    for (int x = 0; x < w; x += TSIDE) {
+      int n = (w - x < TSIDE) ? w - x : TSIDE;
+      uint8* a = readRow(f->img, x, y, n, buf1);
+      const uint8* b = readRow(f->bg, x, y, n, buf2);
+      for (int i = 0; i < n; i++) {
+        int d = (a[i] > b[i]) ? a[i] - b[i] : b[i] - a[i];
+        a[i] = (uint8)(d > f->thr ? d : 0);
+      }
+      writeRow(f->img, x, y, n, a);
+    }
+  }
+}
+
+/// Subtract a background from an image (e.g., the median of a stack).
+/// Each pixel becomes |img(x,y) - bg(x,y)|, or 0 where that is <= thr:
+/// what remains is the foreground, the parts of img that differ from bg.
+/// This modifies img in-place, and only allocates memory if img shares
+/// its pixels with a clone.
+/// Requires: img and bg have the same size, thr >= 0.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageSubtractBackground(Image img, Image bg, int thr) { ///
+  assert (img != NULL);
+  assert (bg != NULL);
+  assert (img->width == bg->width && img->height == bg->height);
+  assert (thr >= 0);
+  if (!ownPixels(img)) return 0;
+  touchAll(img);
+  Foreground f = { img, bg, thr };
+  size_t cost = 2 * (size_t)img->width * img->height;
+  if (img->pixel != bg->pixel) {
+    parallelRows(img->height, cost, foregroundRows, &f);
+  } else {
+    foregroundRows(&f, 0, 0, img->height);
+  }
+  COUNT(PIXMEM, 3ul * img->width * img->height);  // count pixel memory accesses
+  COUNT(NUMOPERACOES, (unsigned long)img->width * img->height);
+  return 1;
+}
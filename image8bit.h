@@ -13,6 +13,7 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stdio.h>
 
 // Type for pixel levels
 typedef uint8_t uint8;
@@ -23,6 +24,30 @@ extern const uint8 PixMax;
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Thread safety.
+// The module keeps no shared mutable state: error causes (ImageErrMsg) and
+// instrumentation counters are per thread (see instrumentation.h), so
+// different threads may work on different images at the same time.
+// An image may be read by several threads at once, but must not be
+// modified while other threads use it (or its views).  Clones may be used
+// by different threads freely.  ImageHistogram, ImageStats, ImageIntegral
+// and ImageBlurred count as modifying an image (they update data kept
+// with it), except on views.
+
+// Pixel memory layouts.
+// LAYOUT_RASTER stores the pixels as a single row-major raster scan.
+// LAYOUT_TILED stores them as 64x64 square tiles, which gives locality in
+// both axes (rotation, filters with large windows, subimage search).
+// The layout never changes the result of any operation.
+typedef enum { LAYOUT_RASTER, LAYOUT_TILED } Layout;
+
+// Interpolation methods for resampling operations.
+typedef enum { INTERP_NEAREST, INTERP_BILINEAR, INTERP_AREA } Interp;
+
+// Methods for ImageBlur (see ImageSetBlurMethod).
+// They give the same results; BLUR_AUTO picks the fastest one.
+typedef enum { BLUR_AUTO, BLUR_DIRECT, BLUR_SAT, BLUR_RUNNING } BlurMethod;
+
 /// Error handling functions
 
 /// Error cause.
@@ -33,12 +58,25 @@ typedef struct image *Image;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
+/// The error cause is kept per thread.
 char* ImageErrMsg() ;
 
-/// Init Image library.  (Call once!)
+/// Init Image library.
 /// Currently, simply calibrate instrumentation and set names of counters.
+/// Only the first call has any effect, and it is safe to call from
+/// several threads (all return when initialization is complete).
 void ImageInit(void) ;
 
+/// Set the number of threads used by image operations to n (at most 64).
+/// With n <= 0, use the IMAGE8BIT_THREADS environment variable, if set,
+/// or else one thread per processor (the default).
+/// Results never depend on the number of threads.
+/// Not to be called while other threads are running image operations.
+void ImageSetThreads(int n) ;
+
+/// Get the number of threads used by image operations.
+int ImageThreads(void) ;
+
 /// Image management functions
 
 /// Create a new black image.
@@ -51,13 +89,35 @@ void ImageInit(void) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCreate(int width, int height, uint8 maxval) ;
 
+/// Clone an image.
+/// Returns a new image with the same size, maxval, layout and pixels as img.
+/// The pixel array is shared (not copied) until either image is modified:
+/// cloning takes constant time, and modifying a clone never affects the
+/// other.  (But views, and images with views, are copied right away.)
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageClone(Image img) ;
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
+/// Requires: no views of the image exist.
+/// Destroying a view does not affect the image it views.
 /// Ensures: (*imgp)==NULL.
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) ;
 
+/// Change the pixel memory layout of img, converting its pixel array.
+/// The pixel levels are not changed.
+/// Requires: img is not a view (nor viewed by others).
+/// (This is an allocation, and may fail.)
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageSetLayout(Image img, Layout layout) ;
+
 /// PGM file operations
 
 /// Load a raw PGM file.
@@ -73,6 +133,52 @@ Image ImageLoad(const char* filename) ;
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) ;
 
+/// Read a raw PGM image from an open stream.
+/// Leading whitespace is skipped, so several images may be read in
+/// sequence from one stream (as allowed by the PGM format).
+/// Does not count pixel memory accesses, so it may run in a thread of its
+/// own, concurrently with other module functions.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+/// If the stream ends before an image starts, errCause is "End of file",
+/// and feof(f) is true.
+Image ImageRead(FILE* f) ;
+
+/// Write image in raw PGM format to an open stream.
+/// Does not count pixel memory accesses, so it may run in a thread of its
+/// own, concurrently with other module functions (that do not modify img).
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageWrite(Image img, FILE* f) ;
+
+/// Tiled container file operations
+
+/// The tiled container stores an image as a grid of fixed-size tiles,
+/// each compressed independently (horizontal delta + PackBits RLE), and
+/// an index of tile offsets.  A rectangular region can then be loaded by
+/// reading and decoding only the tiles it touches.
+
+/// Save image to a tiled container file, using tile x tile pixel tiles.
+/// Requires: 0 < tile <= 4096.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageSaveTiled(Image img, const char* filename, int tile) ;
+
+/// Check if file is a tiled container.
+/// If it is, returns 1 and sets (*pw, *ph) to the image dimensions.
+/// Otherwise, returns 0 and (*pw, *ph) are left untouched.
+int ImageProbeTiled(const char* filename, int* pw, int* ph) ;
+
+/// Load the rectangle (x,y,w,h) of the image stored in a tiled container.
+/// Only the tiles that intersect the rectangle are read and decoded.
+/// The rectangle must be inside the stored image (it is checked).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadRegion(const char* filename, int x, int y, int w, int h) ;
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -86,11 +192,35 @@ int ImageHeight(Image img) ;
 /// Get image maximum gray level
 int ImageMaxval(Image img) ;
 
+/// Get image pixel memory layout
+Layout ImageLayout(Image img) ;
+
+/// Check if img is a view of another image (see ImageView).
+int ImageIsView(Image img) ;
+
+/// Check if img has views (see ImageView).
+int ImageHasViews(Image img) ;
+
+/// Check if img shares its pixel array with clones (see ImageClone).
+/// Destroying such an image frees no pixel memory.
+int ImageSharesPixels(Image img) ;
+
 /// Pixel stats
+/// Compute the histogram of img: hist[v] is set to the number of pixels
+/// with level v, for v in [0, 255].
+/// Unless img is a view, the histogram is kept with it, and later calls
+/// only recount the pixels changed since (by any operation).
+/// (This involves allocation, and may fail.)
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageHistogram(Image img, uint64_t hist[256]) ;
+
 /// Find the minimum and maximum gray levels in image.
 /// On return,
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
+/// Unless img is a view, this uses (and keeps) its histogram: see
+/// ImageHistogram.
 void ImageStats(Image img, uint8* min, uint8* max) ;
 
 /// Check if pixel position (x,y) is inside img.
@@ -110,35 +240,40 @@ int ImageValidRect(Image img, int x, int y, int w, int h) ;
 uint8 ImageGetPixel(Image img, int x, int y) ;
 
 /// Set the pixel at position (x,y) to new level.
+/// If img shares its pixels with a clone, it gets its own copy first;
+/// should that fail, the pixel is left unchanged (and errCause is set).
 void ImageSetPixel(Image img, int x, int y, uint8 level) ;
 
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
 /// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
-/// They never fail.
+/// All of these functions modify the image in-place, and only allocate
+/// memory if img shares its pixels with a clone (see ImageClone).
+/// On success, they return nonzero.
+/// On failure, they return 0, errno/errCause are set accordingly, and img
+/// is left unchanged.
 
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
-void ImageNegative(Image img) ;
+int ImageNegative(Image img) ;
 
 /// Apply threshold to image.
 /// Transform all pixels with level<thr to black (0) and
 /// all pixels with level>=thr to white (maxval).
-void ImageThreshold(Image img, uint8 thr) ;
+int ImageThreshold(Image img, uint8 thr) ;
 
 /// Brighten image by a factor.
 /// Multiply each pixel level by a factor, but saturate at maxval.
 /// This will brighten the image if factor>1.0 and
 /// darken the image if factor<1.0.
-void ImageBrighten(Image img, double factor) ;
+int ImageBrighten(Image img, double factor) ;
 
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
-/// returning a new image as a result.
+/// returning a new image as a result, with the same layout as img.
 /// 
 /// Success and failure are treated as in ImageCreate:
 /// On success, a new image is returned.
@@ -164,6 +299,31 @@ Image ImageRotate(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) ;
 
+/// Mirror an image in-place (flip left-right).
+/// Same result as ImageMirror, without allocating a new image.
+/// If img shares its pixels with a clone, they are copied first.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageMirrorInPlace(Image img) ;
+
+/// Rotate an image 180 degrees in-place.
+/// If img shares its pixels with a clone, they are copied first.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageRotate180InPlace(Image img) ;
+
+/// Rotate an image 90 degrees anti-clockwise in-place.
+/// Same result as ImageRotate, without allocating a new image (but, for
+/// non-square raster images, w*h/8 bytes of bookkeeping).
+/// If img shares its pixels with a clone, ImageRotate is used instead.
+/// Requires: img is not a view, nor viewed by others.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageRotateInPlace(Image img) ;
+
 /// Crop a rectangular subimage from img.
 /// The rectangle is specified by the top left corner coords (x, y) and
 /// width w and height h.
@@ -178,21 +338,108 @@ Image ImageMirror(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Create a view of a rectangular subimage of img, without copying.
+/// The rectangle is specified as in ImageCrop.
+/// The view is an image of width w and height h that shares its pixels
+/// with img: changes made through either are seen in both.
+/// Views may be used wherever an image is expected (except in
+/// ImageSetLayout), and views of views are allowed.
+/// Requires:
+///   The rectangle must be inside the original image.
+///   The view must be destroyed before img.
+/// Ensures:
+///   The pixels of img are not copied nor modified.
+/// Pasting or blending a view into an overlapping region of the same
+/// pixels is not supported.
+/// 
+/// On success, a new image (view) is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageView(Image img, int x, int y, int w, int h) ;
+
+/// Resize an image to w x h pixels.
+/// interp selects how output pixels are computed from the source:
+///   INTERP_NEAREST:  the source pixel nearest to the output pixel center;
+///   INTERP_BILINEAR: bilinear interpolation of the 4 nearest pixels;
+///   INTERP_AREA:     the mean of the source area covered by the output
+///                    pixel (best for reducing images).
+/// Requires: w >= 0, h >= 0; img must not be empty unless w*h == 0.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, Interp interp) ;
+
+/// Apply an affine transformation to an image.
+/// Output pixel (x,y) of the new w x h image takes the level of img at
+/// source position
+///   (m[0]*x + m[1]*y + m[2], m[3]*x + m[4]*y + m[5]),
+/// sampled with INTERP_NEAREST or INTERP_BILINEAR.
+/// Output pixels whose source position falls outside img are set to fill.
+/// The matrix of a 90 degree anti-clockwise rotation is handled exactly
+/// by ImageRotate.
+/// Requires: w >= 0, h >= 0, interp is not INTERP_AREA.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageWarpAffine(Image img, int w, int h, const double m[6], Interp interp, uint8 fill) ;
+
+/// Rotate an image by an arbitrary angle.
+/// Returns the image rotated anti-clockwise by degrees, about its center,
+/// in a new image just large enough to contain it.
+/// Pixels not covered by the rotated image are set to fill.
+/// Multiples of 90 degrees are exact (90 degrees gives ImageRotate).
+/// Requires: interp is not INTERP_AREA.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateAngle(Image img, double degrees, Interp interp, uint8 fill) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place, and only allocates memory if img1 shares
+/// its pixels with a clone.
 /// Requires: img2 must fit inside img1 at position (x, y).
-void ImagePaste(Image img1, int x, int y, Image img2) ;
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img1 is
+/// left unchanged.
+int ImagePaste(Image img1, int x, int y, Image img2) ;
 
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place, and only allocates memory if img1 shares
+/// its pixels with a clone.
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
-void ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img1 is
+/// left unchanged.
+int ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
+
+/// Composite n layers into base, in one pass.
+/// Layer i is the image layers[i], placed with its top left corner at
+/// (offsets[2*i], offsets[2*i+1]) of base, and clipped to base (it need
+/// not fit inside).  Layers are applied in order, so later ones go on top.
+/// If masks != NULL and masks[i] != NULL, masks[i] is the alpha mask of
+/// layer i, of the same size: level m blends the layer pixel over base
+/// with alpha m/maxval of the mask (with 8 bits of precision).  Layers
+/// without a mask are opaque (as in ImagePaste).
+/// This modifies base in-place, and only allocates memory if base shares
+/// its pixels with a clone, besides O(n) bookkeeping.
+/// Requires: n >= 0; layers and masks do not share pixels with base (are
+/// not views of it, say).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and base is
+/// left unchanged.
+int ImageComposite(Image base, Image layers[], Image masks[], const int offsets[], int n) ;
 
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
@@ -205,12 +452,320 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Compare an image to a subimage of a larger image, with tolerance.
+/// Pixels of img2 where mask (if not NULL, an image of the same size) is 0
+/// are ignored.  img2 matches the subimage of img1 at pos (x, y) if each
+/// other pixel differs from the one it covers by at most tol levels, and
+/// the sum of those absolute differences (SAD) is at most budget (or any,
+/// if budget < 0).  With tol = 0 and no mask, this is ImageMatchSubImage.
+/// Requires: img2 fits inside img1 at pos (x, y); 0 <= tol <= 255.
+/// Returns 1 (true) if it matches, 0 otherwise.
+int ImageMatchSubImageTol(Image img1, int x, int y, Image img2, Image mask, int tol, long budget) ;
+
+/// Locate a subimage inside another image, with tolerance.
+/// Searches for img2 inside img1, as ImageLocateSubImage, but matching
+/// as ImageMatchSubImageTol (with the given mask, tol and budget).
+/// If a match is found, returns 1 and the first matching position (in the
+/// order of ImageLocateSubImage) is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// Requires: 0 <= tol <= 255; mask is NULL or has the size of img2.
+int ImageLocateSubImageTol(Image img1, int* px, int* py, Image img2, Image mask, int tol, long budget) ;
+
 /// Filtering
 
+/// Force ImageBlur to use the given method (see BlurMethod).
+/// BLUR_AUTO restores the automatic choice (or the method named by the
+/// environment variable IMAGE8BIT_BLUR, if any).
+/// All methods give the same results: this is meant for testing and
+/// benchmarking.
+void ImageSetBlurMethod(BlurMethod method) ;
+
+/// Get the method ImageBlur uses for a width x height image and a
+/// (2dx+1)x(2dy+1) window.
+/// The first automatic choice may take a few seconds (more with full
+/// instrumentation), to measure the methods on this machine, unless that
+/// was done before: the thresholds measured are kept in the file named by
+/// the environment variable IMAGE8BIT_BLURCONF, or else ~/.image8bit-blur-N,
+/// where N is the instrumentation level of the build (INSTR_LEVEL).
+/// Requires: width, height, dx and dy must be non-negative.
+BlurMethod ImageBlurMethod(int width, int height, int dx, int dy) ;
+
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
+/// [x-dx, x+dx]x[y-dy, y+dy] (only those inside the image), rounded.
+/// The image is changed in-place.
+/// The method (see ImageBlurMethod) does not change the result.
+/// Requires: dx >= 0, dy >= 0.
+/// (This involves allocation, and may fail.)
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageBlur(Image img, int dx, int dy) ;
+
+/// Compute the integral image (summed area table) of img.
+/// Returns an array of (w+1)*(h+1) sums, row by row, where w and h are the
+/// dimensions of img: entry y*(w+1)+x is the sum of the levels of the
+/// pixels in [0,x[ x [0,y[ (so row 0 and column 0 are zeros).
+/// The array is kept with img, and belongs to it: it is valid until img is
+/// next modified or destroyed.  Later calls only recompute the sums that
+/// may have changed since: those below and to the right of the top left
+/// corner of the changed pixels.
+/// Requires: img is not a view.
+/// (This involves allocation, and may fail.)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+const int64_t* ImageIntegral(Image img) ;
+
+/// Blur a copy of img, as ImageBlur does, and return it.
+/// Unless img is a view, the result is also kept with img, so that a later
+/// call with the same dx and dy only recomputes the pixels within (dx,dy)
+/// of those changed since.  The returned image shares its pixels with the
+/// kept one until either changes (see ImageClone): destroying it before
+/// the next call saves a copy.
+/// Requires: dx >= 0, dy >= 0.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageBlurred(Image img, int dx, int dy) ;
+
+/// Convolve an image with a separable kernel.
+/// Each pixel is replaced by the sum of its (nkx x nky) neighbourhood,
+/// weighted by kx[i]*ky[j], with the kernels centered on the pixel.
+/// Pixels outside the image take the level of the nearest edge pixel
+/// (clamp-to-edge).  Results are rounded and saturated to [0, maxval].
+/// Weights are applied in fixed point, with 12 fraction bits.
+/// Requires: nkx and nky are odd and positive, and the absolute weights
+/// of each kernel add up to at most 8.
+/// The image is changed in-place.
+/// (This involves allocation, and may fail.)
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageConvolveSeparable(Image img, const double* kx, int nkx, const double* ky, int nky) ;
+
+/// Build a Gaussian kernel for standard deviation sigma.
+/// The kernel radius is r = ceil(3*sigma), so the kernel has 2r+1 taps,
+/// which are normalized to add up to 1.
+/// Requires: sigma > 0.
+/// On success, returns the kernel and sets (*n) to its length.
+/// (The caller is responsible for freeing the returned array!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+double* ImageGaussianKernel(double sigma, int* n) ;
+
+/// Apply a (2dx+1)x(2dy+1) median filter.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that lie inside the image (as in ImageBlur).
+/// When that rectangle has an even number of pixels, the lower of the two
+/// middle levels is used.
+/// The cost per pixel is constant, independent of dx and dy.
+/// Requires: 0 <= dx, 0 <= dy < 32768.
+/// The image is changed in-place.
+/// (This involves allocation, and may fail.)
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageMedian(Image img, int dx, int dy) ;
+
+/// Morphology
+
+/// Erode an image with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the minimum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that lie inside the image.
+/// The cost per pixel is constant, independent of dx and dy.
+/// Requires: dx >= 0, dy >= 0.
+/// The image is changed in-place.
+/// (This involves allocation, and may fail.)
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageErode(Image img, int dx, int dy) ;
+
+/// Dilate an image with a (2dx+1)x(2dy+1) rectangle.
+/// Like ImageErode, but using the maximum instead of the minimum.
+int ImageDilate(Image img, int dx, int dy) ;
+
+/// Open an image with a (2dx+1)x(2dy+1) rectangle: erode, then dilate.
+/// This removes bright details smaller than the rectangle.
+/// Same contract as ImageErode (on failure, img may be eroded only).
+int ImageOpen(Image img, int dx, int dy) ;
+
+/// Close an image with a (2dx+1)x(2dy+1) rectangle: dilate, then erode.
+/// This fills dark details smaller than the rectangle.
+/// Same contract as ImageErode (on failure, img may be dilated only).
+int ImageClose(Image img, int dx, int dy) ;
+
+/// Connected components
+
+// Statistics of a connected component (see ImageLabel).
+typedef struct {
+  long area;           // number of pixels
+  int x0, y0, x1, y1;  // bounding box [x0,x1]x[y0,y1]
+} Component;
+
+/// Label the connected components of the nonzero pixels of img.
+/// Pixels are connected to their 8 neighbours (horizontal, vertical and
+/// diagonal).  This is meant for thresholded images (see ImageThreshold).
+/// On success, returns nonzero, and
+///   *pn is set to the number n of components;
+///   *plabels (if plabels != NULL) is set to a new array of width*height
+///   labels, in raster order: 0 for zero pixels, 1..n for the others.
+///   Components are numbered in raster order of their first pixel (top to
+///   bottom, then left to right), independently of the number of threads;
+///   *pstats (if pstats != NULL) is set to a new array of n+1 component
+///   statistics, indexed by label (entry 0 describes the zero pixels).
+/// (The caller is responsible for freeing the returned arrays!)
+/// Empty bounding boxes (no pixels) have x0 > x1 and y0 > y1.
+/// (This involves allocation, and may fail.)
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageLabel(Image img, int* pn, uint32_t** plabels, Component** pstats) ;
+
+/// Distance transform
+
+/// Compute the Euclidean distance transform of img.
+/// For each pixel, this is the distance (in pixels) to the nearest
+/// nonzero (foreground) pixel, so foreground pixels get 0.
+/// The cost per pixel is constant.
+/// On success, returns a new array of width*height distances, in raster
+/// order.  If img has no nonzero pixels, all distances are INFINITY.
+/// (The caller is responsible for freeing the returned array!)
+/// (This involves allocation, and may fail.)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+float* ImageDistanceTransform(Image img) ;
+
+/// Replace each pixel by its distance to the nearest nonzero pixel
+/// (see ImageDistanceTransform), multiplied by scale, rounded, and
+/// saturated at the maxval of img.
+/// Requires: scale >= 0.
 /// The image is changed in-place.
-void ImageBlur(Image img, int dx, int dy) ;
+/// (This involves allocation, and may fail.)
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageDistanceMap(Image img, double scale) ;
+
+/// Image comparison
+
+/// Check if two images are equal: same size, maxval and pixel levels.
+/// Rows are compared in segments with memcmp (which is vectorized), and
+/// the comparison stops at the first difference.
+int ImageEqual(Image img1, Image img2) ;
+
+/// Compute the absolute difference of two images of the same size.
+/// Each pixel of the result is |img1(x,y) - img2(x,y)|, and its maxval is
+/// the larger of the two maxvals.  The result has the layout of img1.
+/// Requires: img1 and img2 have the same size.
+/// Ensures: img1 and img2 are not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageAbsDiff(Image img1, Image img2) ;
+
+/// Compute the peak signal-to-noise ratio of img2 relative to img1, in dB:
+/// 10*log10(L^2/MSE), where L is the maxval of img1 and MSE is the mean
+/// squared difference of their pixels.
+/// Requires: img1 and img2 have the same size.
+/// Returns INFINITY if the images have the same pixels (or no pixels).
+double ImagePSNR(Image img1, Image img2) ;
+
+/// Compute the mean structural similarity (SSIM) of img1 and img2.
+/// The SSIM of each pixel is computed over the (2r+1)x(2r+1) window
+/// centered on it (limited to the image, as in ImageBlur), with the usual
+/// constants (0.01 L)^2 and (0.03 L)^2, where L is the maxval of img1.
+/// The cost per pixel is constant, independent of r.
+/// Requires: img1 and img2 have the same size, r >= 0.
+/// On success, returns nonzero and sets *pssim to the mean SSIM (1 for
+/// equal images; 1 also for images with no pixels).
+/// (This involves allocation, and may fail.)
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageSSIM(Image img1, Image img2, int r, double* pssim) ;
+
+/// Temporal frame stacks
+
+// Type Stack is a pointer to frame stacks: running accumulators over a
+// sequence of frames of the same size (a video from a fixed camera, for
+// instance), with memory independent of the number of frames.
+typedef struct stack *Stack;
+
+// Accumulators kept by a stack (see StackCreate).
+#define STACK_SUM 1     // for StackMean
+#define STACK_MINMAX 2  // for StackMin and StackMax
+#define STACK_HIST 4    // for StackMedian
+
+/// Create a stack of frames of the given size.
+///   flags: which accumulators to keep, a combination (|) of
+///     STACK_SUM for StackMean (6 bytes per pixel),
+///     STACK_MINMAX for StackMin and StackMax (2 bytes per pixel),
+///     STACK_HIST for StackMedian (512 bytes per pixel!).
+/// Requires: width and height must be non-negative.
+///
+/// On success, a new stack is returned.
+/// (The caller is responsible for destroying the returned stack!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Stack StackCreate(int width, int height, int flags) ;
+
+/// Destroy the stack pointed to by (*sp).
+/// If (*sp)==NULL, no operation is performed.
+/// Ensures: (*sp)==NULL.
+void StackDestroy(Stack* sp) ;
+
+/// Add a frame to the stack.
+/// The frame may have any layout, or be a view.  It is not kept: only the
+/// accumulators are updated, which takes time proportional to its size.
+/// Requires: frame has the size of the stack.
+/// Ensures: frame is not modified.
+void StackAdd(Stack s, Image frame) ;
+
+/// Get the number of frames added to the stack.
+long StackCount(Stack s) ;
+
+/// Get the width of the frames of the stack.
+int StackWidth(Stack s) ;
+
+/// Get the height of the frames of the stack.
+int StackHeight(Stack s) ;
+
+/// Get the mean of the frames in the stack, rounded to nearest.
+/// After more than about 16 million frames the mean is approximate (see
+/// StackCreate).  The maxval of the result is the largest of the frames.
+/// Requires: s was created with STACK_SUM, and has some frames.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image StackMean(Stack s) ;
+
+/// Get the (lower) median of the frames in the stack.
+/// After 65535 frames the counters start being halved, and the median is
+/// approximate, favouring the more recent frames.
+/// The maxval of the result is the largest of the frames.
+/// Requires: s was created with STACK_HIST, and has some frames.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image StackMedian(Stack s) ;
+
+/// Get the minimum of the frames in the stack.
+/// Requires: s was created with STACK_MINMAX, and has some frames.
+/// On success, a new image is returned (see StackMean).
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image StackMin(Stack s) ;
+
+/// Get the maximum of the frames in the stack.
+/// Requires: s was created with STACK_MINMAX, and has some frames.
+/// On success, a new image is returned (see StackMean).
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image StackMax(Stack s) ;
+
+/// Subtract a background from an image (e.g., the median of a stack).
+/// Each pixel becomes |img(x,y) - bg(x,y)|, or 0 where that is <= thr:
+/// what remains is the foreground, the parts of img that differ from bg.
+/// This modifies img in-place, and only allocates memory if img shares
+/// its pixels with a clone.
+/// Requires: img and bg have the same size, thr >= 0.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageSubtractBackground(Image img, Image bg, int thr) ;
 
 #endif
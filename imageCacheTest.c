@@ -0,0 +1,116 @@
+// imageCacheTest - Check the derived data kept with images.
+//
+// This program edits an image through views, pastes, blurs and single
+// pixels, and after each edit compares what ImageHistogram, ImageIntegral
+// and ImageBlurred return (updated incrementally from the data kept with
+// the image) against the same data recomputed from scratch.
+// It exits with status 1 on the first mismatch.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "error.h"
+
+#include "image8bit.h"
+#include "instrumentation.h"
+
+// Blur window of the kept blurred image
+#define BDX 3
+#define BDY 2
+
+// Compare the kept data of img against a recomputation.
+// Exits on mismatch.
+static void check(Image img, const char* step) {
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+
+  // Histogram and integral image, from the pixels
+  uint64_t hist[256], count[256] = { 0 };
+  if (!ImageHistogram(img, hist)) error(2, errno, "%s: histogram: %s", step, ImageErrMsg());
+  const int64_t* sat = ImageIntegral(img);
+  if (sat == NULL) error(2, errno, "%s: integral: %s", step, ImageErrMsg());
+  int64_t* row = calloc((size_t)w + 1, sizeof(int64_t));  // sums of columns
+  if (row == NULL) error(2, errno, "%s: allocating", step);
+  for (int y = 0; y < h; y++) {
+    int64_t sum = 0;
+    for (int x = 0; x < w; x++) {
+      uint8 v = ImageGetPixel(img, x, y);
+      count[v]++;
+      row[x+1] += v;
+      sum += row[x+1];
+      if (sat[(size_t)(y+1) * (w+1) + x+1] != sum) {
+        error(1, 0, "%s: integral differs at (%d,%d)", step, x, y);
+      }
+    }
+  }
+  free(row);
+  if (memcmp(hist, count, sizeof(hist)) != 0) error(1, 0, "%s: histogram differs", step);
+
+  // Blurred image, against a blur of a copy
+  Image kept = ImageBlurred(img, BDX, BDY);
+  Image copy = ImageCrop(img, 0, 0, w, h);
+  if (kept == NULL || copy == NULL || !ImageBlur(copy, BDX, BDY)) {
+    error(2, errno, "%s: blurring: %s", step, ImageErrMsg());
+  }
+  if (!ImageEqual(kept, copy)) error(1, 0, "%s: blurred image differs", step);
+  ImageDestroy(&kept);
+  ImageDestroy(&copy);
+  printf("# %s: OK\n", step);
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  if (argc != 2) {
+    error(1, 0, "Usage: imageCacheTest input.pgm");
+  }
+
+  ImageInit();
+
+  Image img = ImageLoad(argv[1]);
+  if (img == NULL) {
+    error(2, errno, "Loading %s: %s", argv[1], ImageErrMsg());
+  }
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  if (w < 64 || h < 64) error(1, 0, "%s: image too small", argv[1]);
+  check(img, "load");
+
+  // Edit through a view
+  Image view = ImageView(img, w/4, h/4, w/3, h/3);
+  if (view == NULL || !ImageNegative(view)) error(2, errno, "View: %s", ImageErrMsg());
+  ImageDestroy(&view);
+  check(img, "view negative");
+
+  // Paste a piece of itself, partly over the edited region
+  Image piece = ImageCrop(img, 0, 0, w/5, h/5);
+  if (piece == NULL || !ImageThreshold(piece, 100) ||
+      !ImagePaste(img, w/3, h/3, piece)) {
+    error(2, errno, "Paste: %s", ImageErrMsg());
+  }
+  ImageDestroy(&piece);
+  check(img, "paste");
+
+  // Blur a region, through a view touching the bottom right corner
+  view = ImageView(img, w/2, h/2, w - w/2, h - h/2);
+  if (view == NULL || !ImageBlur(view, 5, 1)) error(2, errno, "Blur: %s", ImageErrMsg());
+  ImageDestroy(&view);
+  check(img, "view blur");
+
+  // Single pixels, at the corners and inside
+  ImageSetPixel(img, 0, 0, 255);
+  ImageSetPixel(img, w-1, h-1, 0);
+  ImageSetPixel(img, w-1, 0, 17);
+  ImageSetPixel(img, w/2, h/7, 200);
+  check(img, "set pixels");
+
+  // A whole image operation
+  if (!ImageMirrorInPlace(img)) error(2, errno, "Mirror: %s", ImageErrMsg());
+  check(img, "mirror");
+
+  ImageDestroy(&img);
+  return 0;
+}
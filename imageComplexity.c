@@ -0,0 +1,444 @@
+// imageComplexity - Empirical complexity analysis of image8bit operations.
+//
+// This program runs one operation of the image8bit module over a geometric
+// sweep of image sizes (and template or window sizes), records the
+// instrumentation counters and cpu time of each run, and fits the growth
+// exponent of every measure by least squares on a log-log scale.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <limits.h>
+#include "error.h"
+
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageComplexity [OPTION...] OP\n"
+    "  Run OP on NxN images for a geometric sweep of N (and of a size M),\n"
+    "  writing one CSV line per run to standard output and a summary table\n"
+    "  with the fitted growth exponents to standard error.\n"
+    "  Each measure is fitted as  measure ~ C * N^a * M^b  (b only if M\n"
+    "  varies and OP uses it).  Boundary terms, such as the N-M+1 positions\n"
+    "  of locate, bias the exponents when M is not small compared to N.\n"
+    "\n"
+    "OPERATIONS:\n"
+    "  locate          Locate an MxM template (M is the template side)\n"
+    "  neg, thr, bri   Negative, threshold 128, brighten by 1.1\n"
+    "  rotate, mirror  Rotate and mirror (creating new images)\n"
+    "  blur            Mean filter of radius M (with the method of -b)\n"
+    "  median          Median filter of radius M\n"
+    "  erode           Erosion of radius M\n"
+    "  label, dist     Connected components and distance transform (of random\n"
+    "                  images thresholded at 128)\n"
+    "\n"
+    "OPTIONS:\n"
+    "  -n MIN,MAX[,F]  Image sides N from MIN to MAX, times F (default 64,512,2)\n"
+    "  -m MIN,MAX[,F]  Sizes M from MIN to MAX, times F (default 4,16,2)\n"
+    "  -c CASE         Input case for locate: best, worst, random or all\n"
+    "                  (default all); other operations use random images\n"
+    "  -r REPS         Time each run REPS times and keep the fastest (default 3)\n"
+    "  -s SEED         Seed for the random images (default 1)\n"
+    "  -x EXP          Fail (exit status 1) if a counter grows faster than N^EXP\n"
+    "  -b METHOD       Method for blur: direct, sat, running or auto (default\n"
+    "                  sat; auto may change methods within a sweep, and mix\n"
+    "                  their growth)\n"
+    "\n"
+    "CASES (locate):\n"
+    "  best            Template found at the first position tried\n"
+    "  worst           Template never found, and every position is compared\n"
+    "                  up to its last pixel (zero image, template with one 1)\n"
+    "  random          Random image, template cropped at a random position\n"
+    "\n"
+    "EXAMPLES:\n"
+    "  imageComplexity -c worst locate > locate.csv\n"
+    "  imageComplexity -n 128,2048 -m 1,1 -x 2.2 blur\n"
+    "  imageComplexity -b running -m 1,64 blur\n";
+
+// Fixed test parameters
+#define THRESHOLD 128
+#define FACTOR 1.1
+
+// A sweep of sizes
+#define SWEEPMAX 32
+typedef struct {
+  int n;
+  int v[SWEEPMAX];
+} Sweep;
+
+// An operation under test.
+// run applies it to img (with template tmpl, and size m) and returns
+// nonzero on success.
+typedef struct {
+  const char* name;
+  int usesM;      // whether M is a size for this operation
+  int hasCases;   // whether best/worst/random cases differ
+  int binary;     // whether random images are thresholded first
+  int (*run)(Image img, Image tmpl, int m);
+} Op;
+
+static int runLocate(Image img, Image tmpl, int m) {
+  int x, y;
+  ImageLocateSubImage(img, &x, &y, tmpl);  // found or not, both are fine
+  return 1;
+}
+
+static int runNeg(Image img, Image tmpl, int m) {
+  return ImageNegative(img);
+}
+
+static int runThr(Image img, Image tmpl, int m) {
+  return ImageThreshold(img, THRESHOLD);
+}
+
+static int runBri(Image img, Image tmpl, int m) {
+  return ImageBrighten(img, FACTOR);
+}
+
+static int runRotate(Image img, Image tmpl, int m) {
+  Image res = ImageRotate(img);
+  ImageDestroy(&res);
+  return 1;
+}
+
+static int runMirror(Image img, Image tmpl, int m) {
+  Image res = ImageMirror(img);
+  ImageDestroy(&res);
+  return 1;
+}
+
+static int runBlur(Image img, Image tmpl, int m) {
+  return ImageBlur(img, m, m);
+}
+
+static int runMedian(Image img, Image tmpl, int m) {
+  return ImageMedian(img, m, m);
+}
+
+static int runErode(Image img, Image tmpl, int m) {
+  return ImageErode(img, m, m);
+}
+
+static int runLabel(Image img, Image tmpl, int m) {
+  int n;
+  Component* stats;
+  if (!ImageLabel(img, &n, NULL, &stats)) return 0;
+  free(stats);
+  return 1;
+}
+
+static int runDist(Image img, Image tmpl, int m) {
+  float* dist = ImageDistanceTransform(img);
+  free(dist);
+  return dist != NULL;
+}
+
+static const Op ops[] = {
+  { "locate", 1, 1, 0, runLocate },
+  { "neg",    0, 0, 0, runNeg },
+  { "thr",    0, 0, 0, runThr },
+  { "bri",    0, 0, 0, runBri },
+  { "rotate", 0, 0, 0, runRotate },
+  { "mirror", 0, 0, 0, runMirror },
+  { "blur",   1, 0, 0, runBlur },
+  { "median", 1, 0, 0, runMedian },
+  { "erode",  1, 0, 0, runErode },
+  { "label",  0, 0, 1, runLabel },
+  { "dist",   0, 0, 1, runDist },
+};
+#define NUMOPS (int)(sizeof(ops) / sizeof(ops[0]))
+
+enum { BEST, WORST, RANDOM, NUMCASES };
+static const char* caseName[NUMCASES] = { "best", "worst", "random" };
+
+// Parse "MIN,MAX[,F]" into a geometric sweep.
+// Returns 0 if invalid.
+static int parseSweep(const char* s, Sweep* sw) {
+  int min, max;
+  double f = 2.0;
+  int k = sscanf(s, "%d,%d,%lf", &min, &max, &f);
+  if (k < 2 || min < 1 || max < min || !(f > 1.0)) return 0;
+  sw->n = 0;
+  for (int v = min; v <= max; ) {
+    if (sw->n >= SWEEPMAX) return 0;
+    sw->v[sw->n++] = v;
+    if (v * f > INT_MAX) break;
+    int next = (int)ceil(v * f);
+    v = (next > v) ? next : v + 1;
+  }
+  return 1;
+}
+
+// A small deterministic generator, so that runs are reproducible anywhere.
+static unsigned rngState = 1;
+
+static unsigned rng(void) {
+  unsigned x = rngState;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return rngState = x;
+}
+
+// Create an n x n image of random levels.
+static Image randomImage(int n) {
+  Image img = ImageCreate(n, n, PixMax);
+  if (img == NULL) return NULL;
+  for (int y = 0; y < n; y++) {
+    for (int x = 0; x < n; x++) {
+      ImageSetPixel(img, x, y, (uint8)(rng() >> 8));
+    }
+  }
+  return img;
+}
+
+// Create the image and template for a run of case c.
+// Returns 0 on failure (with nothing left allocated).
+static int makeInput(int c, int n, int m, int needTmpl, Image* pimg, Image* ptmpl) {
+  Image img, tmpl = NULL;
+  if (needTmpl && c == WORST) {
+    // All positions match but for the last pixel of the template.
+    img = ImageCreate(n, n, PixMax);
+    tmpl = ImageCreate(m, m, PixMax);
+    if (tmpl != NULL) ImageSetPixel(tmpl, m-1, m-1, 1);
+  } else {
+    img = randomImage(n);
+    if (needTmpl && img != NULL) {
+      int x = (c == BEST) ? 0 : (int)(rng() % (unsigned)(n - m + 1));
+      int y = (c == BEST) ? 0 : (int)(rng() % (unsigned)(n - m + 1));
+      tmpl = ImageCrop(img, x, y, m, m);
+    }
+  }
+  if (img == NULL || (needTmpl && tmpl == NULL)) {
+    ImageDestroy(&img);
+    ImageDestroy(&tmpl);
+    return 0;
+  }
+  *pimg = img;
+  *ptmpl = tmpl;
+  return 1;
+}
+
+// Measures of each run: the counters, then time.
+#define NUMMEASURES (NUMCOUNTERS + 1)
+#define TIME NUMCOUNTERS
+
+// Results of all runs of one case
+#define RUNMAX (SWEEPMAX * SWEEPMAX)
+typedef struct {
+  int runs;
+  int n[RUNMAX], m[RUNMAX];
+  double measure[RUNMAX][NUMMEASURES];
+} Results;
+
+// Fit log(y) = c + a*log(n) [+ b*log(m)] by least squares over the runs
+// with y > 0.  useM selects the second regressor.
+// Returns the number of points used (a fit needs at least 2, or 3 with m),
+// and sets *pa, *pb and *pr2 (coefficient of determination).
+static int fit(const Results* r, int k, int useM, double* pa, double* pb, double* pr2) {
+  double sx = 0, sz = 0, sy = 0;
+  int p = 0;
+  for (int i = 0; i < r->runs; i++) {
+    if (r->measure[i][k] <= 0.0) continue;
+    sx += log(r->n[i]);
+    sz += useM ? log(r->m[i]) : 0.0;
+    sy += log(r->measure[i][k]);
+    p++;
+  }
+  if (p < 2 + useM) return 0;
+  double mx = sx / p, mz = sz / p, my = sy / p;
+  double sxx = 0, szz = 0, sxz = 0, sxy = 0, szy = 0, syy = 0;
+  for (int i = 0; i < r->runs; i++) {
+    if (r->measure[i][k] <= 0.0) continue;
+    double x = log(r->n[i]) - mx;
+    double z = (useM ? log(r->m[i]) : 0.0) - mz;
+    double y = log(r->measure[i][k]) - my;
+    sxx += x*x; szz += z*z; sxz += x*z;
+    sxy += x*y; szy += z*y; syy += y*y;
+  }
+  double a, b = 0.0;
+  if (useM) {
+    double det = sxx*szz - sxz*sxz;
+    if (fabs(det) < 1e-12) return 0;
+    a = (sxy*szz - szy*sxz) / det;
+    b = (szy*sxx - sxy*sxz) / det;
+  } else {
+    if (sxx < 1e-12) return 0;
+    a = sxy / sxx;
+  }
+  double sse = syy - a*sxy - b*szy;   // residual sum of squares
+  *pa = a;
+  *pb = b;
+  *pr2 = (syy > 1e-12) ? 1.0 - sse / syy : 1.0;
+  return p;
+}
+
+// Print the summary table of one case to stderr.
+// Returns the largest exponent of N fitted for a counter (or -INFINITY).
+static double summary(const Op* op, const char* cs, const Results* r, int useM) {
+  double worst = -INFINITY;
+  fprintf(stderr, "# %s, case %s, %d runs: measure ~ N^a%s\n",
+          op->name, cs, r->runs, useM ? " * M^b" : "");
+  fprintf(stderr, "#%15s\t%8s\t%8s\t%8s\n", "measure", "a", useM ? "b" : "", "R2");
+  for (int k = 0; k < NUMMEASURES; k++) {
+    const char* name = (k == TIME) ? "time" : InstrName[k];
+    if (name == NULL) continue;
+    double a, b, r2;
+    if (fit(r, k, useM, &a, &b, &r2) == 0) {
+      fprintf(stderr, "%16s\t%8s\n", name, "-");
+      continue;
+    }
+    if (useM) {
+      fprintf(stderr, "%16s\t%8.3f\t%8.3f\t%8.4f\n", name, a, b, r2);
+    } else {
+      fprintf(stderr, "%16s\t%8.3f\t%8s\t%8.4f\n", name, a, "", r2);
+    }
+    if (k != TIME && a > worst) worst = a;
+  }
+  return worst;
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+
+  Sweep ns, ms;
+  parseSweep("64,512,2", &ns);
+  parseSweep("4,16,2", &ms);
+  const char* cs = "all";
+  int reps = 3;
+  double maxExp = INFINITY;
+  BlurMethod method = BLUR_SAT;
+  const Op* op = NULL;
+
+  for (int k = 1; k < ac; k++) {
+    const char* arg = (k + 1 < ac) ? av[k+1] : NULL;
+    if (strcmp(av[k], "-n") == 0) {
+      if (arg == NULL || !parseSweep(arg, &ns)) error(1, 0, "Invalid sweep: -n %s", arg ? arg : "");
+      k++;
+    } else if (strcmp(av[k], "-m") == 0) {
+      if (arg == NULL || !parseSweep(arg, &ms)) error(1, 0, "Invalid sweep: -m %s", arg ? arg : "");
+      k++;
+    } else if (strcmp(av[k], "-c") == 0) {
+      if (arg == NULL) error(1, 0, "Missing case");
+      cs = av[++k];
+    } else if (strcmp(av[k], "-r") == 0) {
+      if (arg == NULL || sscanf(arg, "%d", &reps) != 1 || reps < 1) error(1, 0, "Invalid repetitions");
+      k++;
+    } else if (strcmp(av[k], "-s") == 0) {
+      if (arg == NULL || sscanf(arg, "%u", &rngState) != 1 || rngState == 0) error(1, 0, "Invalid seed");
+      k++;
+    } else if (strcmp(av[k], "-x") == 0) {
+      if (arg == NULL || sscanf(arg, "%lf", &maxExp) != 1) error(1, 0, "Invalid exponent");
+      k++;
+    } else if (strcmp(av[k], "-b") == 0) {
+      static const char* methods[] = { "auto", "direct", "sat", "running" };
+      int i = 0;
+      while (arg != NULL && i < 4 && strcmp(arg, methods[i]) != 0) i++;
+      if (arg == NULL || i == 4) error(1, 0, "Invalid blur method: %s", arg ? arg : "");
+      method = (BlurMethod)i;
+      k++;
+    } else if (op == NULL) {
+      for (int i = 0; i < NUMOPS; i++) {
+        if (strcmp(av[k], ops[i].name) == 0) op = &ops[i];
+      }
+      if (op == NULL) error(1, 0, "Unknown operation: %s\n%s", av[k], USAGE);
+    } else {
+      error(1, 0, "Unexpected argument: %s\n%s", av[k], USAGE);
+    }
+  }
+  if (op == NULL) error(1, 0, "\n%s", USAGE);
+
+  int first = 0, last = NUMCASES - 1;  // cases to run
+  if (!op->hasCases) {
+    first = last = RANDOM;
+  } else if (strcmp(cs, "all") != 0) {
+    for (first = 0; first < NUMCASES && strcmp(cs, caseName[first]) != 0; first++) {}
+    if (first == NUMCASES) error(1, 0, "Unknown case: %s", cs);
+    last = first;
+  }
+  if (!op->usesM) {  // a single, unused size
+    ms.n = 1;
+    ms.v[0] = 0;
+  }
+  int useM = op->usesM && ms.n > 1;
+
+  ImageInit();
+  ImageSetBlurMethod(method);
+
+  // CSV header
+  printf("op,case,N,M,reps");
+  for (int k = 0; k < NUMCOUNTERS; k++) {
+    if (InstrName[k] != NULL) printf(",%s", InstrName[k]);
+  }
+  printf(",time,caltime\n");
+
+  Results* r = malloc(sizeof(*r));
+  if (r == NULL) error(2, errno, "Allocating results");
+
+  int failed = 0;
+  for (int c = first; c <= last; c++) {
+    r->runs = 0;
+    for (int i = 0; i < ns.n; i++) {
+      for (int j = 0; j < ms.n; j++) {
+        int n = ns.v[i], m = ms.v[j];
+        if (op->hasCases && m > n) continue;  // template must fit
+        Image img, tmpl;
+        if (!makeInput(c, n, m, op->hasCases, &img, &tmpl) ||
+            (op->binary && !ImageThreshold(img, THRESHOLD))) {
+          error(2, errno, "Creating %dx%d input: %s", n, n, ImageErrMsg());
+        }
+        // Each repetition runs on its own copy of the input (the in-place
+        // ops change it), made before the measurement: a clone would share
+        // the pixels and copy them inside the op, on the first change.
+        // Counts are the same in every repetition: time is the fastest.
+        unsigned long total[NUMCOUNTERS];
+        double best = INFINITY;
+        for (int rep = 0; rep < reps; rep++) {
+          Image work = ImageCrop(img, 0, 0, n, n);
+          if (work == NULL) {
+            error(2, errno, "Copying %dx%d input: %s", n, n, ImageErrMsg());
+          }
+          InstrReset();
+          double t0 = cpu_time();
+          if (!op->run(work, tmpl, m)) {
+            error(2, errno, "%s on %dx%d: %s", op->name, n, n, ImageErrMsg());
+          }
+          double t = cpu_time() - t0;
+          if (t < best) best = t;
+          InstrTotal(total);
+          ImageDestroy(&work);
+        }
+        ImageDestroy(&img);
+        ImageDestroy(&tmpl);
+
+        int run = r->runs++;
+        r->n[run] = n;
+        r->m[run] = m;
+        for (int k = 0; k < NUMCOUNTERS; k++) r->measure[run][k] = (double)total[k];
+        r->measure[run][TIME] = best;
+
+        printf("%s,%s,%d,%d,%d", op->name, caseName[c], n, m, reps);
+        for (int k = 0; k < NUMCOUNTERS; k++) {
+          if (InstrName[k] != NULL) printf(",%lu", total[k]);
+        }
+        printf(",%.9f,%.3f\n", best, best / InstrCTU);
+        fflush(stdout);
+      }
+    }
+    double a = summary(op, caseName[c], r, useM);
+    if (a > maxExp) {
+      fprintf(stderr, "# REGRESSION: %s (%s) grows as N^%.3f > N^%g\n",
+              op->name, caseName[c], a, maxExp);
+      failed = 1;
+    }
+  }
+
+  free(r);
+  return failed;
+}
@@ -0,0 +1,147 @@
+// imageThreadTest - Check that the image8bit module may be used by
+// several threads at once.
+//
+// This program runs the same work (copy, blur, negative, clone, view) on
+// one image in many threads at the same time, and checks that:
+//   every thread gets the results of a single-threaded run;
+//   the error state is per thread: a failure in one thread is still
+//   reported there after other threads succeed;
+//   the instrumentation totals are the sum of the counts of all threads.
+// It exits with status 1 on the first mismatch.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "error.h"
+
+#include "image8bit.h"
+#include "instrumentation.h"
+
+// Number of threads
+#define NTHREADS 8
+
+// A file that does not exist
+#define MISSING "/nonexistent/imageThreadTest.pgm"
+
+static Image input;              // shared, only read
+static Image refCopy, refClone;  // results of the single-threaded run
+static pthread_barrier_t barrier;
+
+// Do the pixels of img1 and img2 match?
+static int samePixels(Image img1, Image img2) {
+  if (ImageWidth(img1) != ImageWidth(img2) || ImageHeight(img1) != ImageHeight(img2)) return 0;
+  for (int y = 0; y < ImageHeight(img1); y++) {
+    for (int x = 0; x < ImageWidth(img1); x++) {
+      if (ImageGetPixel(img1, x, y) != ImageGetPixel(img2, x, y)) return 0;
+    }
+  }
+  return 1;
+}
+
+// The work of each thread.  Sets *pcopy and *pclone to its results.
+// Returns 0 on failure.
+static int work(Image* pcopy, Image* pclone) {
+  int w = ImageWidth(input);
+  int h = ImageHeight(input);
+  Image copy = ImageCrop(input, 0, 0, w, h);
+  if (copy == NULL || !ImageBlur(copy, 3, 2) || !ImageNegative(copy)) return 0;
+  Image clone = ImageClone(copy);  // shares the pixels until changed
+  if (clone == NULL || !ImageThreshold(clone, 100)) return 0;
+  Image view = ImageView(copy, w/4, h/4, w/2, h/2);
+  if (view == NULL || !ImageBlur(view, 1, 1)) return 0;
+  ImageDestroy(&view);
+  *pcopy = copy;
+  *pclone = clone;
+  return 1;
+}
+
+// Thread body: arg is the thread number.  Returns NULL, or an error message.
+static void* run(void* arg) {
+  long i = (long)arg;
+  const char* msg = NULL;
+  // Odd threads fail first, and must still see their failure after the
+  // even threads succeed.
+  Image bad = NULL;
+  if (i % 2 == 1) bad = ImageLoad(MISSING);
+  const char* cause = ImageErrMsg();
+  pthread_barrier_wait(&barrier);
+  Image copy = NULL, clone = NULL;
+  if (i % 2 == 0 && !work(&copy, &clone)) msg = "work failed";
+  pthread_barrier_wait(&barrier);
+  if (i % 2 == 1) {
+    if (bad != NULL || cause[0] == '\0' || strcmp(ImageErrMsg(), cause) != 0) {
+      msg = "error state changed by another thread";
+    } else if (!work(&copy, &clone)) {
+      msg = "work failed";
+    }
+  }
+  InstrFlush();  // (before the comparisons, which count too)
+  if (msg == NULL && (!samePixels(copy, refCopy) || !samePixels(clone, refClone))) {
+    msg = "results differ";
+  }
+  ImageDestroy(&copy);
+  ImageDestroy(&clone);
+  return (void*)msg;
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  if (argc != 2) {
+    error(1, 0, "Usage: imageThreadTest input.pgm");
+  }
+
+  ImageInit();
+
+  input = ImageLoad(argv[1]);
+  if (input == NULL) {
+    error(2, errno, "Loading %s: %s", argv[1], ImageErrMsg());
+  }
+
+  // Single-threaded run (after a first one, that may set up caches)
+  if (!work(&refCopy, &refClone)) error(2, errno, "Work: %s", ImageErrMsg());
+  ImageDestroy(&refCopy);
+  ImageDestroy(&refClone);
+  unsigned long ref[NUMCOUNTERS];
+  InstrReset();
+  if (!work(&refCopy, &refClone)) error(2, errno, "Work: %s", ImageErrMsg());
+  InstrTotal(ref);
+
+  // The same, in NTHREADS threads at once
+  unsigned long total[NUMCOUNTERS];
+  pthread_t tid[NTHREADS];
+  pthread_barrier_init(&barrier, NULL, NTHREADS);
+  InstrReset();
+  for (long i = 0; i < NTHREADS; i++) {
+    if (pthread_create(&tid[i], NULL, run, (void*)i) != 0) error(2, errno, "Starting thread");
+  }
+  int failed = 0;
+  for (int i = 0; i < NTHREADS; i++) {
+    void* msg;
+    pthread_join(tid[i], &msg);
+    if (msg != NULL) {
+      fprintf(stderr, "# thread %d: %s\n", i, (const char*)msg);
+      failed = 1;
+    }
+  }
+  pthread_barrier_destroy(&barrier);
+  InstrTotal(total);
+  for (int k = 0; k < NUMCOUNTERS; k++) {
+    if (InstrName[k] != NULL && total[k] != NTHREADS * ref[k]) {
+      fprintf(stderr, "# %s: %lu in %d threads, expected %d x %lu\n",
+              InstrName[k], total[k], NTHREADS, NTHREADS, ref[k]);
+      failed = 1;
+    }
+  }
+  if (failed) error(1, 0, "FAILED");
+  printf("# %d threads: OK\n", NTHREADS);
+
+  ImageDestroy(&refCopy);
+  ImageDestroy(&refClone);
+  ImageDestroy(&input);
+  return 0;
+}
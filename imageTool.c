@@ -12,9 +12,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "error.h"
 #include <assert.h>
+#include <math.h>
 
 #include "image8bit.h"
 #include "instrumentation.h"
@@ -31,37 +35,113 @@ static const char* USAGE =
     "  Most operations apply to CURR and some also use PRED.\n"
     "\n"
     "FILES:\n"
-    "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
+    "  Image files in 8-bit raw PGM format or in tiled container format\n"
+    "  are accepted.  Tiled files are only read when needed, and crop on\n"
+    "  a tiled file reads just the tiles covering the rectangle.\n"
     "  Input file names must be distinct from operation names.\n"
     "\n"
+    "STREAMS:\n"
+    "  A FILE named - reads the next image (frame) from a sequence of PGM\n"
+    "  images on standard input, and the whole pipeline is then applied to\n"
+    "  each frame in turn, until the input ends.  Likewise, save - appends\n"
+    "  CURR to a sequence of PGM images on standard output; in that case,\n"
+    "  text output (info, locate, toc) goes to standard error.\n"
+    "  Frames are read ahead and written behind while others are processed.\n"
+    "\n"
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
     "  save FILE       Save CURR to PGM file\n"
+    "  tsave FILE      Save CURR to tiled container file\n"
     "  info            Show information on CURR (size and range)\n"
+    "  layout MODE     Store CURR pixels in MODE layout (raster or tiled)\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "  threads N       Use N threads in the following operations (0: use\n"
+    "                  IMAGE8BIT_THREADS from the environment, or else one\n"
+    "                  per processor, the default); results do not change\n"
+    "  budget MB       Keep at most MB megabytes of pixels in memory (0: no\n"
+    "                  limit; the default is IMAGETOOL_BUDGET from the\n"
+    "                  environment, or no limit).  Images not used by the next\n"
+    "                  operation are spilled to temporary files (in TMPDIR),\n"
+    "                  least recently used first, and loaded back when used\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
+    "  clone           Clone CURR, creating new image that shares its pixels\n"
+    "                  until either is modified (a cheap snapshot)\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
+    "                  (rotate, mirror and turn by multiples of 90º reuse the\n"
+    "                  memory of CURR when it is not used afterwards)\n"
+    "  turn DEG[,INTERP[,LEVEL]]  Rotate CURR DEG degrees counter-clockwise,\n"
+    "                  creating new image; uncovered pixels get LEVEL (0)\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  view X,Y,W,H    Create a view of a rectangle of CURR, without copying:\n"
+    "                  changes to the view also change the viewed image\n"
+    "  resize W,H[,INTERP]  Resize CURR to WxH, creating new image\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
+    "  composite X,Y[,X,Y...]  Composite K layers into CURR in one pass, one\n"
+    "                  per position (X,Y), the last on top; the 2K images before\n"
+    "                  CURR are the alpha MASK and LAYER of each, in order:\n"
+    "                  MASK1 LAYER1 ... MASKK LAYERK CURR\n"
     "\n"              
-    "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  locate [OPTS]   Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "                  OPTS (comma-separated) allow approximate matches:\n"
+    "                    tol=K   each pixel may differ by up to K levels\n"
+    "                    sad=B   the sum of absolute differences is at most B\n"
+    "                    mask    ignore pixels of PRED where the image\n"
+    "                            before it (same size) is 0\n"
+    "  equal           Compare PRED and CURR, print EQUAL or DIFFERENT\n"
+    "  diff            Absolute difference of PRED and CURR, creating new image\n"
+    "  psnr            Print the PSNR of CURR relative to PRED (in dB)\n"
+    "  ssim R          Print the mean SSIM of PRED and CURR, using\n"
+    "                  (2R+1)x(2R+1) windows\n"
     "\n"              
-    "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  blur DX,DY[,METHOD]  blur CURR using (2DX+1)x(2Dy+1) mean filter, with\n"
+    "                  METHOD direct, sat or running (default: the fastest\n"
+    "                  for the window and image size); results do not change\n"
+    "  median DX,DY    Filter CURR using (2DX+1)x(2DY+1) median filter\n"
+    "  gauss SIGMA     Smooth CURR with a Gaussian filter\n"
+    "  conv KX/KY      Convolve CURR with separable kernel KX (horizontal)\n"
+    "                  and KY (vertical)\n"
+    "\n"
+    "  erode DX,DY     Erode CURR with a (2DX+1)x(2DY+1) rectangle\n"
+    "  dilate DX,DY    Dilate CURR with a (2DX+1)x(2DY+1) rectangle\n"
+    "  open DX,DY      Open CURR (erode, then dilate)\n"
+    "  close DX,DY     Close CURR (dilate, then erode)\n"
+    "\n"
+    "  label           Label 8-connected components of nonzero pixels of CURR,\n"
+    "                  print their number, and the area and bounding box of each\n"
+    "  dist SCALE      Replace each pixel of CURR by its Euclidean distance to\n"
+    "                  the nearest nonzero pixel, times SCALE (saturated)\n"
+    "\n"
+    "  stack           Add CURR to the frame stack, which is created with the\n"
+    "                  size of CURR and kept across the frames of a stream\n"
+    "  tmean           Mean of the frames in the stack, creating new image\n"
+    "  tmedian         Median of the frames in the stack, creating new image\n"
+    "  tmin            Minimum of the frames in the stack, creating new image\n"
+    "  tmax            Maximum of the frames in the stack, creating new image\n"
+    "  bgsub T         Subtract the median of the stack (the background) from\n"
+    "                  CURR: pixels differing by at most T levels become 0\n"
+    "                  (memory is kept per pixel, not per frame, but tmedian\n"
+    "                  and bgsub need 512 bytes per pixel)\n"
     "\n"              
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
+    "                  (layers may be partly outside CURR)\n"
     "  DX,DY           Displacement\n"
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
+    "  SIGMA           Standard deviation (in pixels)\n"
+    "  KX, KY          Odd number of comma-separated weights, e.g. 1,2,1\n"
+    "  MODE            Pixel memory layout: raster (row-major) or tiled (64x64)\n"
+    "  INTERP          Interpolation: nearest, bilinear or area\n"
+    "                  (default: area for resize, bilinear for turn)\n"
     "\n"
     ;
 
@@ -77,6 +157,348 @@ static char* errors[] = {
 };
 
 
+// Tile size used when saving tiled container files.
+#define TILE 256
+
+// Capacity of the image buffer.
+#define NBUF 10
+
+// Memory budget.
+// When the pixels of the images in the buffer exceed the budget, the least
+// recently used ones that the next operation does not need are spilled:
+// saved to temporary tiled files and destroyed.  A spilled image is then
+// deferred like a tiled file given as argument, and loaded back (and its
+// file removed) by materialize when needed.
+// Images with views, and views, are never spilled.  Clones are counted
+// separately, although they may share pixels.
+
+typedef struct {
+  size_t budget;              // bytes of pixels (0: no limit)
+  unsigned long tick;         // operations run
+  unsigned long used[NBUF];   // tick of the last use of each slot
+  char* file[NBUF];           // spill file of each slot, or NULL
+  unsigned long spills, restores;
+  size_t spilled, restored;   // bytes of pixels
+} Spill;
+
+static Spill spill;
+
+// Remove the spill file of slot i, if any.
+static void dropSpill(int i) {
+  if (spill.file[i] == NULL) return;
+  unlink(spill.file[i]);
+  free(spill.file[i]);
+  spill.file[i] = NULL;
+}
+
+// Load the tiled file deferred in slot i, if any.
+// Returns 0 on failure.
+static int materialize(Image img[], const char* lazy[], int i) {
+  int w, h;
+  if (i < 0 || lazy[i] == NULL) return 1;
+  int spilled = (lazy[i] == spill.file[i]);
+  fprintf(stderr, "%s %s -> I%d\n", spilled ? "Restoring" : "Loading", lazy[i], i);
+  if (!ImageProbeTiled(lazy[i], &w, &h)) return 0;
+  img[i] = ImageLoadRegion(lazy[i], 0, 0, w, h);
+  if (img[i] == NULL) return 0;
+  lazy[i] = NULL;
+  if (spilled) {
+    dropSpill(i);
+    spill.restores++;
+    spill.restored += (size_t)w * h;
+  }
+  return 1;
+}
+
+// Spill images of img[0..n-1] until their pixels fit in the budget,
+// except the last keep ones.  Views, images with views and images that
+// share their pixels with clones are not spilled: that would free nothing.
+// Returns NULL, or the error cause on failure.
+static const char* spillImages(Image img[], const char* lazy[], int n, int keep) {
+  size_t total = 0;
+  for (int i = 0; i < n; i++) {
+    if (img[i] != NULL && !ImageIsView(img[i])) {
+      total += (size_t)ImageWidth(img[i]) * ImageHeight(img[i]);
+    }
+  }
+  while (total > spill.budget) {
+    int lru = -1;
+    for (int i = 0; i < n - keep; i++) {
+      if (img[i] == NULL || ImageIsView(img[i]) || ImageHasViews(img[i]) ||
+          ImageSharesPixels(img[i])) continue;
+      if (lru < 0 || spill.used[i] < spill.used[lru]) lru = i;
+    }
+    if (lru < 0) return NULL;  // nothing left to spill: go over budget
+    const char* dir = getenv("TMPDIR");
+    if (dir == NULL || *dir == '\0') dir = "/tmp";
+    char* name = malloc(strlen(dir) + sizeof("/imageTool-XXXXXX"));
+    if (name == NULL) return "Allocating spill file name failed";
+    sprintf(name, "%s/imageTool-XXXXXX", dir);
+    int fd = mkstemp(name);
+    if (fd < 0) { free(name); return "Creating spill file failed"; }
+    close(fd);
+    spill.file[lru] = name;
+    size_t bytes = (size_t)ImageWidth(img[lru]) * ImageHeight(img[lru]);
+    fprintf(stderr, "Spilling I%d -> %s\n", lru, name);
+    if (!ImageSaveTiled(img[lru], name, TILE)) {
+      int errsave = errno;
+      dropSpill(lru);
+      errno = errsave;
+      return ImageErrMsg();
+    }
+    ImageDestroy(&img[lru]);
+    lazy[lru] = name;
+    spill.spills++;
+    spill.spilled += bytes;
+    total -= bytes;
+  }
+  return NULL;
+}
+
+// Frame streams.
+// Frames read from stdin are queued by a reader thread, and frames saved to
+// stdout are queued for a writer thread, so that I/O overlaps processing.
+
+// Capacity of each frame queue.
+#define QCAP 2
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  Image item[QCAP];
+  int head;             // index of first item
+  int count;            // number of items queued
+  int closed;           // set when no more items will be pushed
+  const char* errMsg;   // error cause in the helper thread, or NULL
+} Queue;
+
+static void queueInit(Queue* q) {
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->changed, NULL);
+  q->head = q->count = q->closed = 0;
+  q->errMsg = NULL;
+}
+
+// Append img to the queue, waiting while it is full.
+// Returns 0 (and does not take img) if the queue is closed.
+static int queuePush(Queue* q, Image img) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == QCAP && !q->closed) {
+    pthread_cond_wait(&q->changed, &q->lock);
+  }
+  int ok = !q->closed;
+  if (ok) {
+    q->item[(q->head + q->count) % QCAP] = img;
+    q->count++;
+    pthread_cond_broadcast(&q->changed);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return ok;
+}
+
+// Remove the first image from the queue, waiting while it is empty.
+// Returns NULL if the queue is empty and closed.
+static Image queuePop(Queue* q) {
+  Image img = NULL;
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0 && !q->closed) {
+    pthread_cond_wait(&q->changed, &q->lock);
+  }
+  if (q->count > 0) {
+    img = q->item[q->head];
+    q->head = (q->head + 1) % QCAP;
+    q->count--;
+    pthread_cond_broadcast(&q->changed);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return img;
+}
+
+// Close the queue, recording errMsg (if not NULL).
+static void queueClose(Queue* q, const char* errMsg) {
+  pthread_mutex_lock(&q->lock);
+  if (errMsg != NULL) q->errMsg = errMsg;
+  q->closed = 1;
+  pthread_cond_broadcast(&q->changed);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// Stream where frames are written (the original standard output).
+static FILE* frameOut;
+
+// Reader thread: queue frames from stdin until it ends.
+static void* readFrames(void* arg) {
+  Queue* q = (Queue*)arg;
+  const char* errMsg = NULL;
+  for (;;) {
+    int c;
+    while ((c = getc(stdin)) != EOF && isspace(c)) { }  // end of input?
+    if (c == EOF) break;
+    ungetc(c, stdin);
+    Image img = ImageRead(stdin);
+    if (img == NULL) { errMsg = ImageErrMsg(); break; }
+    if (!queuePush(q, img)) { ImageDestroy(&img); break; }
+  }
+  queueClose(q, errMsg);
+  return NULL;
+}
+
+// Writer thread: write queued frames to frameOut until the queue is closed.
+// After a failure, remaining frames are just discarded.
+static void* writeFrames(void* arg) {
+  Queue* q = (Queue*)arg;
+  Image img;
+  while ((img = queuePop(q)) != NULL) {
+    if (q->errMsg == NULL) {
+      if (!ImageWrite(img, frameOut)) q->errMsg = ImageErrMsg();
+      else if (fflush(frameOut) != 0) q->errMsg = "Writing frame failed";
+    }
+    ImageDestroy(&img);
+  }
+  return NULL;
+}
+
+// How the operations use the image buffer.
+// Arguments that are not operations are image files (or -), which append
+// an image.
+typedef struct {
+  const char* name;
+  int operand;    // takes an operand?
+  int below;      // images below CURR it reads (PRED is 1)
+  int creates;    // appends an image?
+} OpInfo;
+
+static const OpInfo opInfo[] = {
+  { "save", 1, 0, 0 }, { "tsave", 1, 0, 0 }, { "info", 0, 0, 0 },
+  { "layout", 1, 0, 0 }, { "tic", 0, 0, 0 }, { "toc", 0, 0, 0 },
+  { "threads", 1, 0, 0 }, { "budget", 1, 0, 0 },
+  { "neg", 0, 0, 0 }, { "thr", 1, 0, 0 }, { "bri", 1, 0, 0 },
+  { "create", 1, 0, 1 }, { "clone", 0, 0, 1 }, { "rotate", 0, 0, 1 },
+  { "turn", 1, 0, 1 }, { "mirror", 0, 0, 1 }, { "crop", 1, 0, 1 },
+  { "view", 1, 0, 1 }, { "resize", 1, 0, 1 },
+  { "paste", 1, 1, 0 }, { "blend", 1, 1, 0 }, { "composite", 1, 1, 0 },
+  { "locate", 0, 1, 0 }, { "equal", 0, 1, 0 }, { "diff", 0, 1, 1 },
+  { "psnr", 0, 1, 0 }, { "ssim", 1, 1, 0 },
+  { "blur", 1, 0, 0 }, { "median", 1, 0, 0 }, { "gauss", 1, 0, 0 },
+  { "conv", 1, 0, 0 }, { "erode", 1, 0, 0 }, { "dilate", 1, 0, 0 },
+  { "open", 1, 0, 0 }, { "close", 1, 0, 0 },
+  { "label", 0, 0, 0 }, { "dist", 1, 0, 0 },
+  { "stack", 0, 0, 0 }, { "tmean", 0, 0, 1 }, { "tmedian", 0, 0, 1 },
+  { "tmin", 0, 0, 1 }, { "tmax", 0, 0, 1 }, { "bgsub", 1, 0, 0 },
+  { NULL, 0, 0, 0 }
+};
+
+// Find operation name, or return NULL (an image file).
+static const OpInfo* findOp(const char* name) {
+  for (const OpInfo* op = opInfo; op->name != NULL; op++) {
+    if (strcmp(name, op->name) == 0) return op;
+  }
+  return NULL;
+}
+
+// Parse the options of locate from s: comma-separated tol=K, sad=B, mask.
+// Returns 0 if s is not such a list (a file name, say), leaving the values
+// unchanged.  Options not in s also leave them unchanged.
+static int parseLocate(const char* s, int* tol, long* sad, int* mask) {
+  int t = *tol, m = *mask;
+  long b = *sad;
+  const char* p = s;
+  do {
+    char* end = (char*)p;  // end of a valid option, or p
+    if (strncmp(p, "tol=", 4) == 0 && isdigit((unsigned char)p[4])) {
+      t = (int)strtol(p + 4, &end, 10);
+    } else if (strncmp(p, "sad=", 4) == 0 && isdigit((unsigned char)p[4])) {
+      b = strtol(p + 4, &end, 10);
+    } else if (strncmp(p, "mask", 4) == 0) {
+      m = 1;
+      end = (char*)p + 4;
+    }
+    if (end == p || (*end != ',' && *end != '\0')) return 0;
+    p = end;
+  } while (*p++ == ',');
+  *tol = t;
+  *sad = b;
+  *mask = m;
+  return 1;
+}
+
+// Does the operation av[k] take an operand?
+static int opOperand(int ac, char* av[], int k) {
+  const OpInfo* op = findOp(av[k]);
+  if (op == NULL) return 0;
+  if (strcmp(op->name, "locate") == 0) {  // optional
+    int tol = 0, mask = 0;
+    long sad = -1;
+    return k+1 < ac && parseLocate(av[k+1], &tol, &sad, &mask);
+  }
+  return op->operand;
+}
+
+// Number of images below CURR read by the operation av[k].
+static int opBelow(int ac, char* av[], int k) {
+  const OpInfo* op = findOp(av[k]);
+  if (op == NULL) return 0;
+  if (strcmp(op->name, "composite") == 0) {  // 2 images per position (2 numbers)
+    int commas = 0;
+    if (k+1 < ac) {
+      for (const char* p = av[k+1]; *p != '\0'; p++) commas += (*p == ',');
+    }
+    return commas + 1;
+  }
+  if (strcmp(op->name, "locate") == 0) {  // the mask is below PRED
+    int tol = 0, mask = 0;
+    long sad = -1;
+    if (k+1 < ac && parseLocate(av[k+1], &tol, &sad, &mask) && mask) return 2;
+  }
+  return op->below;
+}
+
+// Number of images at the end of the buffer used by the operation av[k]
+// (at least CURR, as it is likely to be used next).
+static int opUses(int ac, char* av[], int k) {
+  return opBelow(ac, av, k) + 1;
+}
+
+// Is image n-1 read by the operations from av[k] on, after an image is
+// appended to the n images in the buffer?  Called when an operation
+// creates an image from CURR: if not, that source is never used again,
+// and may be transformed in-place.
+// Later operations may reach deep below CURR (composite, say), so this
+// follows the whole pipeline.
+static int sourceUsed(int ac, char* av[], int k, int n) {
+  int src = n - 1;
+  int top = n + 1;  // images in the buffer
+  for (; k < ac; k++) {
+    const OpInfo* op = findOp(av[k]);
+    if (top - 1 - opBelow(ac, av, k) <= src) return 1;
+    if (op == NULL || op->creates) top++;
+    if (opOperand(ac, av, k)) k++;  // skip operand
+  }
+  return 0;
+}
+
+// Maximum number of weights in a kernel given as operand.
+#define KMAX 255
+
+// Parse a list of comma-separated weights from s into k[0..KMAX-1],
+// stopping at the end of the string or at a '/'.
+// Returns the number of weights read, or 0 if the list is invalid.
+// (*end) is set to the character after the list.
+static int parseKernel(const char* s, double k[], const char** end) {
+  int n = 0;
+  for (;;) {
+    char* e;
+    if (n >= KMAX) return 0;
+    k[n++] = strtod(s, &e);
+    if (e == s) return 0;
+    s = e;
+    if (*s != ',') break;
+    s++;
+  }
+  *end = s;
+  return n;
+}
+
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
 // precondition checks, so that you can force precondition violations, and
@@ -94,135 +516,588 @@ int main(int ac, char* av[]) {
   ImageInit();
 
   int err = 0;
+  const char* errMsg = NULL;   // error cause, if not that of this thread
   int x, y, w, h;
 
+  // Find stream operands: "save -" writes to stdout, other "-" read stdin.
+  int streamIn = 0;
+  int streamOut = 0;
+  for (int i = 1; i < ac; i++) {
+    if (strcmp(av[i], "-") != 0) continue;
+    if (i > 1 && strcmp(av[i-1], "save") == 0) streamOut = 1;
+    else if (i == 1 || strcmp(av[i-1], "tsave") != 0) streamIn = 1;
+  }
+  Queue inQ, outQ;
+  pthread_t reader, writer;
+  if (streamIn) {
+    queueInit(&inQ);
+    if (pthread_create(&reader, NULL, readFrames, &inQ) != 0) {
+      error(4, errno, errors[4], "Creating reader thread failed");
+    }
+  }
+  if (streamOut) {
+    // Frames go to the original stdout; any text output goes to stderr.
+    fflush(stdout);
+    frameOut = fdopen(dup(STDOUT_FILENO), "wb");
+    if (frameOut == NULL || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+      error(4, errno, errors[4], "Redirecting stdout failed");
+    }
+    queueInit(&outQ);
+    if (pthread_create(&writer, NULL, writeFrames, &outQ) != 0) {
+      error(4, errno, errors[4], "Creating writer thread failed");
+    }
+  }
+
   // The image buffer
-  const int N = 10;   // buffer capacity
+  const int N = NBUF; // buffer capacity
   Image img[N];     // the images
+  const char* lazy[N];  // file of each tiled image not yet loaded, or NULL
   int n = 0;          // number of images created
 
-  int k = 1;
-  while (k < ac) {
-    if (strcmp(av[k], "info") == 0) {
-      if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Info on I%d\n", n-1);
-      uint8 min, max;
-      w = ImageWidth(img[n-1]);
-      h = ImageHeight(img[n-1]);
-      uint8 maxval = ImageMaxval(img[n-1]);
-      ImageStats(img[n-1], &min, &max);
-      printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
-      printf("# Gray level range: [%hhu, %hhu]\n", min, max);
-    } else if (strcmp(av[k], "tic") == 0) {
-      InstrReset();
-    } else if (strcmp(av[k], "toc") == 0) {
-      InstrPrint();
-    } else if (strcmp(av[k], "neg") == 0) {
-      if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
-    } else if (strcmp(av[k], "thr") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      uint8 thr;
-      if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
-      fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
-    } else if (strcmp(av[k], "bri") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      double factor;
-      if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
-      fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
-    } else if (strcmp(av[k], "create") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n >= N) { err = 3; break; }
-      if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
-      if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
-      img[n] = ImageCreate(w, h, PixMax);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "rotate") == 0) {
-      if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
-      img[n] = ImageRotate(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "mirror") == 0) {
-      if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
-      img[n] = ImageMirror(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "crop") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
-      img[n] = ImageCrop(img[n-1], x, y, w, h);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "paste") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 2) { err = 2; break; }
-      if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
-      ImagePaste(img[n-1], x, y, img[n-2]);
-    } else if (strcmp(av[k], "blend") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 2) { err = 2; break; }
-      double alpha;
-      if (sscanf(av[k], "%d,%d,%lf", &x, &y, &alpha) != 3) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
-      ImageBlend(img[n-1], x, y, img[n-2], alpha);
-    } else if (strcmp(av[k], "locate") == 0) {
-      if (n < 2) { err = 2; break; }
-      fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
-      if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
-        printf("# FOUND (%d,%d)\n", x, y);
-      } else {
-        printf("# NOTFOUND\n");
+  // The frame stack, with the accumulators needed by the operations used
+  Stack stack = NULL;
+  int stackFlags = 0;
+  for (int i = 1; i < ac; i++) {
+    if (strcmp(av[i], "tmean") == 0) stackFlags |= STACK_SUM;
+    if (strcmp(av[i], "tmin") == 0 || strcmp(av[i], "tmax") == 0) stackFlags |= STACK_MINMAX;
+    if (strcmp(av[i], "tmedian") == 0 || strcmp(av[i], "bgsub") == 0) stackFlags |= STACK_HIST;
+  }
+
+  const char* env = getenv("IMAGETOOL_BUDGET");
+  if (env != NULL) spill.budget = (size_t)(strtod(env, NULL) * 1048576);
+
+  int frames = 0;     // number of frames read
+  int more = 1;       // cleared when the input stream ends
+  do {                // run the pipeline (once per input frame)
+    int k = 1;
+    while (k < ac) {
+      // Keep the images used by this operation, and spill others if needed.
+      int keep = opUses(ac, av, k);
+      spill.tick++;
+      for (int i = (n > keep) ? n - keep : 0; i < n; i++) spill.used[i] = spill.tick;
+      if (spill.budget > 0 && (errMsg = spillImages(img, lazy, n, keep)) != NULL) {
+        err = 4;
+        break;
+      }
+      // A deferred tiled CURR is loaded before being used, except by crop.
+      // (Operations that use PRED load it themselves.)
+      if (strcmp(av[k], "crop") != 0 && strcmp(av[k], "create") != 0 &&
+          strcmp(av[k], "tic") != 0 && strcmp(av[k], "toc") != 0 &&
+          strcmp(av[k], "threads") != 0 && strcmp(av[k], "budget") != 0) {
+        if (!materialize(img, lazy, n-1)) { err = 4; break; }
+      }
+      if (strcmp(av[k], "info") == 0) {
+        if (n < 1) { err = 2; break; }
+        fprintf(stderr, "Info on I%d\n", n-1);
+        uint8 min, max;
+        w = ImageWidth(img[n-1]);
+        h = ImageHeight(img[n-1]);
+        uint8 maxval = ImageMaxval(img[n-1]);
+        ImageStats(img[n-1], &min, &max);
+        printf("# Size: %dx%d%s\n# Maxval: %hhu\n", w, h,
+               ImageIsView(img[n-1]) ? " (view)" : "", maxval);
+        printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+      } else if (strcmp(av[k], "layout") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (n < 1) { err = 2; break; }
+        if (ImageIsView(img[n-1])) { err = 5; break; }   // precondition check!
+        Layout layout;
+        if (strcmp(av[k], "raster") == 0) layout = LAYOUT_RASTER;
+        else if (strcmp(av[k], "tiled") == 0) layout = LAYOUT_TILED;
+        else { err = 5; break; }
+        fprintf(stderr, "Changing I%d to %s layout\n", n-1, av[k]);
+        if (ImageSetLayout(img[n-1], layout) == 0) { err = 4; break; }
+      } else if (strcmp(av[k], "tic") == 0) {
+        InstrReset();
+      } else if (strcmp(av[k], "toc") == 0) {
+        InstrPrint();
+      } else if (strcmp(av[k], "threads") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        int nt;
+        if (sscanf(av[k], "%d", &nt) != 1 || nt < 0) { err = 5; break; }
+        ImageSetThreads(nt);
+        fprintf(stderr, "Using %d threads\n", ImageThreads());
+      } else if (strcmp(av[k], "budget") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        double mb;
+        if (sscanf(av[k], "%lf", &mb) != 1 || mb < 0.0) { err = 5; break; }
+        spill.budget = (size_t)(mb * 1048576);
+        fprintf(stderr, "Memory budget %g MB\n", mb);
+      } else if (strcmp(av[k], "neg") == 0) {
+        if (n < 1) { err = 2; break; }
+        fprintf(stderr, "Negating I%d\n", n-1);
+        if (!ImageNegative(img[n-1])) { err = 4; break; }
+      } else if (strcmp(av[k], "thr") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (n < 1) { err = 2; break; }
+        uint8 thr;
+        if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
+        fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
+        if (!ImageThreshold(img[n-1], (uint8)thr)) { err = 4; break; }
+      } else if (strcmp(av[k], "bri") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (n < 1) { err = 2; break; }
+        double factor;
+        if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
+        fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
+        if (!ImageBrighten(img[n-1], factor)) { err = 4; break; }
+      } else if (strcmp(av[k], "create") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (n >= N) { err = 3; break; }
+        if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
+        if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
+        fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
+        img[n] = ImageCreate(w, h, PixMax);
+        lazy[n] = NULL;
+        if (img[n] == NULL) { err = 4; break; }
+        n++;
+      } else if (strcmp(av[k], "clone") == 0) {
+        if (n < 1) { err = 2; break; }
+        if (n >= N) { err = 3; break; }
+        fprintf(stderr, "Cloning I%d -> I%d\n", n-1, n);
+        lazy[n] = NULL;
+        img[n] = ImageClone(img[n-1]);
+        if (img[n] == NULL) { err = 4; break; }
+        n++;
+      } else if (strcmp(av[k], "rotate") == 0) {
+        if (n < 1) { err = 2; break; }
+        if (n >= N) { err = 3; break; }
+        lazy[n] = NULL;
+        if (!ImageIsView(img[n-1]) && !sourceUsed(ac, av, k+1, n)) {  // source not needed
+          fprintf(stderr, "Rotating I%d in-place -> I%d\n", n-1, n);
+          if (!ImageRotateInPlace(img[n-1])) { err = 4; break; }
+          img[n] = img[n-1];
+          img[n-1] = NULL;
+          n++;
+          k++;
+          continue;
+        }
+        fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
+        img[n] = ImageRotate(img[n-1]);
+        if (img[n] == NULL) { err = 4; break; }
+        n++;
+      } else if (strcmp(av[k], "turn") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (n < 1) { err = 2; break; }
+        if (n >= N) { err = 3; break; }
+        double deg;
+        char name[16] = "bilinear";
+        int fill = 0;
+        if (sscanf(av[k], "%lf,%15[a-z],%d", &deg, name, &fill) < 1) { err = 5; break; }
+        Interp interp;
+        if (strcmp(name, "nearest") == 0) interp = INTERP_NEAREST;
+        else if (strcmp(name, "bilinear") == 0) interp = INTERP_BILINEAR;
+        else { err = 5; break; }
+        if (fill < 0 || fill > ImageMaxval(img[n-1])) { err = 5; break; }
+        lazy[n] = NULL;
+        double turns = fmod(deg / 90.0, 4.0);
+        if (turns < 0) turns += 4.0;
+        if (turns == floor(turns) && turns != 0.0 &&
+            !ImageIsView(img[n-1]) && !sourceUsed(ac, av, k+1, n)) {  // source not needed
+          fprintf(stderr, "Turning I%d by %.3f degrees in-place -> I%d\n", n-1, deg, n);
+          int ok = (turns == 2.0) ? ImageRotate180InPlace(img[n-1]) :
+                   ImageRotateInPlace(img[n-1]) &&
+                   (turns == 1.0 || ImageRotate180InPlace(img[n-1]));
+          if (!ok) { err = 4; break; }
+          img[n] = img[n-1];
+          img[n-1] = NULL;
+          n++;
+          k++;
+          continue;
+        }
+        fprintf(stderr, "Turning I%d by %.3f degrees (%s) -> I%d\n", n-1, deg, name, n);
+        img[n] = ImageRotateAngle(img[n-1], deg, interp, (uint8)fill);
+        if (img[n] == NULL) { err = 4; break; }
+        n++;
+      } else if (strcmp(av[k], "mirror") == 0) {
+        if (n < 1) { err = 2; break; }
+        if (n >= N) { err = 3; break; }
+        lazy[n] = NULL;
+        if (!ImageIsView(img[n-1]) && !sourceUsed(ac, av, k+1, n)) {  // source not needed
+          fprintf(stderr, "Mirroring I%d in-place -> I%d\n", n-1, n);
+          if (!ImageMirrorInPlace(img[n-1])) { err = 4; break; }
+          img[n] = img[n-1];
+          img[n-1] = NULL;
+          n++;
+          k++;
+          continue;
+        }
+        fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
+        img[n] = ImageMirror(img[n-1]);
+        if (img[n] == NULL) { err = 4; break; }
+        n++;
+      } else if (strcmp(av[k], "crop") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (n < 1) { err = 2; break; }
+        if (n >= N) { err = 3; break; }
+        if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+        lazy[n] = NULL;
+        if (lazy[n-1] != NULL) {  // read only the tiles needed
+          fprintf(stderr, "Cropping %s (%d,%d,%d,%d) -> I%d\n", lazy[n-1], x, y, w, h, n);
+          img[n] = ImageLoadRegion(lazy[n-1], x, y, w, h);
+          if (img[n] == NULL) { err = 4; break; }
+          n++;
+          k++;
+          continue;
+        }
+        if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
+        fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+        img[n] = ImageCrop(img[n-1], x, y, w, h);
+        if (img[n] == NULL) { err = 4; break; }
+        n++;
+      } else if (strcmp(av[k], "view") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (n < 1) { err = 2; break; }
+        if (n >= N) { err = 3; break; }
+        if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+        if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
+        fprintf(stderr, "Viewing I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+        lazy[n] = NULL;
+        img[n] = ImageView(img[n-1], x, y, w, h);
+        if (img[n] == NULL) { err = 4; break; }
+        n++;
+      } else if (strcmp(av[k], "resize") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (n < 1) { err = 2; break; }
+        if (n >= N) { err = 3; break; }
+        char name[16] = "area";
+        if (sscanf(av[k], "%d,%d,%15s", &w, &h, name) < 2) { err = 5; break; }
+        Interp interp;
+        if (strcmp(name, "nearest") == 0) interp = INTERP_NEAREST;
+        else if (strcmp(name, "bilinear") == 0) interp = INTERP_BILINEAR;
+        else if (strcmp(name, "area") == 0) interp = INTERP_AREA;
+        else { err = 5; break; }
+        if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
+        if ((size_t)w * h > 0 && (size_t)ImageWidth(img[n-1]) * ImageHeight(img[n-1]) == 0) { err = 5; break; }
+        fprintf(stderr, "Resizing I%d to %dx%d (%s) -> I%d\n", n-1, w, h, name, n);
+        lazy[n] = NULL;
+        img[n] = ImageResize(img[n-1], w, h, interp);
+        if (img[n] == NULL) { err = 4; break; }
+        n++;
+      } else if (strcmp(av[k], "paste") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (n < 2) { err = 2; break; }
+        if (!materialize(img, lazy, n-2)) { err = 4; break; }
+        if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
+        w = ImageWidth(img[n-2]);
+        h = ImageHeight(img[n-2]);
+        if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
+        fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
+        if (!ImagePaste(img[n-1], x, y, img[n-2])) { err = 4; break; }
+      } else if (strcmp(av[k], "blend") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (n < 2) { err = 2; break; }
+        if (!materialize(img, lazy, n-2)) { err = 4; break; }
+        double alpha;
+        if (sscanf(av[k], "%d,%d,%lf", &x, &y, &alpha) != 3) { err = 5; break; }
+        w = ImageWidth(img[n-2]);
+        h = ImageHeight(img[n-2]);
+        if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
+        fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
+        if (!ImageBlend(img[n-1], x, y, img[n-2], alpha)) { err = 4; break; }
+      } else if (strcmp(av[k], "composite") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        int pos[2*N];
+        int K = 0;
+        char* end;
+        const char* p = av[k];
+        do {
+          if (K >= 2*N) { err = 5; break; }
+          pos[K++] = (int)strtol(p, &end, 10);
+          if (end == p) { err = 5; break; }
+          p = end + 1;
+        } while (*end == ',');
+        if (err != 0) break;
+        if (*end != '\0' || K % 2 != 0) { err = 5; break; }
+        K /= 2;
+        if (n < 2*K + 1) { err = 2; break; }
+        Image layers[N], masks[N];
+        for (int i = 0; i < K; i++) {
+          int m = n-1 - 2*K + 2*i;
+          if (!materialize(img, lazy, m) || !materialize(img, lazy, m+1)) { err = 4; break; }
+          masks[i] = img[m];
+          layers[i] = img[m+1];
+          if (ImageWidth(masks[i]) != ImageWidth(layers[i]) ||
+              ImageHeight(masks[i]) != ImageHeight(layers[i])) { err = 5; break; }  // precondition check!
+          fprintf(stderr, "Compositing I%d with mask I%d into I%d@(%d,%d)\n",
+                  m+1, m, n-1, pos[2*i], pos[2*i+1]);
+        }
+        if (err != 0) break;
+        if (!ImageComposite(img[n-1], layers, masks, pos, K)) { err = 4; break; }
+      } else if (strcmp(av[k], "locate") == 0) {
+        if (n < 2) { err = 2; break; }
+        if (!materialize(img, lazy, n-2)) { err = 4; break; }
+        // Options, if the next argument has them
+        int tol = 0;
+        long sad = -1;
+        int useMask = 0;
+        if (k+1 < ac && parseLocate(av[k+1], &tol, &sad, &useMask)) {
+          k++;
+          if (tol < 0 || tol > PixMax || sad < -1) { err = 5; break; }  // precondition check!
+        }
+        Image mask = NULL;
+        if (useMask) {
+          if (n < 3) { err = 2; break; }
+          if (!materialize(img, lazy, n-3)) { err = 4; break; }
+          mask = img[n-3];
+          if (ImageWidth(mask) != ImageWidth(img[n-2]) ||
+              ImageHeight(mask) != ImageHeight(img[n-2])) { err = 5; break; }  // precondition check!
+        }
+        int found;
+        if (tol == 0 && sad < 0 && mask == NULL) {
+          fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
+          found = ImageLocateSubImage(img[n-1], &x, &y, img[n-2]);
+        } else {
+          fprintf(stderr, "Locating I%d in I%d with tol=%d", n-2, n-1, tol);
+          if (sad >= 0) fprintf(stderr, ", sad=%ld", sad);
+          if (mask != NULL) fprintf(stderr, ", mask I%d", n-3);
+          fprintf(stderr, "\n");
+          found = ImageLocateSubImageTol(img[n-1], &x, &y, img[n-2], mask, tol, sad);
+        }
+        if (found) {
+          printf("# FOUND (%d,%d)\n", x, y);
+        } else {
+          printf("# NOTFOUND\n");
+        }
+      } else if (strcmp(av[k], "equal") == 0) {
+        if (n < 2) { err = 2; break; }
+        if (!materialize(img, lazy, n-2)) { err = 4; break; }
+        fprintf(stderr, "Comparing I%d with I%d\n", n-2, n-1);
+        printf("# %s\n", ImageEqual(img[n-2], img[n-1]) ? "EQUAL" : "DIFFERENT");
+      } else if (strcmp(av[k], "diff") == 0 || strcmp(av[k], "psnr") == 0 ||
+                 strcmp(av[k], "ssim") == 0) {
+        const char* op = av[k];
+        int r = 0;
+        if (op[0] == 's') {
+          if (++k >= ac) { err = 1; break; }
+          if (sscanf(av[k], "%d", &r) != 1 || r < 0) { err = 5; break; }
+        }
+        if (n < 2) { err = 2; break; }
+        if (!materialize(img, lazy, n-2)) { err = 4; break; }
+        if (ImageWidth(img[n-2]) != ImageWidth(img[n-1]) ||
+            ImageHeight(img[n-2]) != ImageHeight(img[n-1])) { err = 5; break; }   // precondition check!
+        if (op[0] == 'd') {
+          if (n >= N) { err = 3; break; }
+          lazy[n] = NULL;
+          fprintf(stderr, "Differencing I%d and I%d -> I%d\n", n-2, n-1, n);
+          img[n] = ImageAbsDiff(img[n-2], img[n-1]);
+          if (img[n] == NULL) { err = 4; break; }
+          n++;
+        } else if (op[0] == 'p') {
+          fprintf(stderr, "PSNR of I%d relative to I%d\n", n-1, n-2);
+          printf("# PSNR: %.4f dB\n", ImagePSNR(img[n-2], img[n-1]));
+        } else {
+          fprintf(stderr, "SSIM of I%d and I%d with %dx%d windows\n", n-2, n-1, 2*r+1, 2*r+1);
+          double ssim;
+          if (!ImageSSIM(img[n-2], img[n-1], r, &ssim)) { err = 4; break; }
+          printf("# SSIM: %.6f\n", ssim);
+        }
+      } else if (strcmp(av[k], "blur") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (n < 1) { err = 2; break; }
+        static const char* methods[] = { "auto", "direct", "sat", "running" };
+        int dx; int dy;
+        char name[16] = "auto";
+        if (sscanf(av[k], "%d,%d,%15s", &dx, &dy, name) < 2) { err = 5; break; }
+        if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+        BlurMethod method = BLUR_AUTO;
+        while (method <= BLUR_RUNNING && strcmp(name, methods[method]) != 0) method++;
+        if (method > BLUR_RUNNING) { err = 5; break; }
+        ImageSetBlurMethod(method);
+        method = ImageBlurMethod(ImageWidth(img[n-1]), ImageHeight(img[n-1]), dx, dy);
+        fprintf(stderr, "Blur I%d with %dx%d mean filter (%s)\n", n-1, 2*dx+1, 2*dy+1, methods[method]);
+        int ok = ImageBlur(img[n-1], dx, dy);
+        ImageSetBlurMethod(BLUR_AUTO);
+        if (!ok) { err = 4; break; }
+      } else if (strcmp(av[k], "median") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (n < 1) { err = 2; break; }
+        int dx; int dy;
+        if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+        if (dx < 0 || dy < 0 || dy >= 32768) { err = 5; break; }   // precondition check!
+        fprintf(stderr, "Median I%d with %dx%d filter\n", n-1, 2*dx+1, 2*dy+1);
+        if (!ImageMedian(img[n-1], dx, dy)) { err = 4; break; }
+      } else if (strcmp(av[k], "erode") == 0 || strcmp(av[k], "dilate") == 0 ||
+                 strcmp(av[k], "open") == 0 || strcmp(av[k], "close") == 0) {
+        const char* op = av[k];
+        if (++k >= ac) { err = 1; break; }
+        if (n < 1) { err = 2; break; }
+        int dx; int dy;
+        if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+        if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+        fprintf(stderr, "Applying %s to I%d with %dx%d rectangle\n", op, n-1, 2*dx+1, 2*dy+1);
+        int ok = (op[0] == 'e') ? ImageErode(img[n-1], dx, dy) :
+                 (op[0] == 'd') ? ImageDilate(img[n-1], dx, dy) :
+                 (op[0] == 'o') ? ImageOpen(img[n-1], dx, dy) :
+                                  ImageClose(img[n-1], dx, dy);
+        if (!ok) { err = 4; break; }
+      } else if (strcmp(av[k], "label") == 0) {
+        if (n < 1) { err = 2; break; }
+        fprintf(stderr, "Labeling components of I%d\n", n-1);
+        int nc;
+        Component* stats;
+        if (!ImageLabel(img[n-1], &nc, NULL, &stats)) { err = 4; break; }
+        printf("# Components: %d\n", nc);
+        for (int i = 1; i <= nc; i++) {
+          printf("# %d: area %ld, box %d,%d,%d,%d\n", i, stats[i].area, stats[i].x0,
+                 stats[i].y0, stats[i].x1 - stats[i].x0 + 1, stats[i].y1 - stats[i].y0 + 1);
+        }
+        free(stats);
+      } else if (strcmp(av[k], "dist") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (n < 1) { err = 2; break; }
+        double scale;
+        if (sscanf(av[k], "%lf", &scale) != 1 || scale < 0.0) { err = 5; break; }   // precondition check!
+        fprintf(stderr, "Distance transform of I%d, scaled by %g\n", n-1, scale);
+        if (!ImageDistanceMap(img[n-1], scale)) { err = 4; break; }
+      } else if (strcmp(av[k], "gauss") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (n < 1) { err = 2; break; }
+        double sigma;
+        if (sscanf(av[k], "%lf", &sigma) != 1 || sigma <= 0.0) { err = 5; break; }
+        int nk;
+        double* kernel = ImageGaussianKernel(sigma, &nk);
+        if (kernel == NULL) { err = 4; break; }
+        fprintf(stderr, "Gaussian smoothing I%d with sigma=%.3f (%d taps)\n", n-1, sigma, nk);
+        int ok = ImageConvolveSeparable(img[n-1], kernel, nk, kernel, nk);
+        free(kernel);
+        if (!ok) { err = 4; break; }
+      } else if (strcmp(av[k], "conv") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (n < 1) { err = 2; break; }
+        double kx[KMAX], ky[KMAX];
+        const char* end;
+        int nkx = parseKernel(av[k], kx, &end);
+        if (nkx == 0 || *end != '/') { err = 5; break; }
+        int nky = parseKernel(end + 1, ky, &end);
+        if (nky == 0 || *end != '\0') { err = 5; break; }
+        if (nkx % 2 == 0 || nky % 2 == 0) { err = 5; break; }   // precondition check!
+        double sx = 0.0, sy = 0.0;
+        for (int i = 0; i < nkx; i++) sx += fabs(kx[i]);
+        for (int i = 0; i < nky; i++) sy += fabs(ky[i]);
+        if (sx > 8.0 || sy > 8.0) { err = 5; break; }   // precondition check!
+        fprintf(stderr, "Convolving I%d with %dx%d separable kernel\n", n-1, nkx, nky);
+        if (!ImageConvolveSeparable(img[n-1], kx, nkx, ky, nky)) { err = 4; break; }
+      } else if (strcmp(av[k], "stack") == 0) {
+        if (n < 1) { err = 2; break; }
+        w = ImageWidth(img[n-1]);
+        h = ImageHeight(img[n-1]);
+        if (stack == NULL) {
+          fprintf(stderr, "Creating frame stack (%d,%d)\n", w, h);
+          stack = StackCreate(w, h, stackFlags);
+          if (stack == NULL) { err = 4; break; }
+        }
+        if (w != StackWidth(stack) || h != StackHeight(stack)) { err = 5; break; }   // precondition check!
+        fprintf(stderr, "Stacking I%d (frame %ld)\n", n-1, StackCount(stack));
+        StackAdd(stack, img[n-1]);
+      } else if (strcmp(av[k], "tmean") == 0 || strcmp(av[k], "tmedian") == 0 ||
+                 strcmp(av[k], "tmin") == 0 || strcmp(av[k], "tmax") == 0) {
+        if (stack == NULL || StackCount(stack) == 0) { err = 2; break; }
+        if (n >= N) { err = 3; break; }
+        fprintf(stderr, "Stack %s of %ld frames -> I%d\n", av[k] + 1, StackCount(stack), n);
+        lazy[n] = NULL;
+        img[n] = (strcmp(av[k], "tmean") == 0) ? StackMean(stack) :
+                 (strcmp(av[k], "tmedian") == 0) ? StackMedian(stack) :
+                 (strcmp(av[k], "tmin") == 0) ? StackMin(stack) :
+                                                StackMax(stack);
+        if (img[n] == NULL) { err = 4; break; }
+        n++;
+      } else if (strcmp(av[k], "bgsub") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (n < 1) { err = 2; break; }
+        if (stack == NULL || StackCount(stack) == 0) { err = 2; break; }
+        int thr;
+        if (sscanf(av[k], "%d", &thr) != 1 || thr < 0) { err = 5; break; }   // precondition check!
+        if (ImageWidth(img[n-1]) != StackWidth(stack) ||
+            ImageHeight(img[n-1]) != StackHeight(stack)) { err = 5; break; }   // precondition check!
+        fprintf(stderr, "Subtracting stack median from I%d, threshold %d\n", n-1, thr);
+        Image bg = StackMedian(stack);
+        if (bg == NULL) { err = 4; break; }
+        int ok = ImageSubtractBackground(img[n-1], bg, thr);
+        ImageDestroy(&bg);
+        if (!ok) { err = 4; break; }
+      } else if (strcmp(av[k], "save") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (n < 1) { err = 2; break; }
+        if (strcmp(av[k], "-") == 0) {  // queue a clone for the writer
+          fprintf(stderr, "Writing frame <- I%d\n", n-1);
+          Image copy = ImageClone(img[n-1]);
+          if (copy == NULL) { err = 4; break; }
+          int ok = queuePush(&outQ, copy);
+          assert (ok);  // never closed before the end
+          (void)ok;     // (unused when compiled with NDEBUG)
+          k++;
+          continue;
+        }
+        fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
+        if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      } else if (strcmp(av[k], "tsave") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (n < 1) { err = 2; break; }
+        if (strcmp(av[k], "-") == 0) { err = 5; break; }   // not streamable
+        fprintf(stderr, "Saving tiled %s <- I%d\n", av[k], n-1);
+        if (ImageSaveTiled(img[n-1], av[k], TILE) == 0) { err = 4; break; }
+      } else {  // image file
+        if (n >= N) { err = 3; break; }
+        lazy[n] = NULL;
+        if (strcmp(av[k], "-") == 0) {  // next frame from stdin
+          img[n] = queuePop(&inQ);
+          if (img[n] == NULL) {  // end of input
+            more = 0;
+            if (inQ.errMsg != NULL) { err = 4; errMsg = inQ.errMsg; }
+            break;
+          }
+          fprintf(stderr, "Reading frame %d -> I%d\n", frames++, n);
+          n++;
+          k++;
+          continue;
+        }
+        if (ImageProbeTiled(av[k], &w, &h)) {  // defer loading
+          fprintf(stderr, "Opening tiled %s (%dx%d) -> I%d\n", av[k], w, h, n);
+          img[n] = NULL;
+          lazy[n] = av[k];
+          n++;
+          k++;
+          continue;
+        }
+        fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
+        img[n] = ImageLoad(av[k]);
+        if (img[n] == NULL) { err = 4; break; }
+        n++;
       }
-    } else if (strcmp(av[k], "blur") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      int dx; int dy;
-      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
-      fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
-    } else if (strcmp(av[k], "save") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
-    } else {  // image file
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      k++;
     }
-    k++;
+
+    // Destroy remaining images
+    while (n > 0) {
+      dropSpill(--n);
+      ImageDestroy(&img[n]);
+    }
+  } while (streamIn && more && err == 0);
+  StackDestroy(&stack);
+
+  if (streamIn) {
+    // If the input did not end, the reader is left behind (maybe blocked
+    // reading stdin), but it will not queue any more frames.
+    queueClose(&inQ, NULL);
+    if (!more) pthread_join(reader, NULL);
+    Image frame;
+    while ((frame = queuePop(&inQ)) != NULL) ImageDestroy(&frame);
   }
-  
-  // Destroy remaining images
-  while (n > 0) {
-    ImageDestroy(&img[--n]);
+  if (streamOut) {
+    queueClose(&outQ, NULL);
+    pthread_join(writer, NULL);
+    if (outQ.errMsg != NULL && err == 0) { err = 4; errMsg = outQ.errMsg; }
+    fclose(frameOut);
+  }
+
+  if (spill.spills > 0) {
+    fprintf(stderr, "# Spilled %lu images (%.1f MB), restored %lu (%.1f MB)\n",
+            spill.spills, spill.spilled / 1048576.0, spill.restores, spill.restored / 1048576.0);
   }
 
-  error(err, errno, errors[err], ImageErrMsg());
+  if (errMsg == NULL) errMsg = ImageErrMsg();
+  error(err, errno, errors[err], errMsg);
   return 0;
 }
 
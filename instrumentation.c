@@ -18,8 +18,14 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// Counters and reset time are kept per thread, so threads never race on
+/// them.  A thread adds its counts to the shared totals with InstrFlush
+/// (typically, just before it ends), and InstrPrint/InstrTotal report the
+/// shared totals plus the counts of the calling thread.
 
 #include "instrumentation.h"
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -68,16 +74,19 @@ double cpu_time(void) {
 
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (of the calling thread):
+_Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
+
+// Counts flushed by all threads.
+static atomic_ulong InstrShared[NUMCOUNTERS];
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
     // All elements initialized to NULL
     // See: https://en.cppreference.com/w/c/language/array_initialization
 
-/// Cpu_time read on previous reset (~seconds)
-double InstrTime;  ///extern
+/// Cpu_time read on previous reset by the calling thread (~seconds)
+_Thread_local double InstrTime;  ///extern
 
 /// Calibrated Time Unit (in seconds, initially 1s)
 double InstrCTU = 1.0;  ///extern
@@ -101,15 +110,36 @@ void InstrCalibrate(void) { ///
   InstrCTU = cpu_time() - time;
 }
 
-/// Reset counters to zero and store cpu_time.
+/// Reset counters (and shared totals) to zero and store cpu_time.
 void InstrReset(void) { ///
-  for (int i = 0; i < NUMCOUNTERS; i++)
+  for (int i = 0; i < NUMCOUNTERS; i++) {
     InstrCount[i] = 0ul;
+    atomic_store(&InstrShared[i], 0ul);
+  }
   InstrTime = cpu_time();
 }
 
+/// Add the counters of the calling thread to the shared totals,
+/// and set them to zero.
+void InstrFlush(void) { ///
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    if (InstrCount[i] != 0ul) {
+      atomic_fetch_add(&InstrShared[i], InstrCount[i]);
+      InstrCount[i] = 0ul;
+    }
+  }
+}
+
+/// Get the shared totals plus the counters of the calling thread.
+void InstrTotal(unsigned long total[NUMCOUNTERS]) { ///
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    total[i] = atomic_load(&InstrShared[i]) + InstrCount[i];
+}
+
 // Print times and all named counter values
 void InstrPrint(void) { ///
+  unsigned long total[NUMCOUNTERS];
+  InstrTotal(total);
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
   // compute time in calibrated time units:
@@ -123,7 +153,7 @@ void InstrPrint(void) { ///
   printf("%15.6f\t%15.6f", time, caltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
+      printf("\t%15lu", total[i]);  
   puts("");
 }
 
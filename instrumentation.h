@@ -18,6 +18,11 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// Counters and reset time are kept per thread, so threads never race on
+/// them.  A thread adds its counts to the shared totals with InstrFlush
+/// (typically, just before it ends), and InstrPrint/InstrTotal report the
+/// shared totals plus the counts of the calling thread.
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
@@ -28,14 +33,14 @@ double cpu_time(void) ; ///
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (of the calling thread):
+extern _Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
 
-/// Cpu_time read on previous reset (~seconds)
-extern double InstrTime;  ///extern
+/// Cpu_time read on previous reset by the calling thread (~seconds)
+extern _Thread_local double InstrTime;  ///extern
 
 /// Calibrated Time Unit (in seconds, initially 1s)
 extern double InstrCTU;  ///extern
@@ -45,9 +50,17 @@ extern double InstrCTU;  ///extern
 /// a reasonably cpu-independent time unit.
 void InstrCalibrate(void) ;
 
-/// Reset counters to zero and store cpu_time.
+/// Reset counters (and shared totals) to zero and store cpu_time.
 void InstrReset(void) ;
 
+/// Add the counters of the calling thread to the shared totals,
+/// and set them to zero.
+void InstrFlush(void) ;
+
+/// Get the shared totals plus the counters of the calling thread.
+void InstrTotal(unsigned long total[NUMCOUNTERS]) ;
+
+/// Print time and all named counter values (as given by InstrTotal).
 void InstrPrint(void) ;
 
 #endif